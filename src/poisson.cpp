@@ -3,6 +3,9 @@
 #include <string.h>
 #include <stdio.h>
 #include <math.h>
+#include <unistd.h>
+
+#include "poisson.hpp"
 
 #define STORE 	res -= ta->delta * ta->delta * ta->source[((z * ta->ysize) + y) * ta->xsize + x]; \
 				res /= 6; \
@@ -20,10 +23,36 @@
 #define X_MID	res += ta->input[(( (z) * ta->ysize) + y ) * ta->xsize + (x + 1)] + ta->input[(( (z) * ta->ysize) + y ) * ta->xsize + (x - 1)];
 #define X_MAX	res += ta->input[((z * ta->ysize) + y) * ta->xsize + (x - 1)] + ta->Vbound;
 
-pthread_barrier_t  barrier; // the barrier synchronization object
-
 void *thread(void* args);
 
+// Interior sweep of planes [z0, z1]: every voxel with 0 < x < xs - 1
+// and 0 < y < ys - 1, none of which touch the boundary.  The neighbour rows
+// are set up once per row, so the inner loop is seven loads through
+// restrict pointers rather than seven index calculations.
+static void interior (const double *__restrict__ in, const double *__restrict__ source,
+                      double *__restrict__ out, double d2,
+                      unsigned int xs, unsigned int ys, unsigned int z0, unsigned int z1)
+{
+	const size_t plane = (size_t)xs * ys;
+
+	for (unsigned int z = z0; z < z1 + 1; z++) {
+		for (unsigned int y = 1; y < ys - 1; y++) {
+			const size_t row = z * plane + (size_t)y * xs;
+			const double *__restrict__ c = in + row;
+			const double *__restrict__ yp = c + xs;
+			const double *__restrict__ ym = c - xs;
+			const double *__restrict__ zp = c + plane;
+			const double *__restrict__ zm = c - plane;
+			const double *__restrict__ s = source + row;
+			double *__restrict__ o = out + row;
+			for (unsigned int x = 1; x < xs - 1; x++) {
+				double res = c[x + 1] + c[x - 1] + yp[x] + ym[x] + zp[x] + zm[x];
+				o[x] = (res - d2 * s[x]) / 6;
+			}
+		}
+	}
+}
+
 // structure we're going to use for arguments to our pthread functions
 struct thread_args {
 	double *__restrict__ source;
@@ -40,6 +69,7 @@ struct thread_args {
 	unsigned int numcores;
 	unsigned int block_size;
 	size_t size;
+	pthread_barrier_t *barrier; // shared by the threads of one solve
 	pthread_t thread;
 	FILE *ptr;
 	
@@ -64,7 +94,23 @@ void poisson_dirichlet (double * __restrict__ source,
                         unsigned int numiters, unsigned int numcores)
 {
 	// How many threads should we create?
+	if (numcores == 0) {
+		numcores = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+
+	// Only split across x and y when that gives less halo surface than
+	// z-slabs, e.g. when there are many cores for few planes
+	struct poisson_block blocks[numcores];
+	unsigned int dims[3];
+	numcores = poisson_decompose(numcores, xsize, ysize, zsize, dims, blocks);
+	if (dims[0] * dims[1] > 1) {
+		poisson_dirichlet_blocks(source, potential, Vbound, xsize, ysize, zsize, delta,
+								 numiters, numcores);
+		return;
+	}
 	struct thread_args ta[numcores];
+	// Local to this call so that several solves can run at once
+	pthread_barrier_t barrier;
 	
     // source[i, j, k] is accessed with source[((k * ysize) + j) * xsize + i]
     // potential[i, j, k] is accessed with potential[((k * ysize) + j) * xsize + i]    
@@ -82,16 +128,6 @@ void poisson_dirichlet (double * __restrict__ source,
 	}
 	memcpy(input, source, size);
 
-	unsigned int remainder = 0;
-	unsigned int block_size = 0;
-	if ((zsize % numcores) >= 1) {
-		block_size = floor(zsize / numcores);
-		remainder = zsize % numcores;
-	}
-	else {
-		block_size = zsize / numcores;
-	}
-	
 	pthread_barrier_init (&barrier, NULL, numcores);
 
 	// Split up the incoming data, and spawn the threads
@@ -104,17 +140,13 @@ void poisson_dirichlet (double * __restrict__ source,
 		ta[i].ysize 	= ysize;
 		ta[i].zsize 	= zsize;
 		ta[i].delta 	= delta;
-		ta[i].zstart 	= i * block_size;
+		ta[i].zstart 	= blocks[i].z0;
+		ta[i].zend 		= blocks[i].z1 - 1;
 		ta[i].numiters 	= numiters;
 		ta[i].numcores 	= numcores;
 		ta[i].size 		= size;
 		ta[i].ptr 		= ptr;
-		
-		if (i == numcores - 1) {
-			ta[i].zend = (i * block_size) + (block_size - 1) + remainder;
-		} else {
-			ta[i].zend = (i * block_size) + (block_size - 1);
-		}
+		ta[i].barrier 	= &barrier;
 		
 		if (pthread_create(&ta[i].thread, NULL, thread, (void *)&ta[i]) < 0) {
 			fprintf(stderr, "Could not create thread %d\n", i);
@@ -137,6 +169,7 @@ void poisson_dirichlet (double * __restrict__ source,
 		//~ }
 	//~ }
 	
+	pthread_barrier_destroy(&barrier);
 	fclose(ptr);
 	free(input);
 }
@@ -145,6 +178,11 @@ void poisson_dirichlet (double * __restrict__ source,
 void *thread(void* args) {
 	
 	struct thread_args *ta = (struct thread_args*)args;
+	// Planes this thread copies out at the end, before zstart/zend are
+	// narrowed to the interior
+	size_t plane = (size_t)ta->xsize * ta->ysize;
+	size_t first = ta->zstart * plane;
+	size_t count = (ta->zend + 1 - ta->zstart) * plane;
 	unsigned int is_zmin = 0;
 	//~ unsigned int is_zmax = 0;
 	if (ta->zstart == 0) {
@@ -156,29 +194,14 @@ void *thread(void* args) {
 			ta->zend--;
 		}
 	
+	const double d2 = ta->delta * ta->delta;
+
 	for (unsigned int iter = 0; iter < ta->numiters; iter++) {
 		double res = 0;
 
 		// Loop through general cases (i.e. 0 < x,y,z < maximum) having dealt with zero and maximum seperately
 		//  Means no condition checking in loops
-		for (unsigned int z = ta->zstart; z < ta->zend + 1; z++) {
-			for (unsigned int y = 1; y < ta->ysize - 1; y++) {
-				for  (unsigned int x = 1; x < ta->xsize - 1; x++) {
-					res = 0;
-					
-					res += ta->input[(( (z) * ta->ysize) + y ) * ta->xsize + (x + 1)];
-					res += ta->input[(( (z) * ta->ysize) + y ) * ta->xsize + (x - 1)];
-
-					res += ta->input[( (z * ta->ysize) + (y + 1) ) * ta->xsize + x];
-					res += ta->input[( (z * ta->ysize) + (y - 1) ) * ta->xsize + x];
-
-					res += ta->input[(( (z + 1) * ta->ysize) + y) * ta->xsize + x];
-					res += ta->input[(( (z - 1) * ta->ysize) + y) * ta->xsize + x];
-						
-					STORE;
-				}
-			}
-		}
+		interior(ta->input, ta->source, ta->potential, d2, ta->xsize, ta->ysize, ta->zstart, ta->zend);
 		
 		//x y z'
 		if (is_zmin) {
@@ -402,11 +425,11 @@ void *thread(void* args) {
 		ta->potential = temp;
 		
 		
-		pthread_barrier_wait (&barrier);
+		pthread_barrier_wait (ta->barrier);
 	}
 	
 	if (ta->numiters % 2 == 0) {
-		memcpy(ta->potential, ta->input, ta->size);
+		memcpy(ta->potential + first, ta->input + first, count * sizeof(double));
 	}
 	
 	pthread_exit(NULL);
@@ -1,6 +1,9 @@
 #ifndef POISSON_H
 #define POISSON_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 // Solve Poisson's equation for a rectangular box with Dirichlet
 // boundary conditions on each face.
 void poisson_dirichlet (double *__restrict__ source,
@@ -8,4 +11,296 @@ void poisson_dirichlet (double *__restrict__ source,
                         double Vbound,
                         unsigned int xsize, unsigned int ysize, unsigned int zsize,
                         double delta, unsigned int maxiters, unsigned int numcores);
+
+// Solve Poisson's equation for nrhs sources on the same box at once.
+void poisson_dirichlet_batch (double *const *sources,
+                              double *const *potentials,
+                              unsigned int nrhs,
+                              double Vbound,
+                              unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                              double delta, unsigned int maxiters, unsigned int numcores);
+
+// Extent of one worker's block, [x0, x1) x [y0, y1) x [z0, z1)
+struct poisson_block {
+    unsigned int x0, x1;
+    unsigned int y0, y1;
+    unsigned int z0, z1;
+};
+
+// Split the box into a dims[0] x dims[1] x dims[2] grid of at most numcores
+// blocks with the least halo surface.  Returns the number of blocks.
+unsigned int poisson_decompose (unsigned int numcores,
+                                unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                                unsigned int dims[3], struct poisson_block *blocks);
+
+// Solve Poisson's equation with one worker per block of poisson_decompose.
+void poisson_dirichlet_blocks (double *__restrict__ source,
+                               double *__restrict__ potential,
+                               double Vbound,
+                               unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                               double delta, unsigned int maxiters, unsigned int numcores);
+
+// Mirror planes through the middle of the box, for poisson_symmetry
+#define POISSON_MIRROR_X 1
+#define POISSON_MIRROR_Y 2
+#define POISSON_MIRROR_Z 4
+
+// Find which mirror planes the source is exactly symmetric under.
+unsigned int poisson_symmetry (const double *source,
+                               unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                               unsigned int numcores);
+
+// Solve Poisson's equation on the part of the box left after the mirror
+// symmetries of the source, and unfold the result.  Returns the mirrors used.
+unsigned int poisson_dirichlet_symmetric (double *__restrict__ source,
+                                          double *__restrict__ potential,
+                                          double Vbound,
+                                          unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                                          double delta, unsigned int maxiters, unsigned int numcores);
+
+// Solve Poisson's equation by iterative refinement, with the residual and
+// iterate in double and inner sweeps of the correction in float.  Returns
+// the sweeps performed.
+unsigned int poisson_dirichlet_mixed (double *__restrict__ source,
+                                      double *__restrict__ potential,
+                                      double Vbound,
+                                      unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                                      double delta, unsigned int maxiters, unsigned int inner,
+                                      double tolerance, unsigned int numcores);
+
+// Solve Poisson's equation on voxels spaced dx, dy and dz apart.  Cubic
+// voxels are handed to poisson_dirichlet.
+void poisson_dirichlet_aniso (double *__restrict__ source,
+                              double *__restrict__ potential,
+                              double Vbound,
+                              unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                              double dx, double dy, double dz,
+                              unsigned int maxiters, unsigned int numcores);
+
+// Merge overlapping or touching boxes until none overlap or touch.
+void poisson_merge_blocks (struct poisson_block *blocks, unsigned int *nblocks);
+
+// Re-solve from the previous potential after the source changed only in
+// the edit boxes, relaxing regions around the edits that grow only while
+// the updates reaching their faces exceed tolerance.
+unsigned int poisson_resolve_local (double *__restrict__ source,
+                                    double *__restrict__ potential,
+                                    double Vbound,
+                                    unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                                    double delta,
+                                    const struct poisson_block *edits, unsigned int nedits,
+                                    unsigned int maxiters, double tolerance, unsigned int numcores);
+
+// Solve Poisson's equation as a dataflow graph of tiles run by
+// work-stealing workers instead of lock-step z-slabs.
+void poisson_dirichlet_tiled (double *__restrict__ source,
+                              double *__restrict__ potential,
+                              double Vbound,
+                              unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                              double delta, unsigned int maxiters, unsigned int numcores);
+
+// Solve Poisson's equation by barrier-free asynchronous relaxation until no
+// voxel changes by more than tolerance, with at most one worker per core.
+// Returns the sweeps performed; *converged, if given, is 0 if maxiters ran
+// out before the tolerance was met.
+unsigned int poisson_dirichlet_async (double *__restrict__ source,
+                                      double *__restrict__ potential,
+                                      double Vbound,
+                                      unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                                      double delta, unsigned int maxiters, double tolerance,
+                                      unsigned int numcores, int *converged);
+
+// Solve Poisson's equation for memory-mapped source and potential files,
+// streaming z-planes and combining depth iterations per pass.
+int poisson_dirichlet_ooc (const char *source_path, const char *potential_path,
+                           double Vbound,
+                           unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                           double delta, unsigned int maxiters, unsigned int depth,
+                           unsigned int numcores);
+
+// Grid files hold a fixed header followed by the raw grid, in the same
+// order as the poisson_dirichlet arrays, starting on a page boundary so
+// that it can be memory-mapped and used without copying.  All fields are
+// in host (little-endian) byte order.
+#define POISSON_GRID_VERSION 1
+#define POISSON_GRID_ALIGN 4096
+#define POISSON_GRID_F64 1
+#define POISSON_GRID_F32 2
+#define POISSON_GRID_PZ 3               // doubles compressed by poisson_compress
+
+struct poisson_grid_header {
+    char magic[8];              // "PGRID"
+    uint32_t version;
+    uint32_t dtype;             // POISSON_GRID_F64, _F32 or _PZ
+    uint32_t xsize, ysize, zsize;
+    uint32_t iteration;         // iterate held by a snapshot or checkpoint, otherwise 0
+    double delta;
+    double Vbound;
+    uint64_t data_offset;       // POISSON_GRID_ALIGN
+    uint64_t data_bytes;
+    uint64_t checksum;          // sum of per-plane FNV-1a hashes
+};
+
+// Lossy compression of a grid to within an absolute error bound in 4 x 4
+// x 4 blocks.  Smooth fields such as potentials take a few bits per voxel.
+size_t poisson_compress (const double *data,
+                         unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                         double tolerance, unsigned char **stream, unsigned int numcores);
+int poisson_decompress (const unsigned char *stream, size_t bytes, double *data,
+                        unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                        unsigned int numcores);
+
+int poisson_grid_write (const char *path, const double *data,
+                        unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                        double delta, double Vbound, unsigned int numcores);
+int poisson_grid_write_compressed (const char *path, const double *data,
+                                   unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                                   double delta, double Vbound, unsigned int iteration,
+                                   double tolerance, unsigned int numcores);
+const void *poisson_grid_map (const char *path, struct poisson_grid_header *header,
+                              int verify, unsigned int numcores);
+void poisson_grid_unmap (const void *data, const struct poisson_grid_header *header);
+double *poisson_grid_read (const char *path, struct poisson_grid_header *header, unsigned int numcores);
+void poisson_grid_header_init (struct poisson_grid_header *header,
+                               unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                               double delta, double Vbound);
+uint64_t poisson_grid_checksum (const void *data, const struct poisson_grid_header *header);
+
+// Write a grid as text, one "x: | y: | z: - value" line per voxel, formatted
+// in parallel.  Sparse output leaves out voxels equal to Vbound.
+int poisson_export_text (const char *path, const double *data,
+                         unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                         double Vbound, int precision, int sparse, unsigned int numcores);
+
+// What a snapshot writer does when the solver wants a buffer and all of
+// them are still queued or being written
+#define POISSON_SNAPSHOT_BLOCK 0        // wait for the writer (back-pressure)
+#define POISSON_SNAPSHOT_DROP_NEWEST 1  // skip the new snapshot
+#define POISSON_SNAPSHOT_DROP_OLDEST 2  // discard the oldest queued snapshot
+
+// Background thread writing intermediate potentials to grid files, so that
+// taking a snapshot costs the solver one copy of the grid.
+struct poisson_snapshot_writer;
+
+struct poisson_snapshot_writer *poisson_snapshot_create (const char *prefix,
+                                                         unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                                                         double delta, double Vbound,
+                                                         unsigned int nbuffers, int policy);
+struct poisson_snapshot_writer *poisson_checkpoint_create (const char *path,
+                                                           unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                                                           double delta, double Vbound);
+double *poisson_snapshot_acquire (struct poisson_snapshot_writer *w);
+void poisson_snapshot_submit (struct poisson_snapshot_writer *w, double *buffer, unsigned int iteration);
+void poisson_snapshot_release (struct poisson_snapshot_writer *w, double *buffer);
+int poisson_snapshot_compress (struct poisson_snapshot_writer *w, double tolerance, unsigned int numcores);
+int poisson_snapshot_destroy (struct poisson_snapshot_writer *w,
+                              unsigned int *written, unsigned int *dropped);
+
+// A sweep kernel built at run time for one shape and thread count: worker
+// relaxes its planes of in into out, as poisson_sweep does.
+typedef void (*poisson_jit_fn)(const double *__restrict__ in, const double *__restrict__ source,
+                               double *__restrict__ out, double d2, double Vbound,
+                               unsigned int worker);
+
+// Compile, or load from the on-disk cache, a kernel specialised for this
+// shape and thread count.  Returns NULL if no compiler is available.
+poisson_jit_fn poisson_jit_kernel (unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                                   unsigned int numcores);
+
+// A Jacobi sweep of the box [x0, x1) x [y0, y1) x [z0, z1), with the
+// signature of poisson_sweep, e.g. poisson_stencil<S>::sweep
+struct poisson_grid;
+typedef void (*poisson_sweep_fn)(const struct poisson_grid *g, const double *in, double *out,
+                                 unsigned int x0, unsigned int x1,
+                                 unsigned int y0, unsigned int y1,
+                                 unsigned int z0, unsigned int z1);
+
+// Extra behaviour for poisson_solve.  Start from poisson_options_init so
+// that fields added later keep their defaults.
+struct poisson_options {
+    struct poisson_snapshot_writer *snapshots;  // receives every snapshot_every'th iterate
+    unsigned int snapshot_every;
+    struct poisson_snapshot_writer *checkpoints; // from poisson_checkpoint_create
+    unsigned int checkpoint_every;
+    const char *resume;                         // checkpoint to continue from, or NULL
+    int warm_start;                             // start from the incoming potential, not the source
+    double tolerance;                           // stop once no voxel changes by more than this
+    int skip_unchanged;                         // only sweep tiles whose inputs changed
+    int jit;                                    // sweep with a kernel from poisson_jit_kernel
+    poisson_sweep_fn sweep;                     // another stencil to relax with, or NULL
+    int mehrstellen;                            // fourth order: 19-point stencil, corrected source
+};
+
+void poisson_options_init (struct poisson_options *opts);
+
+// Solve Poisson's equation like poisson_dirichlet with the extra behaviour
+// selected by opts.  Returns the iterations performed.
+unsigned int poisson_solve (double *__restrict__ source,
+                            double *__restrict__ potential,
+                            double Vbound,
+                            unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                            double delta, unsigned int maxiters, unsigned int numcores,
+                            const struct poisson_options *opts);
+
+// Refinement for poisson_amr_solve.  Start from poisson_amr_options_init
+// so that fields added later keep their defaults.
+struct poisson_amr_options {
+    double source_threshold;                    // refine around voxels with |source| above this
+    double gradient_threshold;                  // after a pass, split cells differing from a neighbour by more
+    unsigned int grading;                       // cells of each size between refined regions and coarser ones
+    unsigned int coarsest;                      // largest cell, in voxels, a power of two
+    unsigned int passes;                        // solves, each followed by gradient refinement
+};
+
+// Solution on an octree of cells refined around the source
+struct poisson_amr;
+
+void poisson_amr_options_init (struct poisson_amr_options *opts);
+
+// Solve Poisson's equation on an octree refined around the source, with
+// finite volume stencils across cells of different sizes.
+struct poisson_amr *poisson_amr_solve (const double *source, double Vbound,
+                                       unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                                       double delta, unsigned int maxiters, unsigned int numcores,
+                                       const struct poisson_amr_options *opts);
+size_t poisson_amr_cells (const struct poisson_amr *amr);
+void poisson_amr_sample (const struct poisson_amr *amr, double *potential, unsigned int numcores);
+void poisson_amr_destroy (struct poisson_amr *amr);
+
+// A voxel at which poisson_probe_walk estimates the potential
+struct poisson_probe {
+    unsigned int x, y, z;
+    double value;                               // the estimate
+    double halfwidth;                           // of its 95% confidence interval
+    unsigned long walks;                        // random walks averaged
+};
+
+// Estimate the potential at a few voxels by random walks to the boundary,
+// until each 95% confidence interval is within halfwidth.  Returns the
+// number of probes that got there.
+int poisson_probe_walk (const double *source, double Vbound,
+                        unsigned int xsize, unsigned int ysize, unsigned int zsize, double delta,
+                        struct poisson_probe *probes, unsigned int nprobes,
+                        double halfwidth, unsigned long maxwalks, uint64_t seed,
+                        unsigned int numcores);
+
+// One independent solve for the concurrent scheduler.  The fields have the
+// same meaning as the poisson_dirichlet arguments.
+struct poisson_job {
+    double *source;
+    double *potential;
+    double Vbound;
+    unsigned int xsize, ysize, zsize;
+    double delta;
+    unsigned int numiters;
+};
+
+// Re-entrant pool of workers that packs many independent solves onto
+// the cores, splitting only the large ones.
+struct poisson_scheduler;
+
+struct poisson_scheduler *poisson_scheduler_create (unsigned int numworkers);
+int poisson_scheduler_submit (struct poisson_scheduler *s, const struct poisson_job *job);
+void poisson_scheduler_wait (struct poisson_scheduler *s);
+void poisson_scheduler_destroy (struct poisson_scheduler *s);
 #endif
@@ -0,0 +1,711 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "poisson.hpp"
+
+// Marks for amr_node::cell besides a cell number
+#define AMR_OUTSIDE -1				// leaf wholly outside the box
+#define AMR_INTERNAL -2				// node with children
+
+// One node of the octree.  The root is a cube of a power of two voxels
+// at the origin covering the box.  Nodes that straddle the far faces are
+// always split, so every leaf lies wholly inside the box or wholly outside.
+struct amr_node {
+	unsigned int pos[3];			// first voxel covered
+	unsigned int size;				// voxels along each side, a power of two
+	int child;						// first of eight consecutive children, or -1
+	int cell;						// cell number, AMR_OUTSIDE or AMR_INTERNAL
+	double value;					// potential of a leaf, also the start of the next pass
+};
+
+struct poisson_amr {
+	struct amr_node *nodes;
+	size_t nnodes;
+	size_t capacity;
+	unsigned int *leaves;			// node of each cell, in depth-first order
+	size_t ncells;
+	unsigned int dims[3];
+	double Vbound;
+	double delta;
+};
+
+// Cells within grading * size voxels of a flagged voxel are split, one
+// flag byte per block of 2^level voxels for each level from 1 up
+struct amr_flags {
+	unsigned char *level[32];
+	unsigned int dims[32][3];
+	unsigned int levels;
+	unsigned int grading;
+};
+
+// The relaxation operator in compressed rows: the new value of cell i is
+// the sum of weight[k] * u[col[k]] for k in [row[i], row[i + 1]), plus b[i]
+struct amr_operator {
+	size_t *row;
+	unsigned int *col;
+	double *weight;
+	double *b;
+};
+
+// State shared by the workers of one pass
+struct amr_engine {
+	struct poisson_amr *amr;
+	const double *source;
+	double *sum;					// source summed over each cell
+	struct amr_operator op;
+	double *u[2];
+	double *potential;
+	unsigned int numiters;
+	pthread_barrier_t barrier;
+};
+
+// structure we're going to use for arguments to our amr pthread functions
+struct amr_args {
+	struct amr_engine *e;
+	size_t start;					// cells [start, end)
+	size_t end;
+	pthread_t thread;
+};
+
+static int amr_refine(struct poisson_amr *amr, const struct amr_flags *f, unsigned int n,
+                      unsigned int coarsest, int criteria);
+static int amr_balance(struct poisson_amr *amr);
+static int amr_number(struct poisson_amr *amr);
+static int amr_build(struct poisson_amr *amr, const double *sum, struct amr_operator *op);
+static void amr_operator_free(struct amr_operator *op);
+static int amr_flags_init(struct amr_flags *f, const double *source, const unsigned int dims[3],
+                          double threshold, unsigned int levels, unsigned int grading);
+static void amr_flags_free(struct amr_flags *f);
+static void amr_run(struct amr_engine *e, unsigned int numcores, void *(*fn)(void *));
+static void *amr_sum_thread(void *args);
+static void *amr_relax_thread(void *args);
+static void *amr_sample_thread(void *args);
+
+/// Fill in the default options: refine around every non-zero source
+/// voxel, with at least two cells of each size between refined regions and
+/// cells of 16 voxels, and a single pass
+void poisson_amr_options_init (struct poisson_amr_options *opts)
+{
+	memset(opts, 0, sizeof(*opts));
+	opts->grading = 2;
+	opts->coarsest = 16;
+	opts->passes = 1;
+}
+
+/// Solve Poisson's equation on an adaptive octree of cubic cells instead
+/// of the dense grid.  Cells are a voxel across near source voxels
+/// above opts->source_threshold and double in size every opts->grading
+/// cells further out, up to opts->coarsest voxels.  Neighbouring cells
+/// differ in size by at most a factor of two.
+///
+/// The stencil is the finite volume form of poisson_dirichlet's: each
+/// shared face contributes its area over the distance between the cell
+/// centres, and a cell's source is the sum over its voxels.  On a patch of
+/// one-voxel cells it is exactly the 7-point stencil.  A face on the box
+/// boundary sees Vbound half a voxel outside the box, as the dense solver
+/// does.  Like poisson_dirichlet, the source is the first iterate.
+///
+/// With opts->passes > 1 and a gradient threshold, cells whose potential
+/// differs from a neighbour by more than opts->gradient_threshold are split
+/// after each pass and the next pass starts from the last solution.
+/// \param source is a flattened 3-D array, ordered as for poisson_dirichlet
+/// \param maxiters is the number of Jacobi iterations in each pass
+/// \param numcores is the number of CPU cores to use.  If 0, an optimal number is chosen
+/// \param opts selects the refinement; NULL gives the defaults
+/// \return the solution, to be sampled with poisson_amr_sample, or NULL if memory runs out
+struct poisson_amr *poisson_amr_solve (const double *source, double Vbound,
+                                       unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                                       double delta, unsigned int maxiters, unsigned int numcores,
+                                       const struct poisson_amr_options *opts)
+{
+	struct poisson_amr_options defaults;
+	if (!opts) {
+		poisson_amr_options_init(&defaults);
+		opts = &defaults;
+	}
+	if (numcores == 0)
+		numcores = sysconf(_SC_NPROCESSORS_ONLN);
+
+	struct poisson_amr *amr = (struct poisson_amr *)calloc(1, sizeof(*amr));
+	if (!amr) {
+		fprintf(stderr, "malloc failure\n");
+		return NULL;
+	}
+	amr->dims[0] = xsize;
+	amr->dims[1] = ysize;
+	amr->dims[2] = zsize;
+	amr->Vbound = Vbound;
+	amr->delta = delta;
+
+	unsigned int levels = 0;
+	unsigned int root = 1;
+	while (root < xsize || root < ysize || root < zsize) {
+		root *= 2;
+		levels++;
+	}
+	unsigned int coarsest = opts->coarsest > 0 ? opts->coarsest : 1;
+
+	struct amr_flags flags;
+	amr->capacity = 1024;
+	amr->nodes = (struct amr_node *)malloc(amr->capacity * sizeof(struct amr_node));
+	if (!amr->nodes || amr_flags_init(&flags, source, amr->dims, opts->source_threshold,
+									  levels, opts->grading) != 0) {
+		fprintf(stderr, "malloc failure\n");
+		poisson_amr_destroy(amr);
+		return NULL;
+	}
+	struct amr_node *r = &amr->nodes[0];
+	r->pos[0] = r->pos[1] = r->pos[2] = 0;
+	r->size = root;
+	r->child = -1;
+	r->cell = 0;
+	r->value = 0;
+	amr->nnodes = 1;
+	int status = amr_refine(amr, &flags, 0, coarsest, 1);
+	amr_flags_free(&flags);
+
+	for (unsigned int pass = 0; status == 0 && pass < (opts->passes > 0 ? opts->passes : 1); pass++) {
+		if (amr_balance(amr) != 0 || amr_number(amr) != 0) {
+			status = -1;
+			break;
+		}
+
+		struct amr_engine e;
+		memset(&e, 0, sizeof(e));
+		e.amr = amr;
+		e.source = source;
+		e.numiters = maxiters;
+		e.sum = (double *)malloc(amr->ncells * sizeof(double));
+		e.u[0] = (double *)malloc(amr->ncells * sizeof(double));
+		e.u[1] = (double *)malloc(amr->ncells * sizeof(double));
+		if (!e.sum || !e.u[0] || !e.u[1]) {
+			free(e.sum);
+			free(e.u[0]);
+			free(e.u[1]);
+			status = -1;
+			break;
+		}
+		amr_run(&e, numcores, amr_sum_thread);
+		status = amr_build(amr, e.sum, &e.op);
+		if (status == 0) {
+			for (size_t i = 0; i < amr->ncells; i++) {
+				const struct amr_node *n = &amr->nodes[amr->leaves[i]];
+				e.u[0][i] = pass == 0 ? e.sum[i] / ((double)n->size * n->size * n->size) : n->value;
+			}
+			amr_run(&e, numcores, amr_relax_thread);
+			const double *u = e.u[maxiters % 2];
+			for (size_t i = 0; i < amr->ncells; i++)
+				amr->nodes[amr->leaves[i]].value = u[i];
+		}
+
+		// Split the cells across which the potential still changes too much
+		int split = 0;
+		if (status == 0 && pass + 1 < opts->passes && opts->gradient_threshold > 0) {
+			const double *u = e.u[maxiters % 2];
+			unsigned char *mark = (unsigned char *)calloc(amr->ncells, 1);
+			if (!mark) {
+				status = -1;
+			} else {
+				for (size_t i = 0; i < amr->ncells; i++) {
+					for (size_t k = e.op.row[i]; k < e.op.row[i + 1]; k++) {
+						double d = u[i] - u[e.op.col[k]];
+						d = d < 0 ? -d : d;
+						if (d > opts->gradient_threshold)
+							mark[i] = 1;
+					}
+				}
+				size_t ncells = amr->ncells;
+				for (size_t i = 0; i < ncells && status == 0; i++) {
+					if (mark[i] && amr->nodes[amr->leaves[i]].size > 1) {
+						status = amr_refine(amr, NULL, amr->leaves[i], 0, 0);
+						split = 1;
+					}
+				}
+				free(mark);
+			}
+		}
+
+		amr_operator_free(&e.op);
+		free(e.sum);
+		free(e.u[0]);
+		free(e.u[1]);
+		if (!split)
+			break;
+	}
+
+	if (status != 0) {
+		fprintf(stderr, "malloc failure\n");
+		poisson_amr_destroy(amr);
+		return NULL;
+	}
+	return amr;
+}
+
+/// \return the number of cells the last pass solved for
+size_t poisson_amr_cells (const struct poisson_amr *amr)
+{
+	return amr->ncells;
+}
+
+/// Sample an AMR solution onto the dense grid it was solved for.  Each
+/// voxel takes the value of the cell containing it.
+/// \param potential receives xsize * ysize * zsize values, ordered as for poisson_dirichlet
+/// \param numcores is the number of threads to fill with.  If 0, one per core
+void poisson_amr_sample (const struct poisson_amr *amr, double *potential, unsigned int numcores)
+{
+	if (numcores == 0)
+		numcores = sysconf(_SC_NPROCESSORS_ONLN);
+
+	struct amr_engine e;
+	memset(&e, 0, sizeof(e));
+	e.amr = (struct poisson_amr *)amr;
+	e.potential = potential;
+	amr_run(&e, numcores, amr_sample_thread);
+}
+
+void poisson_amr_destroy (struct poisson_amr *amr)
+{
+	if (!amr)
+		return;
+	free(amr->nodes);
+	free(amr->leaves);
+	free(amr);
+}
+
+
+// Whether node n lies wholly outside the box, or straddles its far faces
+static int amr_outside(const struct poisson_amr *amr, const struct amr_node *n)
+{
+	for (unsigned int a = 0; a < 3; a++) {
+		if (n->pos[a] >= amr->dims[a])
+			return 1;
+	}
+	return 0;
+}
+
+static int amr_straddles(const struct poisson_amr *amr, const struct amr_node *n)
+{
+	for (unsigned int a = 0; a < 3; a++) {
+		if (n->pos[a] + n->size > amr->dims[a])
+			return 1;
+	}
+	return 0;
+}
+
+
+// Whether a flagged voxel lies within grading cells of node n
+static int amr_near(const struct amr_flags *f, const struct amr_node *n)
+{
+	unsigned int l = 0;
+	while ((1u << l) < n->size)
+		l++;
+	if (l == 0)
+		return 0;
+
+	const unsigned int *d = f->dims[l];
+	unsigned int lo[3], hi[3];
+	for (unsigned int a = 0; a < 3; a++) {
+		unsigned int b = n->pos[a] >> l;
+		lo[a] = b > f->grading ? b - f->grading : 0;
+		hi[a] = b + f->grading < d[a] ? b + f->grading + 1 : d[a];
+	}
+	for (unsigned int z = lo[2]; z < hi[2]; z++) {
+		for (unsigned int y = lo[1]; y < hi[1]; y++) {
+			const unsigned char *row = f->level[l] + ((size_t)z * d[1] + y) * d[0];
+			for (unsigned int x = lo[0]; x < hi[0]; x++) {
+				if (row[x])
+					return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+
+// Decide whether leaf n is to be split and split it, and its children in
+// turn.  With criteria the size and source rules apply, otherwise n is
+// split regardless and its children only where they straddle the box.
+// Children start from the value of their parent.  Returns -1 if memory
+// runs out.
+static int amr_refine(struct poisson_amr *amr, const struct amr_flags *f, unsigned int n,
+                      unsigned int coarsest, int criteria)
+{
+	struct amr_node *node = &amr->nodes[n];
+	if (amr_outside(amr, node)) {
+		node->cell = AMR_OUTSIDE;
+		return 0;
+	}
+	if (criteria && !amr_straddles(amr, node) && node->size <= coarsest
+		&& (node->size == 1 || !amr_near(f, node)))
+		return 0;
+
+	if (amr->nnodes + 8 > amr->capacity) {
+		size_t capacity = 2 * amr->capacity;
+		struct amr_node *nodes = (struct amr_node *)realloc(amr->nodes, capacity * sizeof(struct amr_node));
+		if (!nodes)
+			return -1;
+		amr->nodes = nodes;
+		amr->capacity = capacity;
+		node = &amr->nodes[n];
+	}
+
+	unsigned int half = node->size / 2;
+	unsigned int first = (unsigned int)amr->nnodes;
+	for (unsigned int i = 0; i < 8; i++) {
+		struct amr_node *c = &amr->nodes[first + i];
+		for (unsigned int a = 0; a < 3; a++)
+			c->pos[a] = node->pos[a] + ((i >> a) & 1) * half;
+		c->size = half;
+		c->child = -1;
+		c->cell = 0;
+		c->value = node->value;
+	}
+	amr->nnodes += 8;
+	node->child = (int)first;
+	node->cell = AMR_INTERNAL;
+
+	for (unsigned int i = 0; i < 8; i++) {
+		unsigned int c = first + i;
+		if (criteria) {
+			if (amr_refine(amr, f, c, coarsest, 1) != 0)
+				return -1;
+		} else if (amr_outside(amr, &amr->nodes[c])) {
+			amr->nodes[c].cell = AMR_OUTSIDE;
+		} else if (amr_straddles(amr, &amr->nodes[c])) {
+			if (amr_refine(amr, NULL, c, 0, 0) != 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+
+// The smallest node containing voxel p that is no smaller than size
+static unsigned int amr_find(const struct poisson_amr *amr, const unsigned int p[3], unsigned int size)
+{
+	unsigned int n = 0;
+	while (amr->nodes[n].child >= 0 && amr->nodes[n].size > size) {
+		const struct amr_node *node = &amr->nodes[n];
+		unsigned int half = node->size / 2;
+		unsigned int i = 0;
+		for (unsigned int a = 0; a < 3; a++)
+			i |= (p[a] >= node->pos[a] + half) << a;
+		n = node->child + i;
+	}
+	return n;
+}
+
+
+// The voxel just across face side (0 low, 1 high) of node n along axis a,
+// or -1 if that is outside the box
+static int amr_across(const struct poisson_amr *amr, const struct amr_node *n,
+                      unsigned int a, unsigned int side, unsigned int p[3])
+{
+	p[0] = n->pos[0];
+	p[1] = n->pos[1];
+	p[2] = n->pos[2];
+	if (side == 0) {
+		if (n->pos[a] == 0)
+			return -1;
+		p[a] = n->pos[a] - 1;
+	} else {
+		if (n->pos[a] + n->size >= amr->dims[a])
+			return -1;
+		p[a] = n->pos[a] + n->size;
+	}
+	return 0;
+}
+
+
+// Split leaves until no two face neighbours differ in size by more than
+// a factor of two.  Returns -1 if memory runs out.
+static int amr_balance(struct poisson_amr *amr)
+{
+	int changed = 1;
+	while (changed) {
+		changed = 0;
+		for (size_t n = 0; n < amr->nnodes; n++) {
+			if (amr->nodes[n].child >= 0 || amr->nodes[n].cell == AMR_OUTSIDE)
+				continue;
+			for (unsigned int f = 0; f < 6; f++) {
+				unsigned int p[3];
+				if (amr_across(amr, &amr->nodes[n], f / 2, f % 2, p) != 0)
+					continue;
+				unsigned int m = amr_find(amr, p, amr->nodes[n].size);
+				if (amr->nodes[m].size > 2 * amr->nodes[n].size) {
+					if (amr_refine(amr, NULL, m, 0, 0) != 0)
+						return -1;
+					changed = 1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+
+// Number the leaves inside the box depth first, so that cells close in
+// space are mostly close in memory.  Returns -1 if memory runs out.
+static int amr_number(struct poisson_amr *amr)
+{
+	free(amr->leaves);
+	amr->ncells = 0;
+	amr->leaves = (unsigned int *)malloc(amr->nnodes * sizeof(unsigned int));
+	unsigned int *stack = (unsigned int *)malloc(amr->nnodes * sizeof(unsigned int));
+	if (!amr->leaves || !stack) {
+		free(stack);
+		return -1;
+	}
+
+	size_t top = 0;
+	stack[top++] = 0;
+	while (top > 0) {
+		struct amr_node *n = &amr->nodes[stack[--top]];
+		if (n->child >= 0) {
+			for (int i = 7; i >= 0; i--)
+				stack[top++] = n->child + i;
+		} else if (n->cell != AMR_OUTSIDE) {
+			n->cell = (int)amr->ncells;
+			amr->leaves[amr->ncells++] = (unsigned int)(n - amr->nodes);
+		}
+	}
+	free(stack);
+	return 0;
+}
+
+
+// Append the leaves of node n touching its face side along axis a, with
+// the area of the contact over the distance between the centres of them
+// and a cell of the given size, to the operator row being built
+static void amr_face(const struct poisson_amr *amr, unsigned int n, unsigned int a, unsigned int side,
+                     unsigned int size, unsigned int *col, double *coef, size_t *k)
+{
+	const struct amr_node *node = &amr->nodes[n];
+	if (node->child >= 0) {
+		for (unsigned int i = 0; i < 8; i++) {
+			if (((i >> a) & 1) == side)
+				amr_face(amr, node->child + i, a, side, size, col, coef, k);
+		}
+		return;
+	}
+	double s = node->size;
+	col[*k] = (unsigned int)node->cell;
+	coef[*k] = s * s / ((size + s) / 2);
+	(*k)++;
+}
+
+
+// Build the relaxation operator for the current cells.  Returns -1 if
+// memory runs out.
+static int amr_build(struct poisson_amr *amr, const double *sum, struct amr_operator *op)
+{
+	const double d2 = amr->delta * amr->delta;
+
+	// With a 2:1 balance a face has at most four neighbours
+	size_t capacity = amr->ncells * 24;
+	op->row = (size_t *)malloc((amr->ncells + 1) * sizeof(size_t));
+	op->col = (unsigned int *)malloc(capacity * sizeof(unsigned int));
+	op->weight = (double *)malloc(capacity * sizeof(double));
+	op->b = (double *)malloc(amr->ncells * sizeof(double));
+	if (!op->row || !op->col || !op->weight || !op->b) {
+		amr_operator_free(op);
+		return -1;
+	}
+
+	size_t k = 0;
+	for (size_t i = 0; i < amr->ncells; i++) {
+		const struct amr_node *n = &amr->nodes[amr->leaves[i]];
+		double c = n->size;
+		double diag = 0;
+		double b = 0;
+
+		op->row[i] = k;
+		for (unsigned int f = 0; f < 6; f++) {
+			unsigned int p[3];
+			if (amr_across(amr, n, f / 2, f % 2, p) != 0) {
+				// Vbound sits half a voxel outside the box
+				double coef = c * c / ((c + 1) / 2);
+				b += coef * amr->Vbound;
+				diag += coef;
+				continue;
+			}
+			unsigned int m = amr_find(amr, p, n->size);
+			size_t k0 = k;
+			if (amr->nodes[m].child >= 0) {
+				amr_face(amr, m, f / 2, 1 - f % 2, n->size, op->col, op->weight, &k);
+			} else {
+				// A bigger neighbour shares only this cell's face
+				double s = amr->nodes[m].size;
+				op->col[k] = (unsigned int)amr->nodes[m].cell;
+				op->weight[k] = c * c / ((c + s) / 2);
+				k++;
+			}
+			for (size_t j = k0; j < k; j++)
+				diag += op->weight[j];
+		}
+		for (size_t j = op->row[i]; j < k; j++)
+			op->weight[j] /= diag;
+		op->b[i] = (b - d2 * sum[i]) / diag;
+	}
+	op->row[amr->ncells] = k;
+	return 0;
+}
+
+
+static void amr_operator_free(struct amr_operator *op)
+{
+	free(op->row);
+	free(op->col);
+	free(op->weight);
+	free(op->b);
+	memset(op, 0, sizeof(*op));
+}
+
+
+// Flag the blocks of each level holding a voxel whose source exceeds
+// threshold in magnitude.  Returns -1 if memory runs out.
+static int amr_flags_init(struct amr_flags *f, const double *source, const unsigned int dims[3],
+                          double threshold, unsigned int levels, unsigned int grading)
+{
+	memset(f, 0, sizeof(*f));
+	f->levels = levels;
+	f->grading = grading;
+	for (unsigned int l = 1; l <= levels; l++) {
+		for (unsigned int a = 0; a < 3; a++)
+			f->dims[l][a] = (dims[a] + (1u << l) - 1) >> l;
+		f->level[l] = (unsigned char *)calloc((size_t)f->dims[l][0] * f->dims[l][1] * f->dims[l][2], 1);
+		if (!f->level[l]) {
+			amr_flags_free(f);
+			return -1;
+		}
+	}
+	if (levels == 0)
+		return 0;
+
+	const unsigned int *d = f->dims[1];
+	for (unsigned int z = 0; z < dims[2]; z++) {
+		for (unsigned int y = 0; y < dims[1]; y++) {
+			const double *row = source + ((size_t)z * dims[1] + y) * dims[0];
+			unsigned char *flag = f->level[1] + ((size_t)(z / 2) * d[1] + y / 2) * d[0];
+			for (unsigned int x = 0; x < dims[0]; x++) {
+				double s = row[x] < 0 ? -row[x] : row[x];
+				if (s > threshold)
+					flag[x / 2] = 1;
+			}
+		}
+	}
+	for (unsigned int l = 2; l <= levels; l++) {
+		const unsigned int *p = f->dims[l - 1];
+		const unsigned int *q = f->dims[l];
+		for (unsigned int z = 0; z < p[2]; z++) {
+			for (unsigned int y = 0; y < p[1]; y++) {
+				for (unsigned int x = 0; x < p[0]; x++) {
+					if (f->level[l - 1][((size_t)z * p[1] + y) * p[0] + x])
+						f->level[l][((size_t)(z / 2) * q[1] + y / 2) * q[0] + x / 2] = 1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+
+static void amr_flags_free(struct amr_flags *f)
+{
+	for (unsigned int l = 0; l < 32; l++)
+		free(f->level[l]);
+}
+
+
+// Run fn on numcores threads, each given a balanced range of cells
+static void amr_run(struct amr_engine *e, unsigned int numcores, void *(*fn)(void *))
+{
+	size_t ncells = e->amr->ncells;
+	if (numcores > ncells)
+		numcores = ncells > 0 ? (unsigned int)ncells : 1;
+
+	pthread_barrier_init(&e->barrier, NULL, numcores);
+	struct amr_args aa[numcores];
+	for (unsigned int i = 0; i < numcores; i++) {
+		aa[i].e 	= e;
+		aa[i].start = ncells * i / numcores;
+		aa[i].end 	= ncells * (i + 1) / numcores;
+		if (pthread_create(&aa[i].thread, NULL, fn, (void *)&aa[i]) != 0) {
+			fprintf(stderr, "Could not create thread %d\n", i);
+		}
+	}
+	for (unsigned int i = 0; i < numcores; i++) {
+		pthread_join(aa[i].thread, NULL);
+	}
+	pthread_barrier_destroy(&e->barrier);
+}
+
+
+static void *amr_sum_thread(void *args)
+{
+	struct amr_args *aa = (struct amr_args *)args;
+	const struct poisson_amr *amr = aa->e->amr;
+	const unsigned int *d = amr->dims;
+
+	for (size_t i = aa->start; i < aa->end; i++) {
+		const struct amr_node *n = &amr->nodes[amr->leaves[i]];
+		double s = 0;
+		for (unsigned int z = n->pos[2]; z < n->pos[2] + n->size; z++) {
+			for (unsigned int y = n->pos[1]; y < n->pos[1] + n->size; y++) {
+				const double *row = aa->e->source + ((size_t)z * d[1] + y) * d[0];
+				for (unsigned int x = n->pos[0]; x < n->pos[0] + n->size; x++)
+					s += row[x];
+			}
+		}
+		aa->e->sum[i] = s;
+	}
+	return NULL;
+}
+
+
+static void *amr_relax_thread(void *args)
+{
+	struct amr_args *aa = (struct amr_args *)args;
+	struct amr_engine *e = aa->e;
+	const struct amr_operator *op = &e->op;
+	double *in = e->u[0];
+	double *out = e->u[1];
+
+	for (unsigned int iter = 0; iter < e->numiters; iter++) {
+		for (size_t i = aa->start; i < aa->end; i++) {
+			double v = op->b[i];
+			for (size_t k = op->row[i]; k < op->row[i + 1]; k++)
+				v += op->weight[k] * in[op->col[k]];
+			out[i] = v;
+		}
+
+		double *temp = in;
+		in = out;
+		out = temp;
+		pthread_barrier_wait(&e->barrier);
+	}
+	return NULL;
+}
+
+
+static void *amr_sample_thread(void *args)
+{
+	struct amr_args *aa = (struct amr_args *)args;
+	const struct poisson_amr *amr = aa->e->amr;
+	const unsigned int *d = amr->dims;
+
+	for (size_t i = aa->start; i < aa->end; i++) {
+		const struct amr_node *n = &amr->nodes[amr->leaves[i]];
+		for (unsigned int z = n->pos[2]; z < n->pos[2] + n->size; z++) {
+			for (unsigned int y = n->pos[1]; y < n->pos[1] + n->size; y++) {
+				double *row = aa->e->potential + ((size_t)z * d[1] + y) * d[0];
+				for (unsigned int x = n->pos[0]; x < n->pos[0] + n->size; x++)
+					row[x] = n->value;
+			}
+		}
+	}
+	return NULL;
+}
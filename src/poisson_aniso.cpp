@@ -0,0 +1,181 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "poisson.hpp"
+#include "poisson_kernel.hpp"
+
+// Weights of one anisotropic Jacobi update, worked out once per solve:
+// out = wx * (x neighbours) + wy * (y neighbours) + wz * (z neighbours) - ws * source
+struct aniso_weights {
+	double wx, wy, wz, ws;
+};
+
+// State shared by the workers of one poisson_dirichlet_aniso call
+struct aniso_engine {
+	struct poisson_grid grid;
+	struct aniso_weights w;
+	double *first;					// the first iterate, read by even sweeps
+	double *second;					// written by even sweeps, read by odd ones
+	unsigned int numiters;
+	pthread_barrier_t barrier;
+};
+
+// structure we're going to use for arguments to our anisotropic pthread function
+struct aniso_args {
+	struct aniso_engine *e;
+	unsigned int zstart;
+	unsigned int zend;
+	pthread_t thread;
+};
+
+static void *aniso_thread(void *args);
+
+/// Solve Poisson's equation like poisson_dirichlet on voxels of spacing
+/// dx, dy and dz, e.g. imaging data with thicker slices than pixels,
+/// without resampling to cubes first.  The 7-point stencil weighs each
+/// pair of neighbours by the inverse square of its spacing, and the
+/// weights are normalised once up front so that a sweep only multiplies.
+///
+/// Cubic voxels go to poisson_dirichlet, which adds the six neighbours
+/// and divides once rather than weighing each pair, so they give its
+/// results bit for bit without the three multiplies per voxel.
+/// \param source is a pointer to a flattened 3-D array for the source function
+/// \param potential is a pointer to a flattened 3-D array for the calculated potential
+/// \param Vbound is the potential on the boundary
+/// \param dx, dy and dz are the voxel spacings along each axis
+/// \param numiters is the number of iterations to perform
+/// \param numcores is the number of CPU cores to use.  If 0, an optimal number is chosen
+void poisson_dirichlet_aniso (double *__restrict__ source,
+                              double *__restrict__ potential,
+                              double Vbound,
+                              unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                              double dx, double dy, double dz,
+                              unsigned int numiters, unsigned int numcores)
+{
+	if (dx == dy && dy == dz) {
+		poisson_dirichlet(source, potential, Vbound, xsize, ysize, zsize, dx, numiters, numcores);
+		return;
+	}
+	if (xsize == 0 || ysize == 0 || zsize == 0)
+		return;
+
+	if (numcores == 0)
+		numcores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (numcores > zsize)
+		numcores = zsize;
+
+	size_t size = (size_t)xsize * ysize * zsize * sizeof(double);
+	double *input = (double *)malloc(size);
+	double *bound = poisson_bound_row(xsize, Vbound);
+	if (!input || !bound) {
+		fprintf(stderr, "malloc failure\n");
+		free(input);
+		free(bound);
+		return;
+	}
+	// As in poisson_dirichlet the source is the first iterate
+	memcpy(input, source, size);
+
+	struct aniso_engine e;
+	const double ix = 1 / (dx * dx);
+	const double iy = 1 / (dy * dy);
+	const double iz = 1 / (dz * dz);
+	const double sum = 2 * (ix + iy + iz);
+	e.w.wx = ix / sum;
+	e.w.wy = iy / sum;
+	e.w.wz = iz / sum;
+	e.w.ws = 1 / sum;
+	e.grid.source = source;
+	e.grid.bound = bound;
+	e.grid.Vbound = Vbound;
+	e.grid.delta = 0;
+	e.grid.xsize = xsize;
+	e.grid.ysize = ysize;
+	e.grid.zsize = zsize;
+	e.first = input;
+	e.second = potential;
+	e.numiters = numiters;
+	pthread_barrier_init(&e.barrier, NULL, numcores);
+
+	struct aniso_args aa[numcores];
+	for (unsigned int i = 0; i < numcores; i++) {
+		aa[i].e 		= &e;
+		aa[i].zstart 	= (unsigned int)((size_t)zsize * i / numcores);
+		aa[i].zend 		= (unsigned int)((size_t)zsize * (i + 1) / numcores);
+		if (pthread_create(&aa[i].thread, NULL, aniso_thread, (void *)&aa[i]) != 0) {
+			fprintf(stderr, "Could not create thread %d\n", i);
+		}
+	}
+	for (unsigned int i = 0; i < numcores; i++) {
+		pthread_join(aa[i].thread, NULL);
+	}
+	pthread_barrier_destroy(&e.barrier);
+
+	// An odd number of sweeps ends in second, the caller's potential, and
+	// an even number back in first, the copy of the source
+	if (numiters % 2 == 0)
+		memcpy(potential, input, size);
+
+	free(input);
+	free(bound);
+}
+
+
+// Relax one x-row with the anisotropic weights, with the arguments of
+// poisson_sweep_row over the whole row
+static inline void aniso_row(const struct aniso_weights *w, const double *__restrict__ c,
+                             const double *__restrict__ ym, const double *__restrict__ yp,
+                             const double *__restrict__ zm, const double *__restrict__ zp,
+                             const double *__restrict__ s, double *__restrict__ o,
+                             unsigned int xs, double vb)
+{
+	const double wx = w->wx, wy = w->wy, wz = w->wz, ws = w->ws;
+
+	if (xs == 1) {
+		o[0] = wx * (vb + vb) + wy * (yp[0] + ym[0]) + wz * (zp[0] + zm[0]) - ws * s[0];
+		return;
+	}
+	o[0] = wx * (c[1] + vb) + wy * (yp[0] + ym[0]) + wz * (zp[0] + zm[0]) - ws * s[0];
+	for (unsigned int x = 1; x < xs - 1; x++)
+		o[x] = wx * (c[x + 1] + c[x - 1]) + wy * (yp[x] + ym[x]) + wz * (zp[x] + zm[x]) - ws * s[x];
+	unsigned int x = xs - 1;
+	o[x] = wx * (vb + c[x - 1]) + wy * (yp[x] + ym[x]) + wz * (zp[x] + zm[x]) - ws * s[x];
+}
+
+
+static void *aniso_thread(void *args)
+{
+	struct aniso_args *aa = (struct aniso_args *)args;
+	struct aniso_engine *e = aa->e;
+	const struct poisson_grid *g = &e->grid;
+	const unsigned int xs = g->xsize;
+	const unsigned int ys = g->ysize;
+	const unsigned int zs = g->zsize;
+	const size_t plane = (size_t)xs * ys;
+	const struct aniso_weights w = e->w;
+	double *in = e->first;
+	double *out = e->second;
+
+	for (unsigned int iter = 0; iter < e->numiters; iter++) {
+		for (unsigned int z = aa->zstart; z < aa->zend; z++) {
+			for (unsigned int y = 0; y < ys; y++) {
+				size_t row = z * plane + (size_t)y * xs;
+				const double *c  = in + row;
+				const double *ym = y > 0 	  ? c - xs 	  : g->bound;
+				const double *yp = y < ys - 1 ? c + xs 	  : g->bound;
+				const double *zm = z > 0 	  ? c - plane : g->bound;
+				const double *zp = z < zs - 1 ? c + plane : g->bound;
+				aniso_row(&w, c, ym, yp, zm, zp, g->source + row, out + row, xs, g->Vbound);
+			}
+		}
+
+		double *temp = in;
+		in = out;
+		out = temp;
+		pthread_barrier_wait(&e->barrier);
+	}
+	return NULL;
+}
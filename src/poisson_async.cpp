@@ -0,0 +1,254 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <math.h>
+#include <atomic>
+
+#include "poisson.hpp"
+
+// Consecutive sweeps below the tolerance every worker must report before
+// the monitor declares convergence.  One quiet sweep is not enough as a
+// neighbour may still be feeding in changes through the shared planes.
+#define ASYNC_QUIET_SWEEPS 2
+
+// Why the workers stopped, in async_monitor::stop
+#define ASYNC_RUNNING 0
+#define ASYNC_QUIET 1					// every worker had its quiet sweeps
+#define ASYNC_CAPPED 2					// maxiters ran out first
+
+// Per-worker progress, padded so that publishing it does not bounce the
+// cache line holding another worker's entry
+struct async_progress {
+	std::atomic<unsigned int> sweeps;
+	std::atomic<unsigned int> quiet;
+	char pad[64 - 2 * sizeof(std::atomic<unsigned int>)];
+};
+
+// Global convergence monitor shared by all workers of one solve
+struct async_monitor {
+	struct async_progress *progress;
+	unsigned int numcores;
+	std::atomic<int> stop;
+};
+
+// structure we're going to use for arguments to our async pthread function
+struct async_args {
+	const double *__restrict__ source;
+	double *potential;				// relaxed in place, shared by all workers
+	const double *bound;
+	double Vbound;
+	double delta;
+	double tolerance;
+	unsigned int xsize;
+	unsigned int ysize;
+	unsigned int zsize;
+	unsigned int zstart;
+	unsigned int zend;
+	unsigned int maxiters;
+	unsigned int id;
+	struct async_monitor *monitor;
+	pthread_t thread;
+};
+
+static void *async_thread(void *args);
+
+/// Solve Poisson's equation by asynchronous (chaotic) relaxation.  Each
+/// worker sweeps its own z-slab of potential in place as fast as it can,
+/// picking up whatever its neighbours have most recently stored in the
+/// planes they share.  There are no barriers, so the iterates are not those
+/// of poisson_dirichlet, but they converge to the same solution.
+///
+/// numcores is clamped to the cores online: a descheduled worker freezes
+/// its slab, and its neighbours waste sweeps on stale planes or, worse,
+/// run out of sweeps against it and leave the solve unconverged.
+/// \param source is a pointer to a flattened 3-D array for the source function
+/// \param potential is a pointer to a flattened 3-D array for the calculated potential
+/// \param Vbound is the potential on the boundary
+/// \param xsize is the number of elements in the x-direction
+/// \param ysize is the number of elements in the y-direction
+/// \param zsize is the number of elements in the z-direction
+/// \param delta is the voxel spacing in all directions
+/// \param maxiters stops the solve once every worker has made this many sweeps
+/// \param tolerance stops the solve once no voxel changes by more than this in a sweep
+/// \param numcores is the number of CPU cores to use.  If 0, or more than
+///        there are, one per core
+/// \param converged if not NULL, is set to 1 if the solve stopped because
+///        no voxel was changing by more than tolerance, or 0 if maxiters ran
+///        out first and the potential is not converged
+/// \return the largest number of sweeps made by any worker
+unsigned int poisson_dirichlet_async (double * __restrict__ source,
+                                      double * __restrict__ potential,
+                                      double Vbound,
+                                      unsigned int xsize, unsigned int ysize, unsigned int zsize, double delta,
+                                      unsigned int maxiters, double tolerance, unsigned int numcores,
+                                      int *converged)
+{
+	unsigned int online = sysconf(_SC_NPROCESSORS_ONLN);
+	if (numcores == 0 || numcores > online)
+		numcores = online;
+	if (numcores > zsize)
+		numcores = zsize;
+
+	size_t size = (size_t)xsize * ysize * zsize * sizeof(double);
+	double *bound = (double *)malloc(xsize * sizeof(double));
+	struct async_progress *progress = new struct async_progress[numcores];
+	if (converged)
+		*converged = 0;
+	if (!bound) {
+		fprintf(stderr, "malloc failure\n");
+		delete[] progress;
+		return 0;
+	}
+	for (unsigned int x = 0; x < xsize; x++)
+		bound[x] = Vbound;
+
+	// As in poisson_dirichlet the source is the first iterate
+	memcpy(potential, source, size);
+
+	struct async_monitor monitor;
+	monitor.progress = progress;
+	monitor.numcores = numcores;
+	monitor.stop = ASYNC_RUNNING;
+	for (unsigned int i = 0; i < numcores; i++) {
+		progress[i].sweeps = 0;
+		progress[i].quiet = 0;
+	}
+
+	struct async_args aa[numcores];
+	for (unsigned int i = 0; i < numcores; i++) {
+		aa[i].source 	= source;
+		aa[i].potential = potential;
+		aa[i].bound 	= bound;
+		aa[i].Vbound 	= Vbound;
+		aa[i].delta 	= delta;
+		aa[i].tolerance = tolerance;
+		aa[i].xsize 	= xsize;
+		aa[i].ysize 	= ysize;
+		aa[i].zsize 	= zsize;
+		aa[i].zstart 	= (unsigned int)((size_t)zsize * i / numcores);
+		aa[i].zend 		= (unsigned int)((size_t)zsize * (i + 1) / numcores);
+		aa[i].maxiters 	= maxiters;
+		aa[i].id 		= i;
+		aa[i].monitor 	= &monitor;
+
+		if (pthread_create(&aa[i].thread, NULL, async_thread, (void *)&aa[i]) != 0) {
+			fprintf(stderr, "Could not create thread %d\n", i);
+		}
+	}
+
+	unsigned int sweeps = 0;
+	for (unsigned int i = 0; i < numcores; i++) {
+		pthread_join(aa[i].thread, NULL);
+		if (progress[i].sweeps > sweeps)
+			sweeps = progress[i].sweeps;
+	}
+
+	if (converged)
+		*converged = monitor.stop == ASYNC_QUIET;
+	delete[] progress;
+	free(bound);
+	return sweeps;
+}
+
+
+// Planes on the edge of a slab are read by the neighbouring worker while
+// this one writes them, so those accesses go through relaxed atomics.  On
+// x86 these are ordinary loads and stores; they only stop the compiler from
+// tearing or caching them.
+static inline double load_shared(const double *p)
+{
+	double v;
+	__atomic_load(p, &v, __ATOMIC_RELAXED);
+	return v;
+}
+
+static inline void store_shared(double *p, double v)
+{
+	__atomic_store(p, &v, __ATOMIC_RELAXED);
+}
+
+// Relax one x-row in place and return the largest change.  When shared is
+// set the z-neighbour rows may belong to another worker and the row itself
+// may be read by one.
+template <bool shared>
+static double async_row(const struct async_args *aa, unsigned int y, unsigned int z)
+{
+	const unsigned int xs = aa->xsize;
+	const unsigned int ys = aa->ysize;
+	const size_t plane = (size_t)xs * ys;
+	const double d2 = aa->delta * aa->delta;
+	const double vb = aa->Vbound;
+	size_t row = ((size_t)z * ys + y) * xs;
+	double *c = aa->potential + row;
+	const double *s  = aa->source + row;
+	const double *ym = y > 0 			? c - xs 	: aa->bound;
+	const double *yp = y < ys - 1 		? c + xs 	: aa->bound;
+	const double *zm = z > 0 			? c - plane : aa->bound;
+	const double *zp = z < aa->zsize - 1 ? c + plane : aa->bound;
+	double change = 0;
+
+	for (unsigned int x = 0; x < xs; x++) {
+		double xm = x > 0 ? c[x - 1] : vb;
+		double xp = x < xs - 1 ? c[x + 1] : vb;
+		double zn = shared ? load_shared(&zp[x]) + load_shared(&zm[x]) : zp[x] + zm[x];
+		double res = (xp + xm + yp[x] + ym[x] + zn - d2 * s[x]) / 6;
+		change = fmax(change, fabs(res - c[x]));
+		if (shared)
+			store_shared(&c[x], res);
+		else
+			c[x] = res;
+	}
+	return change;
+}
+
+
+static void *async_thread(void *args)
+{
+	struct async_args *aa = (struct async_args *)args;
+	struct async_monitor *m = aa->monitor;
+	struct async_progress *own = &m->progress[aa->id];
+
+	if (aa->maxiters == 0)
+		return NULL;
+
+	for (unsigned int iter = 1; m->stop.load(std::memory_order_relaxed) == ASYNC_RUNNING; iter++) {
+		double change = 0;
+
+		for (unsigned int z = aa->zstart; z < aa->zend; z++) {
+			bool shared = z == aa->zstart || z == aa->zend - 1;
+			for (unsigned int y = 0; y < aa->ysize; y++) {
+				double c = shared ? async_row<true>(aa, y, z) : async_row<false>(aa, y, z);
+				change = fmax(change, c);
+			}
+		}
+
+		own->sweeps.store(iter, std::memory_order_relaxed);
+		if (change > aa->tolerance)
+			own->quiet.store(0, std::memory_order_relaxed);
+		else
+			own->quiet.store(own->quiet.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+		// Stop once every worker has had enough quiet sweeps in a row, or
+		// once even the slowest worker has used up its sweeps.  A worker
+		// that runs out early keeps going, as its neighbours would
+		// otherwise relax against a frozen slab.  The first worker to
+		// decide records why, quiet taking precedence over the cap.
+		unsigned int quiet = ASYNC_QUIET_SWEEPS;
+		unsigned int sweeps = aa->maxiters;
+		for (unsigned int i = 0; i < m->numcores; i++) {
+			unsigned int q = m->progress[i].quiet.load(std::memory_order_relaxed);
+			unsigned int n = m->progress[i].sweeps.load(std::memory_order_relaxed);
+			quiet = q < quiet ? q : quiet;
+			sweeps = n < sweeps ? n : sweeps;
+		}
+		if (quiet >= ASYNC_QUIET_SWEEPS || sweeps >= aa->maxiters) {
+			int running = ASYNC_RUNNING;
+			m->stop.compare_exchange_strong(running, quiet >= ASYNC_QUIET_SWEEPS ? ASYNC_QUIET : ASYNC_CAPPED,
+											std::memory_order_relaxed);
+		}
+	}
+
+	return NULL;
+}
@@ -0,0 +1,202 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "poisson.hpp"
+
+// Number of right-hand sides relaxed together.  One lane of a lane_t holds
+// the same voxel for BATCH_LANES different sources, so every neighbour load
+// feeds BATCH_LANES updates.
+#define BATCH_LANES 4
+
+typedef double lane_t __attribute__((vector_size(BATCH_LANES * sizeof(double))));
+
+// Jacobi update for one interleaved voxel
+#define LANE_UPDATE(xp, xm, yp, ym, zp, zm, s) \
+				(((xp) + (xm) + (yp) + (ym) + (zp) + (zm) - (s)) / 6.0)
+
+// structure we're going to use for arguments to our batch pthread function
+struct batch_args {
+	double *const *sources;
+	double *const *potentials;
+	unsigned int nrhs;
+	lane_t *__restrict__ source;	// interleaved, pre-scaled by delta * delta
+	lane_t *__restrict__ input;
+	lane_t *__restrict__ output;
+	const lane_t *bound;			// one x-row of Vbound, stands in for rows outside the box
+	lane_t vbound;
+	double delta;
+	unsigned int xsize;
+	unsigned int ysize;
+	unsigned int zsize;
+	unsigned int zstart;			// first plane owned by this thread
+	unsigned int zend;				// one past the last plane owned by this thread
+	unsigned int numiters;
+	pthread_barrier_t *barrier;
+	pthread_t thread;
+};
+
+static void *batch_thread(void *args);
+
+/// Solve Poisson's equation for nrhs different sources on the same box.
+/// The sources are relaxed BATCH_LANES at a time in an interleaved layout so
+/// that each SIMD lane carries one right-hand side.
+/// \param sources is an array of nrhs flattened 3-D source arrays
+/// \param potentials is an array of nrhs flattened 3-D arrays for the calculated potentials
+/// \param nrhs is the number of right-hand sides
+/// \param Vbound is the potential on the boundary
+/// \param xsize is the number of elements in the x-direction
+/// \param ysize is the number of elements in the y-direction
+/// \param zsize is the number of elements in the z-direction
+/// \param delta is the voxel spacing in all directions
+/// \param numiters is the number of iterations to perform
+/// \param numcores is the number of CPU cores to use.  If 0, an optimal number is chosen
+void poisson_dirichlet_batch (double *const *sources,
+                              double *const *potentials,
+                              unsigned int nrhs,
+                              double Vbound,
+                              unsigned int xsize, unsigned int ysize, unsigned int zsize, double delta,
+                              unsigned int numiters, unsigned int numcores)
+{
+	if (nrhs == 0)
+		return;
+
+	if (numcores == 0)
+		numcores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (numcores > zsize)
+		numcores = zsize;
+
+	size_t count = (size_t)xsize * ysize * zsize;
+	lane_t *buffers;
+	if (posix_memalign((void **)&buffers, sizeof(lane_t), (3 * count + xsize) * sizeof(lane_t))) {
+		fprintf(stderr, "malloc failure\n");
+		return;
+	}
+
+	lane_t vbound;
+	for (unsigned int m = 0; m < BATCH_LANES; m++)
+		vbound[m] = Vbound;
+	lane_t *bound = buffers + 3 * count;
+	for (unsigned int x = 0; x < xsize; x++)
+		bound[x] = vbound;
+
+	pthread_barrier_t barrier;
+	pthread_barrier_init(&barrier, NULL, numcores);
+
+	struct batch_args ba[numcores];
+	for (unsigned int i = 0; i < numcores; i++) {
+		ba[i].sources 	 = sources;
+		ba[i].potentials = potentials;
+		ba[i].nrhs 		 = nrhs;
+		ba[i].source 	 = buffers;
+		ba[i].input 	 = buffers + count;
+		ba[i].output 	 = buffers + 2 * count;
+		ba[i].bound 	 = bound;
+		ba[i].vbound 	 = vbound;
+		ba[i].delta 	 = delta;
+		ba[i].xsize 	 = xsize;
+		ba[i].ysize 	 = ysize;
+		ba[i].zsize 	 = zsize;
+		// Spread the remainder planes one each over the first threads
+		ba[i].zstart 	 = (unsigned int)((size_t)zsize * i / numcores);
+		ba[i].zend 		 = (unsigned int)((size_t)zsize * (i + 1) / numcores);
+		ba[i].numiters 	 = numiters;
+		ba[i].barrier 	 = &barrier;
+
+		if (pthread_create(&ba[i].thread, NULL, batch_thread, (void *)&ba[i]) != 0) {
+			fprintf(stderr, "Could not create thread %d\n", i);
+		}
+	}
+
+	for (unsigned int i = 0; i < numcores; i++) {
+		pthread_join(ba[i].thread, NULL);
+	}
+
+	pthread_barrier_destroy(&barrier);
+	free(buffers);
+}
+
+
+// Relax planes [zstart, zend) of one interleaved iteration from in to out
+static void batch_sweep(const struct batch_args *ba, const lane_t *__restrict__ in, lane_t *__restrict__ out)
+{
+	const unsigned int xs = ba->xsize;
+	const unsigned int ys = ba->ysize;
+	const unsigned int zs = ba->zsize;
+	const size_t plane = (size_t)xs * ys;
+	const lane_t vb = ba->vbound;
+
+	for (unsigned int z = ba->zstart; z < ba->zend; z++) {
+		for (unsigned int y = 0; y < ys; y++) {
+			size_t row = ((size_t)z * ys + y) * xs;
+			const lane_t *c  = in + row;
+			const lane_t *s  = ba->source + row;
+			const lane_t *ym = y > 0 	  ? c - xs 	  : ba->bound;
+			const lane_t *yp = y < ys - 1 ? c + xs 	  : ba->bound;
+			const lane_t *zm = z > 0 	  ? c - plane : ba->bound;
+			const lane_t *zp = z < zs - 1 ? c + plane : ba->bound;
+			lane_t *o = out + row;
+
+			if (xs == 1) {
+				o[0] = LANE_UPDATE(vb, vb, yp[0], ym[0], zp[0], zm[0], s[0]);
+				continue;
+			}
+
+			o[0] = LANE_UPDATE(c[1], vb, yp[0], ym[0], zp[0], zm[0], s[0]);
+			for (unsigned int x = 1; x < xs - 1; x++) {
+				o[x] = LANE_UPDATE(c[x + 1], c[x - 1], yp[x], ym[x], zp[x], zm[x], s[x]);
+			}
+			o[xs - 1] = LANE_UPDATE(vb, c[xs - 2], yp[xs - 1], ym[xs - 1], zp[xs - 1], zm[xs - 1], s[xs - 1]);
+		}
+	}
+}
+
+
+static void *batch_thread(void *args)
+{
+	struct batch_args *ba = (struct batch_args *)args;
+	const size_t plane = (size_t)ba->xsize * ba->ysize;
+	const size_t first = ba->zstart * plane;
+	const size_t last = ba->zend * plane;
+	const double d2 = ba->delta * ba->delta;
+
+	for (unsigned int group = 0; group < ba->nrhs; group += BATCH_LANES) {
+		unsigned int lanes = ba->nrhs - group < BATCH_LANES ? ba->nrhs - group : BATCH_LANES;
+		lane_t *in = ba->input;
+		lane_t *out = ba->output;
+
+		// Interleave this thread's planes of the sources.  As in
+		// poisson_dirichlet the source is also the first iterate.
+		// Unused lanes carry a zero source.
+		for (size_t i = first; i < last; i++) {
+			for (unsigned int m = 0; m < BATCH_LANES; m++) {
+				double s = m < lanes ? ba->sources[group + m][i] : 0;
+				in[i][m] = s;
+				ba->source[i][m] = d2 * s;
+			}
+		}
+		pthread_barrier_wait(ba->barrier);
+
+		for (unsigned int iter = 0; iter < ba->numiters; iter++) {
+			batch_sweep(ba, in, out);
+
+			lane_t *temp = in;
+			in = out;
+			out = temp;
+
+			pthread_barrier_wait(ba->barrier);
+		}
+
+		// De-interleave this thread's planes of the result.  No other
+		// thread touches these planes until after the next pack barrier.
+		for (size_t i = first; i < last; i++) {
+			for (unsigned int m = 0; m < lanes; m++) {
+				ba->potentials[group + m][i] = in[i][m];
+			}
+		}
+	}
+
+	return NULL;
+}
@@ -0,0 +1,192 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "poisson.hpp"
+#include "poisson_kernel.hpp"
+
+// Cuts across x are rounded to this many doubles (one cache line) so that
+// two workers never write the same line at a block edge
+#define BLOCK_X_ALIGN 8
+
+// structure we're going to use for arguments to our block pthread function
+struct block_args {
+	struct poisson_grid *grid;
+	struct poisson_block block;
+	const double *source;
+	double *potential;
+	double *scratch;
+	unsigned int numiters;
+	pthread_barrier_t *barrier;
+	pthread_t thread;
+};
+
+static void *block_thread(void *args);
+
+// Cut [0, size) into parts nearly equal ranges and return the start of
+// range i.  Ranges are whole multiples of align (bar the last), and the
+// first ones get one unit more rather than the last getting the remainder.
+static unsigned int block_cut(unsigned int size, unsigned int parts, unsigned int i, unsigned int align)
+{
+	unsigned int units = (size + align - 1) / align;
+	size_t cut = (size_t)units * i / parts * align;
+	return cut < size ? (unsigned int)cut : size;
+}
+
+/// Factor numcores into a px * py * pz grid of blocks that minimises the
+/// total halo surface between blocks, and fill in the extent of each block.
+/// Among equal cost factorisations, cuts across z are preferred to cuts
+/// across y, and both to cuts across x, to keep rows long and contiguous.
+/// If numcores exceeds the number of voxels fewer blocks are used.
+/// \param numcores is the number of blocks wanted
+/// \param dims receives px, py and pz
+/// \param blocks receives the extents of the blocks, numcores entries
+/// \return the number of blocks, px * py * pz
+unsigned int poisson_decompose (unsigned int numcores,
+                                unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                                unsigned int dims[3], struct poisson_block *blocks)
+{
+	for (unsigned int n = numcores; n > 0; n--) {
+		double best = -1;
+
+		for (unsigned int pz = n; pz > 0; pz--) {
+			if (n % pz != 0 || pz > zsize)
+				continue;
+			for (unsigned int py = n / pz; py > 0; py--) {
+				unsigned int px = n / pz / py;
+				if ((n / pz) % py != 0 || py > ysize || px > (xsize + BLOCK_X_ALIGN - 1) / BLOCK_X_ALIGN)
+					continue;
+
+				double cost = (double)(px - 1) * ysize * zsize
+							+ (double)(py - 1) * xsize * zsize
+							+ (double)(pz - 1) * xsize * ysize;
+				if (best < 0 || cost < best) {
+					best = cost;
+					dims[0] = px;
+					dims[1] = py;
+					dims[2] = pz;
+				}
+			}
+		}
+		if (best < 0)
+			continue;
+
+		for (unsigned int i = 0; i < n; i++) {
+			unsigned int bx = i % dims[0];
+			unsigned int by = (i / dims[0]) % dims[1];
+			unsigned int bz = i / (dims[0] * dims[1]);
+			blocks[i].x0 = block_cut(xsize, dims[0], bx, BLOCK_X_ALIGN);
+			blocks[i].x1 = block_cut(xsize, dims[0], bx + 1, BLOCK_X_ALIGN);
+			blocks[i].y0 = block_cut(ysize, dims[1], by, 1);
+			blocks[i].y1 = block_cut(ysize, dims[1], by + 1, 1);
+			blocks[i].z0 = block_cut(zsize, dims[2], bz, 1);
+			blocks[i].z1 = block_cut(zsize, dims[2], bz + 1, 1);
+		}
+		return n;
+	}
+	return 0;
+}
+
+/// Solve Poisson's equation with the same arguments as poisson_dirichlet,
+/// with each worker relaxing one block of a px * py * pz decomposition
+/// chosen by poisson_decompose.
+void poisson_dirichlet_blocks (double * __restrict__ source,
+                               double * __restrict__ potential,
+                               double Vbound,
+                               unsigned int xsize, unsigned int ysize, unsigned int zsize, double delta,
+                               unsigned int numiters, unsigned int numcores)
+{
+	if (numcores == 0)
+		numcores = sysconf(_SC_NPROCESSORS_ONLN);
+
+	size_t size = (size_t)xsize * ysize * zsize * sizeof(double);
+	struct poisson_block blocks[numcores];
+	unsigned int dims[3];
+	numcores = poisson_decompose(numcores, xsize, ysize, zsize, dims, blocks);
+
+	double *scratch = (double *)malloc(size);
+	double *bound = poisson_bound_row(xsize, Vbound);
+	if (!scratch || !bound) {
+		fprintf(stderr, "malloc failure\n");
+		free(scratch);
+		free(bound);
+		return;
+	}
+
+	struct poisson_grid grid;
+	grid.source = source;
+	grid.bound = bound;
+	grid.Vbound = Vbound;
+	grid.delta = delta;
+	grid.xsize = xsize;
+	grid.ysize = ysize;
+	grid.zsize = zsize;
+
+	pthread_barrier_t barrier;
+	pthread_barrier_init(&barrier, NULL, numcores);
+
+	struct block_args ba[numcores];
+	for (unsigned int i = 0; i < numcores; i++) {
+		ba[i].grid 		= &grid;
+		ba[i].block 	= blocks[i];
+		ba[i].source 	= source;
+		ba[i].potential = potential;
+		ba[i].scratch 	= scratch;
+		ba[i].numiters 	= numiters;
+		ba[i].barrier 	= &barrier;
+
+		if (pthread_create(&ba[i].thread, NULL, block_thread, (void *)&ba[i]) != 0) {
+			fprintf(stderr, "Could not create thread %d\n", i);
+		}
+	}
+	for (unsigned int i = 0; i < numcores; i++) {
+		pthread_join(ba[i].thread, NULL);
+	}
+
+	pthread_barrier_destroy(&barrier);
+	free(bound);
+	free(scratch);
+}
+
+
+// Copy the rows of block b from one grid to another
+static void block_copy(const struct poisson_grid *g, const struct poisson_block *b,
+                       double *__restrict__ dst, const double *__restrict__ src)
+{
+	for (unsigned int z = b->z0; z < b->z1; z++) {
+		for (unsigned int y = b->y0; y < b->y1; y++) {
+			size_t row = ((size_t)z * g->ysize + y) * g->xsize;
+			memcpy(dst + row + b->x0, src + row + b->x0, (b->x1 - b->x0) * sizeof(double));
+		}
+	}
+}
+
+
+static void *block_thread(void *args)
+{
+	struct block_args *ba = (struct block_args *)args;
+	const struct poisson_block *b = &ba->block;
+	double *in = ba->scratch;
+	double *out = ba->potential;
+
+	// As in poisson_dirichlet the source is the first iterate
+	block_copy(ba->grid, b, in, ba->source);
+	pthread_barrier_wait(ba->barrier);
+
+	for (unsigned int iter = 0; iter < ba->numiters; iter++) {
+		poisson_sweep(ba->grid, in, out, b->x0, b->x1, b->y0, b->y1, b->z0, b->z1);
+
+		double *temp = in;
+		in = out;
+		out = temp;
+
+		pthread_barrier_wait(ba->barrier);
+	}
+
+	if (in != ba->potential)
+		block_copy(ba->grid, b, ba->potential, in);
+
+	return NULL;
+}
@@ -0,0 +1,498 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "poisson.hpp"
+
+// The grid is coded in independent 4 x 4 x 4 blocks, the coefficients of
+// each block in groups that share one bit width
+#define BLOCK_SIDE 	4
+#define BLOCK_SIZE 	64
+#define GROUP_SIZE 	8
+#define WIDTH_BITS 	7
+
+// Worst case for one block: every group at the full 64 bits
+#define BLOCK_MAX_BYTES ((BLOCK_SIZE / GROUP_SIZE * WIDTH_BITS + BLOCK_SIZE * 64) / 8 + 1)
+
+// Quantised values must stay well inside an int64 after the transform
+#define QUANT_LIMIT 4503599627370496.0 	// 2^52
+
+static const char stream_magic[4] = {'P', 'Z', '0', '1'};
+
+// Start of every stream.  Layer l, the blocks of planes [4l, 4l + 4), is
+// coded from payload byte offsets[l] to offsets[l + 1], where the offsets
+// follow the header and the payload follows the offsets.
+struct stream_header {
+	char magic[4];
+	uint32_t xsize, ysize, zsize;
+	uint32_t layers;
+	uint32_t reserved;
+	double step;
+};
+
+struct bit_writer {
+	unsigned char *buf;
+	size_t size;
+	size_t bytes;
+	uint64_t acc;
+	unsigned int nacc;
+};
+
+struct bit_reader {
+	const unsigned char *p;
+	const unsigned char *end;
+	uint64_t acc;
+	unsigned int nacc;
+	int overrun;					// set if a read went past end
+};
+
+// structure we're going to use for arguments to the coder threads
+struct compress_args {
+	const double *data;
+	unsigned char *stream;			// whole stream, when decoding
+	const uint64_t *offsets;		// payload offsets, when decoding
+	unsigned int xsize, ysize, zsize;
+	double step;
+	double tolerance;
+	const unsigned char *order;
+	unsigned int l0, l1;			// layers [l0, l1) of this thread
+	struct bit_writer bw;
+	uint64_t *sizes;				// coded bytes of each of its layers
+	double *out;
+	int status;
+	int threaded;
+	pthread_t thread;
+};
+
+static void *compress_thread(void *args);
+static void *decompress_thread(void *args);
+
+
+// Sequency order of the block coefficients: coarsest first, so that the
+// groups at the end, which hold the finest details, are mostly zero
+static void block_order(unsigned char order[BLOCK_SIZE])
+{
+	static const unsigned int rank[BLOCK_SIDE] = {0, 1, 2, 2};
+	unsigned int n = 0;
+	for (unsigned int r = 0; r <= 6; r++)
+		for (unsigned int i = 0; i < BLOCK_SIZE; i++)
+			if (rank[i & 3] + rank[(i >> 2) & 3] + rank[i >> 4] == r)
+				order[n++] = i;
+}
+
+// Two levels of the reversible integer Haar (S) transform on 4 values
+// with the given stride, leaving them in the order ss, sd, d0, d1
+static inline void lift_forward(int64_t *p, unsigned int s)
+{
+	int64_t d0 = p[s] - p[0];
+	int64_t s0 = p[0] + (d0 >> 1);
+	int64_t d1 = p[3 * s] - p[2 * s];
+	int64_t s1 = p[2 * s] + (d1 >> 1);
+	int64_t sd = s1 - s0;
+	p[0] = s0 + (sd >> 1);
+	p[s] = sd;
+	p[2 * s] = d0;
+	p[3 * s] = d1;
+}
+
+static inline void lift_inverse(int64_t *p, unsigned int s)
+{
+	int64_t sd = p[s];
+	int64_t s0 = p[0] - (sd >> 1);
+	int64_t s1 = sd + s0;
+	int64_t d0 = p[2 * s];
+	int64_t d1 = p[3 * s];
+	p[0] = s0 - (d0 >> 1);
+	p[s] = d0 + p[0];
+	p[2 * s] = s1 - (d1 >> 1);
+	p[3 * s] = d1 + p[2 * s];
+}
+
+static void block_forward(int64_t *b)
+{
+	for (unsigned int i = 0; i < 16; i++)
+		lift_forward(b + 4 * i, 1);
+	for (unsigned int z = 0; z < 4; z++)
+		for (unsigned int x = 0; x < 4; x++)
+			lift_forward(b + 16 * z + x, 4);
+	for (unsigned int i = 0; i < 16; i++)
+		lift_forward(b + i, 16);
+}
+
+static void block_inverse(int64_t *b)
+{
+	for (unsigned int i = 0; i < 16; i++)
+		lift_inverse(b + i, 16);
+	for (unsigned int z = 0; z < 4; z++)
+		for (unsigned int x = 0; x < 4; x++)
+			lift_inverse(b + 16 * z + x, 4);
+	for (unsigned int i = 0; i < 16; i++)
+		lift_inverse(b + 4 * i, 1);
+}
+
+// Append the low n <= 32 bits of v
+static inline void bits_put(struct bit_writer *bw, uint64_t v, unsigned int n)
+{
+	bw->acc |= (v & ((1ULL << n) - 1)) << bw->nacc;
+	bw->nacc += n;
+	while (bw->nacc >= 8) {
+		bw->buf[bw->bytes++] = (unsigned char)bw->acc;
+		bw->acc >>= 8;
+		bw->nacc -= 8;
+	}
+}
+
+static inline void bits_put64(struct bit_writer *bw, uint64_t v, unsigned int n)
+{
+	if (n > 32) {
+		bits_put(bw, v, 32);
+		bits_put(bw, v >> 32, n - 32);
+	} else {
+		bits_put(bw, v, n);
+	}
+}
+
+// Pad to a byte boundary
+static inline void bits_flush(struct bit_writer *bw)
+{
+	if (bw->nacc > 0)
+		bits_put(bw, 0, 8 - bw->nacc);
+}
+
+// Read n <= 32 bits.  Past the end the bits read as zero and overrun is set.
+static inline uint64_t bits_get(struct bit_reader *br, unsigned int n)
+{
+	while (br->nacc < n) {
+		uint64_t byte = 0;
+		if (br->p < br->end)
+			byte = *br->p++;
+		else
+			br->overrun = 1;
+		br->acc |= byte << br->nacc;
+		br->nacc += 8;
+	}
+	uint64_t v = br->acc & ((1ULL << n) - 1);
+	br->acc >>= n;
+	br->nacc -= n;
+	return v;
+}
+
+static inline uint64_t bits_get64(struct bit_reader *br, unsigned int n)
+{
+	if (n > 32) {
+		uint64_t lo = bits_get(br, 32);
+		return lo | bits_get(br, n - 32) << 32;
+	}
+	return bits_get(br, n);
+}
+
+static inline uint64_t zigzag(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t u)
+{
+	return (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+}
+
+static inline unsigned int bit_width(uint64_t v)
+{
+	return v ? 64 - __builtin_clzll(v) : 0;
+}
+
+/// Compress a grid so that every voxel is reproduced to within an absolute
+/// error bound.  Each 4 x 4 x 4 block is quantised, decorrelated with a
+/// reversible integer transform and coded with a bit width per group of
+/// coefficients, so smooth fields shrink to a few bits per voxel.  Layers
+/// of blocks are coded independently by numcores threads.
+/// \param data is a flattened 3-D array, ordered as for poisson_dirichlet
+/// \param tolerance is the largest absolute error allowed in any voxel
+/// \param stream receives a malloc'd buffer holding the compressed grid
+/// \param numcores is the number of threads to use.  If 0, one per core
+/// \return the size of the stream in bytes, or 0 if tolerance is not
+///         positive or too small for the range of the data
+size_t poisson_compress (const double *data,
+                         unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                         double tolerance, unsigned char **stream, unsigned int numcores)
+{
+	*stream = NULL;
+	if (!(tolerance > 0))
+		return 0;
+
+	unsigned int layers = (zsize + BLOCK_SIDE - 1) / BLOCK_SIDE;
+	if (numcores == 0)
+		numcores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (numcores > layers)
+		numcores = layers > 0 ? layers : 1;
+
+	struct stream_header h;
+	memcpy(h.magic, stream_magic, sizeof(h.magic));
+	h.xsize = xsize;
+	h.ysize = ysize;
+	h.zsize = zsize;
+	h.layers = layers;
+	h.reserved = 0;
+	// Just under twice the tolerance, so that rounding in the
+	// reconstruction cannot take the error past the bound
+	h.step = 2 * tolerance * (1 - 1.0 / (1 << 20));
+
+	unsigned char order[BLOCK_SIZE];
+	block_order(order);
+
+	uint64_t *sizes = (uint64_t *)calloc(layers + 1, sizeof(uint64_t));
+	if (!sizes) {
+		fprintf(stderr, "malloc failure\n");
+		return 0;
+	}
+
+	struct compress_args ca[numcores];
+	for (unsigned int i = 0; i < numcores; i++) {
+		memset(&ca[i], 0, sizeof(ca[i]));
+		ca[i].data 		= data;
+		ca[i].xsize 	= xsize;
+		ca[i].ysize 	= ysize;
+		ca[i].zsize 	= zsize;
+		ca[i].step 		= h.step;
+		ca[i].tolerance = tolerance;
+		ca[i].order 	= order;
+		ca[i].l0 		= (unsigned int)((size_t)layers * i / numcores);
+		ca[i].l1 		= (unsigned int)((size_t)layers * (i + 1) / numcores);
+		ca[i].sizes 	= sizes;
+		ca[i].status 	= -1;
+		ca[i].threaded 	= pthread_create(&ca[i].thread, NULL, compress_thread, (void *)&ca[i]) == 0;
+		if (!ca[i].threaded)
+			compress_thread(&ca[i]);
+	}
+
+	int status = 0;
+	size_t payload = 0;
+	for (unsigned int i = 0; i < numcores; i++) {
+		if (ca[i].threaded)
+			pthread_join(ca[i].thread, NULL);
+		if (ca[i].status != 0)
+			status = -1;
+		payload += ca[i].bw.bytes;
+	}
+
+	size_t head = sizeof(h) + (layers + 1) * sizeof(uint64_t);
+	unsigned char *out = status == 0 ? (unsigned char *)malloc(head + payload) : NULL;
+	if (out) {
+		// The per-layer sizes become payload offsets
+		uint64_t *offsets = (uint64_t *)(out + sizeof(h));
+		uint64_t offset = 0;
+		for (unsigned int l = 0; l <= layers; l++) {
+			uint64_t n = sizes[l];
+			offsets[l] = offset;
+			offset += n;
+		}
+		memcpy(out, &h, sizeof(h));
+		unsigned char *p = out + head;
+		for (unsigned int i = 0; i < numcores; i++) {
+			memcpy(p, ca[i].bw.buf, ca[i].bw.bytes);
+			p += ca[i].bw.bytes;
+		}
+	} else if (status == 0) {
+		fprintf(stderr, "malloc failure\n");
+	}
+
+	for (unsigned int i = 0; i < numcores; i++)
+		free(ca[i].bw.buf);
+	free(sizes);
+	*stream = out;
+	return out ? head + payload : 0;
+}
+
+/// Reconstruct a grid from a stream made by poisson_compress
+/// \param stream is the compressed grid
+/// \param bytes is the size of the stream
+/// \param data receives the xsize * ysize * zsize voxels
+/// \param numcores is the number of threads to use.  If 0, one per core
+/// \return 0 on success, -1 if the stream is malformed or of another size of
+///         grid, in which case data may have been partly written
+int poisson_decompress (const unsigned char *stream, size_t bytes, double *data,
+                        unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                        unsigned int numcores)
+{
+	struct stream_header h;
+	if (bytes < sizeof(h))
+		return -1;
+	memcpy(&h, stream, sizeof(h));
+	size_t head = sizeof(h) + ((size_t)h.layers + 1) * sizeof(uint64_t);
+	if (memcmp(h.magic, stream_magic, sizeof(stream_magic)) != 0
+		|| h.xsize != xsize || h.ysize != ysize || h.zsize != zsize
+		|| h.layers != (zsize + BLOCK_SIDE - 1) / BLOCK_SIDE || bytes < head) {
+		fprintf(stderr, "not a compressed grid of %u x %u x %u\n", xsize, ysize, zsize);
+		return -1;
+	}
+
+	// Streams start on a malloc or page boundary, so the offsets are aligned.
+	// The layers must tile the payload exactly, with nothing left over.
+	const uint64_t *offsets = (const uint64_t *)(stream + sizeof(h));
+	int bad = offsets[0] != 0 || offsets[h.layers] != bytes - head;
+	for (unsigned int l = 0; l < h.layers && !bad; l++)
+		bad = offsets[l] > offsets[l + 1];
+	if (bad) {
+		fprintf(stderr, "corrupt compressed grid\n");
+		return -1;
+	}
+
+	unsigned char order[BLOCK_SIZE];
+	block_order(order);
+
+	unsigned int layers = h.layers;
+	if (numcores == 0)
+		numcores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (numcores > layers)
+		numcores = layers > 0 ? layers : 1;
+
+	struct compress_args ca[numcores];
+	for (unsigned int i = 0; i < numcores; i++) {
+		memset(&ca[i], 0, sizeof(ca[i]));
+		ca[i].stream 	= (unsigned char *)stream + head;
+		ca[i].offsets 	= offsets;
+		ca[i].xsize 	= xsize;
+		ca[i].ysize 	= ysize;
+		ca[i].zsize 	= zsize;
+		ca[i].step 		= h.step;
+		ca[i].order 	= order;
+		ca[i].l0 		= (unsigned int)((size_t)layers * i / numcores);
+		ca[i].l1 		= (unsigned int)((size_t)layers * (i + 1) / numcores);
+		ca[i].out 		= data;
+		ca[i].status 	= -1;
+		ca[i].threaded 	= pthread_create(&ca[i].thread, NULL, decompress_thread, (void *)&ca[i]) == 0;
+		if (!ca[i].threaded)
+			decompress_thread(&ca[i]);
+	}
+	int status = 0;
+	for (unsigned int i = 0; i < numcores; i++) {
+		if (ca[i].threaded)
+			pthread_join(ca[i].thread, NULL);
+		if (ca[i].status != 0)
+			status = -1;
+	}
+	if (status != 0)
+		fprintf(stderr, "corrupt compressed grid\n");
+	return status;
+}
+
+
+// Voxel (x, y, z) of a block, with blocks overhanging the grid taking the
+// nearest voxel inside it so that they stay smooth
+static inline size_t block_index(const struct compress_args *ca, unsigned int x, unsigned int y, unsigned int z)
+{
+	if (x >= ca->xsize)
+		x = ca->xsize - 1;
+	if (y >= ca->ysize)
+		y = ca->ysize - 1;
+	if (z >= ca->zsize)
+		z = ca->zsize - 1;
+	return ((size_t)z * ca->ysize + y) * ca->xsize + x;
+}
+
+
+static void *compress_thread(void *args)
+{
+	struct compress_args *ca = (struct compress_args *)args;
+	struct bit_writer *bw = &ca->bw;
+	const double inv = 1 / ca->step;
+	int64_t b[BLOCK_SIZE];
+
+	for (unsigned int l = ca->l0; l < ca->l1; l++) {
+		size_t start = bw->bytes;
+		for (unsigned int by = 0; by < ca->ysize; by += BLOCK_SIDE) {
+			for (unsigned int bx = 0; bx < ca->xsize; bx += BLOCK_SIDE) {
+				if (bw->size - bw->bytes < BLOCK_MAX_BYTES) {
+					size_t size = bw->size ? 2 * bw->size : 64 * BLOCK_MAX_BYTES;
+					unsigned char *buf = (unsigned char *)realloc(bw->buf, size);
+					if (!buf) {
+						fprintf(stderr, "malloc failure\n");
+						return NULL;
+					}
+					bw->buf = buf;
+					bw->size = size;
+				}
+
+				for (unsigned int i = 0; i < BLOCK_SIZE; i++) {
+					double v = ca->data[block_index(ca, bx + (i & 3), by + ((i >> 2) & 3),
+													BLOCK_SIDE * l + (i >> 4))];
+					double q = nearbyint(v * inv);
+					if (!(fabs(q) < QUANT_LIMIT) || fabs(v - q * ca->step) > ca->tolerance) {
+						fprintf(stderr, "compression tolerance %g too small for value %g\n",
+								ca->tolerance, v);
+						return NULL;
+					}
+					b[i] = (int64_t)q;
+				}
+				block_forward(b);
+
+				for (unsigned int g = 0; g < BLOCK_SIZE; g += GROUP_SIZE) {
+					uint64_t u[GROUP_SIZE];
+					uint64_t all = 0;
+					for (unsigned int i = 0; i < GROUP_SIZE; i++) {
+						u[i] = zigzag(b[ca->order[g + i]]);
+						all |= u[i];
+					}
+					unsigned int n = bit_width(all);
+					bits_put(bw, n, WIDTH_BITS);
+					for (unsigned int i = 0; n > 0 && i < GROUP_SIZE; i++)
+						bits_put64(bw, u[i], n);
+				}
+			}
+		}
+		bits_flush(bw);
+		ca->sizes[l] = bw->bytes - start;
+	}
+
+	ca->status = 0;
+	return NULL;
+}
+
+
+static void *decompress_thread(void *args)
+{
+	struct compress_args *ca = (struct compress_args *)args;
+	int64_t b[BLOCK_SIZE];
+
+	for (unsigned int l = ca->l0; l < ca->l1; l++) {
+		struct bit_reader br;
+		br.p = ca->stream + ca->offsets[l];
+		br.end = ca->stream + ca->offsets[l + 1];
+		br.acc = 0;
+		br.nacc = 0;
+		br.overrun = 0;
+
+		for (unsigned int by = 0; by < ca->ysize; by += BLOCK_SIDE) {
+			for (unsigned int bx = 0; bx < ca->xsize; bx += BLOCK_SIDE) {
+				for (unsigned int g = 0; g < BLOCK_SIZE; g += GROUP_SIZE) {
+					unsigned int n = (unsigned int)bits_get(&br, WIDTH_BITS);
+					if (n > 64)
+						return NULL;
+					for (unsigned int i = 0; i < GROUP_SIZE; i++)
+						b[ca->order[g + i]] = n > 0 ? unzigzag(bits_get64(&br, n)) : 0;
+				}
+				block_inverse(b);
+
+				for (unsigned int i = 0; i < BLOCK_SIZE; i++) {
+					unsigned int x = bx + (i & 3);
+					unsigned int y = by + ((i >> 2) & 3);
+					unsigned int z = BLOCK_SIDE * l + (i >> 4);
+					if (x < ca->xsize && y < ca->ysize && z < ca->zsize)
+						ca->out[((size_t)z * ca->ysize + y) * ca->xsize + x] = b[i] * ca->step;
+				}
+			}
+		}
+
+		// A layer ends on a byte boundary, so decoding it must use up
+		// exactly its bytes, no more and no fewer
+		if (br.overrun || br.p != br.end)
+			return NULL;
+	}
+
+	ca->status = 0;
+	return NULL;
+}
@@ -0,0 +1,332 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "poisson.hpp"
+
+static const char grid_magic[8] = {'P', 'G', 'R', 'I', 'D', '\0', '\0', '\0'};
+
+#define FNV_OFFSET 	0xcbf29ce484222325ULL
+#define FNV_PRIME 	0x100000001b3ULL
+
+// structure we're going to use for arguments to the slab writer threads
+struct grid_io_args {
+	int fd;
+	const unsigned char *data;
+	size_t plane_bytes;
+	unsigned int z0;
+	unsigned int z1;
+	off_t offset;
+	uint64_t checksum;
+	int status;
+	int threaded;
+	pthread_t thread;
+};
+
+/// Checksum of a run of planes.  Each plane is hashed with FNV-1a over
+/// 64-bit words, seeded with its plane index, and the plane hashes are
+/// summed.  The sum does not depend on how planes are split over threads.
+static uint64_t grid_checksum(const unsigned char *data, size_t plane_bytes, unsigned int z0, unsigned int z1)
+{
+	uint64_t sum = 0;
+	for (unsigned int z = z0; z < z1; z++) {
+		const unsigned char *p = data + z * plane_bytes;
+		uint64_t h = FNV_OFFSET ^ z;
+		size_t i;
+		for (i = 0; i + 8 <= plane_bytes; i += 8) {
+			uint64_t w;
+			memcpy(&w, p + i, 8);
+			h = (h ^ w) * FNV_PRIME;
+		}
+		for (; i < plane_bytes; i++)
+			h = (h ^ p[i]) * FNV_PRIME;
+		sum += h;
+	}
+	return sum;
+}
+
+
+static void *grid_write_thread(void *args)
+{
+	struct grid_io_args *ga = (struct grid_io_args *)args;
+	const unsigned char *p = ga->data + ga->z0 * ga->plane_bytes;
+	size_t left = (ga->z1 - ga->z0) * ga->plane_bytes;
+	off_t offset = ga->offset + (off_t)ga->z0 * ga->plane_bytes;
+
+	ga->checksum = grid_checksum(ga->data, ga->plane_bytes, ga->z0, ga->z1);
+	ga->status = 0;
+	while (left > 0) {
+		ssize_t n = pwrite(ga->fd, p, left, offset);
+		if (n <= 0) {
+			ga->status = -1;
+			break;
+		}
+		p += n;
+		left -= n;
+		offset += n;
+	}
+	return NULL;
+}
+
+
+static void *grid_checksum_thread(void *args)
+{
+	struct grid_io_args *ga = (struct grid_io_args *)args;
+	ga->checksum = grid_checksum(ga->data, ga->plane_bytes, ga->z0, ga->z1);
+	return NULL;
+}
+
+
+// Run fn over z-slabs of the grid on numcores threads and return the
+// summed checksum, or set *status to -1 if any slab failed
+static uint64_t grid_slabs(void *(*fn)(void *), int fd, const void *data, size_t plane_bytes,
+                           unsigned int zsize, off_t offset, unsigned int numcores, int *status)
+{
+	if (numcores == 0)
+		numcores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (numcores > zsize)
+		numcores = zsize > 0 ? zsize : 1;
+
+	struct grid_io_args ga[numcores];
+	for (unsigned int i = 0; i < numcores; i++) {
+		ga[i].fd 			= fd;
+		ga[i].data 			= (const unsigned char *)data;
+		ga[i].plane_bytes 	= plane_bytes;
+		ga[i].z0 			= (unsigned int)((size_t)zsize * i / numcores);
+		ga[i].z1 			= (unsigned int)((size_t)zsize * (i + 1) / numcores);
+		ga[i].offset 		= offset;
+		ga[i].status 		= -1;
+		ga[i].threaded 		= pthread_create(&ga[i].thread, NULL, fn, (void *)&ga[i]) == 0;
+		if (!ga[i].threaded)
+			fn(&ga[i]);
+	}
+
+	uint64_t checksum = 0;
+	*status = 0;
+	for (unsigned int i = 0; i < numcores; i++) {
+		if (ga[i].threaded)
+			pthread_join(ga[i].thread, NULL);
+		checksum += ga[i].checksum;
+		if (fn == grid_write_thread && ga[i].status != 0)
+			*status = -1;
+	}
+	return checksum;
+}
+
+/// Fill in the header of a grid file of doubles, except for the checksum
+void poisson_grid_header_init (struct poisson_grid_header *header,
+                               unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                               double delta, double Vbound)
+{
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, grid_magic, sizeof(header->magic));
+	header->version 	= POISSON_GRID_VERSION;
+	header->dtype 		= POISSON_GRID_F64;
+	header->xsize 		= xsize;
+	header->ysize 		= ysize;
+	header->zsize 		= zsize;
+	header->delta 		= delta;
+	header->Vbound 		= Vbound;
+	header->data_offset = POISSON_GRID_ALIGN;
+	header->data_bytes 	= (uint64_t)xsize * ysize * zsize * sizeof(double);
+}
+
+/// Checksum of a whole grid on the calling thread, for writers that
+/// already run off the critical path
+/// \param data is the grid described by header
+/// \return the value for poisson_grid_header::checksum
+uint64_t poisson_grid_checksum (const void *data, const struct poisson_grid_header *header)
+{
+	// A compressed stream has no planes and is hashed as a single one
+	if (header->dtype == POISSON_GRID_PZ)
+		return grid_checksum((const unsigned char *)data, header->data_bytes, 0, 1);
+	size_t elem = header->dtype == POISSON_GRID_F32 ? sizeof(float) : sizeof(double);
+	return grid_checksum((const unsigned char *)data, (size_t)header->xsize * header->ysize * elem,
+						 0, header->zsize);
+}
+
+/// Write a grid of doubles to a grid file.  The data is written straight
+/// from memory by numcores threads, each with pwrite of its own z-slab,
+/// and the header, including the checksum, is written last.
+/// \param path is the file to create or overwrite
+/// \param data is a flattened 3-D array, ordered as for poisson_dirichlet
+/// \param delta is the voxel spacing recorded in the header
+/// \param Vbound is the boundary potential recorded in the header
+/// \param numcores is the number of threads to write with.  If 0, one per core
+/// \return 0 on success, -1 on failure
+int poisson_grid_write (const char *path, const double *data,
+                        unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                        double delta, double Vbound, unsigned int numcores)
+{
+	struct poisson_grid_header h;
+	poisson_grid_header_init(&h, xsize, ysize, zsize, delta, Vbound);
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+	if (ftruncate(fd, h.data_offset + h.data_bytes) != 0) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+
+	int status;
+	h.checksum = grid_slabs(grid_write_thread, fd, data, (size_t)xsize * ysize * sizeof(double),
+							zsize, h.data_offset, numcores, &status);
+	if (status == 0 && pwrite(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h))
+		status = -1;
+	if (status != 0)
+		perror(path);
+	if (close(fd) != 0)
+		status = -1;
+	return status;
+}
+
+/// Write a grid of doubles to a grid file compressed by poisson_compress.
+/// Every voxel read back is within tolerance of data.
+/// \param iteration is recorded in the header, as for snapshots; 0 otherwise
+/// \param tolerance is the largest absolute error allowed in any voxel
+/// \param numcores is the number of threads to compress with.  If 0, one per core
+/// \return 0 on success, -1 on failure, including a tolerance too small for the data
+int poisson_grid_write_compressed (const char *path, const double *data,
+                                   unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                                   double delta, double Vbound, unsigned int iteration,
+                                   double tolerance, unsigned int numcores)
+{
+	unsigned char *stream;
+	size_t bytes = poisson_compress(data, xsize, ysize, zsize, tolerance, &stream, numcores);
+	if (bytes == 0)
+		return -1;
+
+	struct poisson_grid_header h;
+	poisson_grid_header_init(&h, xsize, ysize, zsize, delta, Vbound);
+	h.dtype = POISSON_GRID_PZ;
+	h.iteration = iteration;
+	h.data_bytes = bytes;
+	h.checksum = poisson_grid_checksum(stream, &h);
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(path);
+		free(stream);
+		return -1;
+	}
+	int status = 0;
+	if (pwrite(fd, stream, bytes, h.data_offset) != (ssize_t)bytes
+		|| pwrite(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) {
+		perror(path);
+		status = -1;
+	}
+	if (close(fd) != 0)
+		status = -1;
+	free(stream);
+	return status;
+}
+
+/// Map a grid file read-only.  The data is not copied; the returned
+/// pointer addresses the page cache directly.
+/// \param path is the file to map
+/// \param header receives the file header
+/// \param verify checks the checksum before returning if non-zero
+/// \param numcores is the number of threads used to verify the checksum.  If 0, one per core
+/// \return the grid data, or NULL if the file is missing, malformed or corrupt
+const void *poisson_grid_map (const char *path, struct poisson_grid_header *header,
+                              int verify, unsigned int numcores)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || pread(fd, header, sizeof(*header), 0) != (ssize_t)sizeof(*header)) {
+		fprintf(stderr, "%s: not a grid file\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	// The data must start after the header on an aligned boundary, and
+	// end inside the file without the sum wrapping around
+	size_t elem = header->dtype == POISSON_GRID_F32 ? sizeof(float) : sizeof(double);
+	if (memcmp(header->magic, grid_magic, sizeof(grid_magic)) != 0
+		|| header->version != POISSON_GRID_VERSION
+		|| (header->dtype != POISSON_GRID_F64 && header->dtype != POISSON_GRID_F32
+			&& header->dtype != POISSON_GRID_PZ)
+		|| (header->dtype != POISSON_GRID_PZ
+			&& header->data_bytes != (uint64_t)header->xsize * header->ysize * header->zsize * elem)
+		|| header->data_offset < sizeof(*header)
+		|| header->data_offset % POISSON_GRID_ALIGN != 0
+		|| header->data_bytes > UINT64_MAX - header->data_offset
+		|| (uint64_t)st.st_size < header->data_offset + header->data_bytes) {
+		fprintf(stderr, "%s: not a grid file\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	void *map = mmap(NULL, header->data_offset + header->data_bytes, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror(path);
+		return NULL;
+	}
+	const unsigned char *data = (const unsigned char *)map + header->data_offset;
+
+	if (verify) {
+		int status;
+		uint64_t sum = header->dtype == POISSON_GRID_PZ ? poisson_grid_checksum(data, header)
+					   : grid_slabs(grid_checksum_thread, -1, data,
+									(size_t)header->xsize * header->ysize * elem,
+									header->zsize, 0, numcores, &status);
+		if (sum != header->checksum) {
+			fprintf(stderr, "%s: checksum mismatch\n", path);
+			munmap(map, header->data_offset + header->data_bytes);
+			return NULL;
+		}
+	}
+	return data;
+}
+
+/// Read a grid file of any type into a new array of doubles, converting
+/// from floats or decompressing as needed
+/// \param path is the file to read
+/// \param header receives the file header
+/// \param numcores is the number of threads to use.  If 0, one per core
+/// \return a malloc'd array of xsize * ysize * zsize doubles, or NULL on failure
+double *poisson_grid_read (const char *path, struct poisson_grid_header *header, unsigned int numcores)
+{
+	const void *map = poisson_grid_map(path, header, 1, numcores);
+	if (!map)
+		return NULL;
+
+	size_t count = (size_t)header->xsize * header->ysize * header->zsize;
+	double *data = (double *)malloc(count * sizeof(double));
+	if (!data) {
+		fprintf(stderr, "malloc failure\n");
+	} else if (header->dtype == POISSON_GRID_F64) {
+		memcpy(data, map, count * sizeof(double));
+	} else if (header->dtype == POISSON_GRID_F32) {
+		for (size_t i = 0; i < count; i++)
+			data[i] = ((const float *)map)[i];
+	} else if (poisson_decompress((const unsigned char *)map, header->data_bytes, data,
+								  header->xsize, header->ysize, header->zsize, numcores) != 0) {
+		free(data);
+		data = NULL;
+	}
+	poisson_grid_unmap(map, header);
+	return data;
+}
+
+/// Unmap data returned by poisson_grid_map
+void poisson_grid_unmap (const void *data, const struct poisson_grid_header *header)
+{
+	if (data)
+		munmap((unsigned char *)data - header->data_offset, header->data_offset + header->data_bytes);
+}
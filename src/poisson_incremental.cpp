@@ -0,0 +1,309 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "poisson.hpp"
+#include "poisson_kernel.hpp"
+
+// What each worker reports per region after a sweep: the largest change
+// anywhere, then on each face
+#define CHANGE_ALL 	0
+#define CHANGE_X0 	1
+#define CHANGE_X1 	2
+#define CHANGE_Y0 	3
+#define CHANGE_Y1 	4
+#define CHANGE_Z0 	5
+#define CHANGE_Z1 	6
+#define CHANGES 	7
+
+// State shared by the workers of one poisson_resolve_local call
+struct local_engine {
+	struct poisson_grid grid;
+	double *potential;
+	double *scratch;
+	struct poisson_block *regions;	// active regions, disjoint
+	unsigned int nregions;
+	unsigned int nplanes;			// planes summed over the regions
+	double *changes;				// changes[(id * maxregions + r) * CHANGES + i]
+	unsigned int maxregions;
+	unsigned int workers;
+	unsigned int maxiters;
+	unsigned int done;
+	double tolerance;
+	int stop;
+	pthread_barrier_t barrier;
+};
+
+// structure we're going to use for arguments to our local pthread function
+struct local_args {
+	struct local_engine *e;
+	unsigned int id;
+	pthread_t thread;
+};
+
+static void *local_thread(void *args);
+
+/// Re-solve Poisson's equation after the source has changed only inside
+/// a few boxes.  The previous potential is the starting point, and only
+/// active regions, starting one voxel around each edit, are relaxed.  A
+/// region grows by a voxel through any face where the last sweep changed
+/// something by more than tolerance, regions that meet are merged, and the
+/// solve stops once no voxel in any region changes by more than tolerance.
+/// Outside the regions the potential is left untouched.
+/// \param source is the new source function
+/// \param potential holds the solution for the old source, and receives the new one
+/// \param edits are the boxes where the source changed
+/// \param nedits is the number of edits
+/// \param maxiters is the most iterations to perform
+/// \param tolerance is the change below which the potential is taken as converged
+/// \param numcores is the number of CPU cores to use.  If 0, an optimal number is chosen
+/// \return the number of iterations performed
+unsigned int poisson_resolve_local (double *__restrict__ source,
+                                    double *__restrict__ potential,
+                                    double Vbound,
+                                    unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                                    double delta,
+                                    const struct poisson_block *edits, unsigned int nedits,
+                                    unsigned int maxiters, double tolerance, unsigned int numcores)
+{
+	if (numcores == 0)
+		numcores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nedits == 0 || maxiters == 0)
+		return 0;
+
+	size_t size = (size_t)xsize * ysize * zsize * sizeof(double);
+	double *scratch = (double *)malloc(size);
+	double *bound = poisson_bound_row(xsize, Vbound);
+	struct poisson_block *regions = (struct poisson_block *)malloc(nedits * sizeof(*regions));
+	double *changes = (double *)calloc((size_t)numcores * nedits * CHANGES, sizeof(double));
+	if (!scratch || !bound || !regions || !changes) {
+		fprintf(stderr, "malloc failure\n");
+		free(scratch);
+		free(bound);
+		free(regions);
+		free(changes);
+		return 0;
+	}
+
+	// Outside the regions both buffers always hold the old solution, so a
+	// region can grow into either of them
+	memcpy(scratch, potential, size);
+
+	struct local_engine e;
+	e.grid.source = source;
+	e.grid.bound = bound;
+	e.grid.Vbound = Vbound;
+	e.grid.delta = delta;
+	e.grid.xsize = xsize;
+	e.grid.ysize = ysize;
+	e.grid.zsize = zsize;
+	e.potential = potential;
+	e.scratch = scratch;
+	e.regions = regions;
+	e.nregions = 0;
+	e.changes = changes;
+	e.maxregions = nedits;
+	e.workers = numcores;
+	e.maxiters = maxiters;
+	e.done = 0;
+	e.tolerance = tolerance;
+	e.stop = 0;
+
+	for (unsigned int i = 0; i < nedits; i++) {
+		struct poisson_block r = edits[i];
+		r.x0 = r.x0 > 0 ? r.x0 - 1 : 0;
+		r.y0 = r.y0 > 0 ? r.y0 - 1 : 0;
+		r.z0 = r.z0 > 0 ? r.z0 - 1 : 0;
+		r.x1 = r.x1 < xsize ? r.x1 + 1 : xsize;
+		r.y1 = r.y1 < ysize ? r.y1 + 1 : ysize;
+		r.z1 = r.z1 < zsize ? r.z1 + 1 : zsize;
+		if (r.x0 < r.x1 && r.y0 < r.y1 && r.z0 < r.z1)
+			regions[e.nregions++] = r;
+	}
+	poisson_merge_blocks(regions, &e.nregions);
+	e.nplanes = 0;
+	for (unsigned int r = 0; r < e.nregions; r++)
+		e.nplanes += regions[r].z1 - regions[r].z0;
+
+	pthread_barrier_init(&e.barrier, NULL, numcores);
+	struct local_args la[numcores];
+	for (unsigned int i = 0; i < numcores; i++) {
+		la[i].e = &e;
+		la[i].id = i;
+		if (pthread_create(&la[i].thread, NULL, local_thread, (void *)&la[i]) != 0) {
+			fprintf(stderr, "Could not create thread %d\n", i);
+		}
+	}
+	for (unsigned int i = 0; i < numcores; i++) {
+		pthread_join(la[i].thread, NULL);
+	}
+	pthread_barrier_destroy(&e.barrier);
+
+	// The last iterate is in scratch after an odd number of sweeps, and
+	// only differs from the potential inside the regions
+	if (e.done % 2 == 1) {
+		for (unsigned int r = 0; r < e.nregions; r++) {
+			const struct poisson_block *b = &regions[r];
+			for (unsigned int z = b->z0; z < b->z1; z++) {
+				for (unsigned int y = b->y0; y < b->y1; y++) {
+					size_t row = ((size_t)z * ysize + y) * xsize;
+					memcpy(potential + row + b->x0, scratch + row + b->x0,
+						   (b->x1 - b->x0) * sizeof(double));
+				}
+			}
+		}
+	}
+
+	free(changes);
+	free(regions);
+	free(bound);
+	free(scratch);
+	return e.done;
+}
+
+/// Merge overlapping or touching boxes into their bounding boxes until
+/// none overlap or touch
+/// \param blocks are the boxes, overwritten with the merged ones
+/// \param nblocks is the number of boxes, updated to the number merged
+void poisson_merge_blocks (struct poisson_block *blocks, unsigned int *nblocks)
+{
+	unsigned int n = *nblocks;
+	for (unsigned int i = 0; i < n; i++) {
+		for (unsigned int j = i + 1; j < n; j++) {
+			struct poisson_block *a = &blocks[i];
+			const struct poisson_block *b = &blocks[j];
+			if (a->x0 > b->x1 || b->x0 > a->x1 || a->y0 > b->y1 || b->y0 > a->y1
+				|| a->z0 > b->z1 || b->z0 > a->z1)
+				continue;
+			a->x0 = a->x0 < b->x0 ? a->x0 : b->x0;
+			a->y0 = a->y0 < b->y0 ? a->y0 : b->y0;
+			a->z0 = a->z0 < b->z0 ? a->z0 : b->z0;
+			a->x1 = a->x1 > b->x1 ? a->x1 : b->x1;
+			a->y1 = a->y1 > b->y1 ? a->y1 : b->y1;
+			a->z1 = a->z1 > b->z1 ? a->z1 : b->z1;
+			blocks[j] = blocks[--n];
+			// The grown box may now meet boxes already passed
+			j = i;
+		}
+	}
+	*nblocks = n;
+}
+
+
+static inline void note_change(double *c, unsigned int i, double d)
+{
+	if (d > c[i])
+		c[i] = d;
+}
+
+
+// Relax the rows of plane z in region b and record the changes in c
+static void local_sweep(const struct local_engine *e, const double *in, double *out,
+                        const struct poisson_block *b, unsigned int z, double *c)
+{
+	const size_t plane = (size_t)e->grid.xsize * e->grid.ysize;
+	for (unsigned int y = b->y0; y < b->y1; y++) {
+		poisson_sweep(&e->grid, in, out, b->x0, b->x1, y, y + 1, z, z + 1);
+
+		size_t row = z * plane + (size_t)y * e->grid.xsize;
+		double rowmax = 0;
+		for (unsigned int x = b->x0; x < b->x1; x++) {
+			double d = out[row + x] - in[row + x];
+			d = d < 0 ? -d : d;
+			rowmax = d > rowmax ? d : rowmax;
+		}
+		note_change(c, CHANGE_ALL, rowmax);
+		if (y == b->y0)
+			note_change(c, CHANGE_Y0, rowmax);
+		if (y == b->y1 - 1)
+			note_change(c, CHANGE_Y1, rowmax);
+		if (z == b->z0)
+			note_change(c, CHANGE_Z0, rowmax);
+		if (z == b->z1 - 1)
+			note_change(c, CHANGE_Z1, rowmax);
+
+		double dx0 = out[row + b->x0] - in[row + b->x0];
+		double dx1 = out[row + b->x1 - 1] - in[row + b->x1 - 1];
+		note_change(c, CHANGE_X0, dx0 < 0 ? -dx0 : dx0);
+		note_change(c, CHANGE_X1, dx1 < 0 ? -dx1 : dx1);
+	}
+}
+
+
+// Combine the workers' reports, grow the regions where the changes reach
+// their faces and decide whether to stop
+static void local_update(struct local_engine *e)
+{
+	const struct poisson_grid *g = &e->grid;
+	double total = 0;
+
+	for (unsigned int r = 0; r < e->nregions; r++) {
+		double c[CHANGES] = {0};
+		for (unsigned int id = 0; id < e->workers; id++) {
+			double *w = e->changes + ((size_t)id * e->maxregions + r) * CHANGES;
+			for (unsigned int i = 0; i < CHANGES; i++) {
+				note_change(c, i, w[i]);
+				w[i] = 0;
+			}
+		}
+		total = c[CHANGE_ALL] > total ? c[CHANGE_ALL] : total;
+
+		struct poisson_block *b = &e->regions[r];
+		if (c[CHANGE_X0] > e->tolerance && b->x0 > 0)
+			b->x0--;
+		if (c[CHANGE_X1] > e->tolerance && b->x1 < g->xsize)
+			b->x1++;
+		if (c[CHANGE_Y0] > e->tolerance && b->y0 > 0)
+			b->y0--;
+		if (c[CHANGE_Y1] > e->tolerance && b->y1 < g->ysize)
+			b->y1++;
+		if (c[CHANGE_Z0] > e->tolerance && b->z0 > 0)
+			b->z0--;
+		if (c[CHANGE_Z1] > e->tolerance && b->z1 < g->zsize)
+			b->z1++;
+	}
+
+	poisson_merge_blocks(e->regions, &e->nregions);
+	e->nplanes = 0;
+	for (unsigned int r = 0; r < e->nregions; r++)
+		e->nplanes += e->regions[r].z1 - e->regions[r].z0;
+
+	e->done++;
+	e->stop = total <= e->tolerance || e->done == e->maxiters;
+}
+
+
+static void *local_thread(void *args)
+{
+	struct local_args *la = (struct local_args *)args;
+	struct local_engine *e = la->e;
+	double *in = e->potential;
+	double *out = e->scratch;
+
+	while (!e->stop) {
+		// Share out the planes of all the regions, in region order
+		unsigned int p0 = (unsigned int)((size_t)e->nplanes * la->id / e->workers);
+		unsigned int p1 = (unsigned int)((size_t)e->nplanes * (la->id + 1) / e->workers);
+		unsigned int p = 0;
+		for (unsigned int r = 0; r < e->nregions && p < p1; r++) {
+			const struct poisson_block *b = &e->regions[r];
+			double *c = e->changes + ((size_t)la->id * e->maxregions + r) * CHANGES;
+			for (unsigned int z = b->z0; z < b->z1; z++, p++) {
+				if (p >= p0 && p < p1)
+					local_sweep(e, in, out, b, z, c);
+			}
+		}
+
+		double *temp = in;
+		in = out;
+		out = temp;
+
+		// One thread updates the regions while the rest wait to see them
+		if (pthread_barrier_wait(&e->barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+			local_update(e);
+		pthread_barrier_wait(&e->barrier);
+	}
+	return NULL;
+}
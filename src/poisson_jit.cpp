@@ -0,0 +1,308 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "poisson.hpp"
+
+// Symbol every generated kernel exports
+#define JIT_SYMBOL "poisson_jit_sweep"
+
+// Bytes of cache the rows of one y-tile should fit in, three planes deep
+#define JIT_TILE_BYTES (256 << 10)
+
+// Version of the kernel generator, part of the cache key.  Bump it whenever
+// jit_source writes something different, so old kernels are not loaded.
+#define JIT_VERSION 1
+
+// Flags the kernels are compiled with, also part of the cache key
+static const char *const jit_flags[] = {"-O3", "-march=native", "-ffp-contract=off", "-fPIC", "-shared"};
+
+// Kernels loaded by this process, most recent first
+struct jit_entry {
+	unsigned int xsize, ysize, zsize, numcores;
+	poisson_jit_fn fn;				// NULL if it could not be built
+	struct jit_entry *next;
+};
+
+static pthread_mutex_t jit_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct jit_entry *jit_loaded = NULL;
+
+static poisson_jit_fn jit_build(unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                                unsigned int numcores);
+static int jit_run(char *const argv[], const char *out);
+
+/// Get a sweep kernel specialised for one shape and thread count, building
+/// it on first use.  The kernel source has the strides, y-tile size,
+/// boundary handling and each worker's planes baked in.  It is compiled
+/// with $CXX, or g++, at -O3 -march=native into a shared object that is
+/// loaded with dlopen.
+///
+/// Shared objects are cached in $POISSON_JIT_DIR, or ~/.cache/poisson_jit,
+/// keyed by shape, thread count and a hash of the generator version, the
+/// compiler, its version and flags, and the CPU description, so later
+/// processes on the same machine and toolchain load them without compiling.
+/// Contraction into FMAs is turned off, so the kernel gives bit-for-bit
+/// the results of poisson_sweep.
+/// \param numcores is the number of workers; worker i sweeps planes
+///        [zsize * i / numcores, zsize * (i + 1) / numcores)
+/// \return the kernel, or NULL if there is no compiler or it fails, in
+///         which case the caller uses the generic kernel
+poisson_jit_fn poisson_jit_kernel (unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                                   unsigned int numcores)
+{
+	pthread_mutex_lock(&jit_lock);
+	for (struct jit_entry *j = jit_loaded; j; j = j->next) {
+		if (j->xsize == xsize && j->ysize == ysize && j->zsize == zsize && j->numcores == numcores) {
+			pthread_mutex_unlock(&jit_lock);
+			return j->fn;
+		}
+	}
+
+	// Failures are remembered too, so a missing compiler costs one attempt
+	poisson_jit_fn fn = jit_build(xsize, ysize, zsize, numcores);
+	struct jit_entry *j = (struct jit_entry *)malloc(sizeof(*j));
+	if (j) {
+		j->xsize = xsize;
+		j->ysize = ysize;
+		j->zsize = zsize;
+		j->numcores = numcores;
+		j->fn = fn;
+		j->next = jit_loaded;
+		jit_loaded = j;
+	}
+	pthread_mutex_unlock(&jit_lock);
+	return fn;
+}
+
+
+// Fold a string, terminator included, into an FNV-1a hash
+static uint64_t jit_fnv(uint64_t h, const char *s)
+{
+	for (const char *p = s; ; p++) {
+		h ^= (unsigned char)*p;
+		h *= 0x100000001b3;
+		if (!*p)
+			return h;
+	}
+}
+
+// Hash of everything besides the shape that decides what kernel comes out:
+// the generator version, the compiler with its --version output and flags,
+// and the CPU model and feature flags, which decide what -march=native
+// produces.  dir is where the compiler's output is briefly kept.
+static uint64_t jit_hash(const char *dir, const char *cxx)
+{
+	char line[4096];
+	uint64_t h = 0xcbf29ce484222325;
+	snprintf(line, sizeof(line), "%d", JIT_VERSION);
+	h = jit_fnv(h, line);
+	h = jit_fnv(h, cxx);
+	for (size_t i = 0; i < sizeof(jit_flags) / sizeof(jit_flags[0]); i++)
+		h = jit_fnv(h, jit_flags[i]);
+
+	char out[1100];
+	snprintf(out, sizeof(out), "%s/version.%d.tmp", dir, (int)getpid());
+	char *argv[] = {(char *)cxx, (char *)"--version", NULL};
+	FILE *f = jit_run(argv, out) == 0 ? fopen(out, "r") : NULL;
+	if (f) {
+		while (fgets(line, sizeof(line), f))
+			h = jit_fnv(h, line);
+		fclose(f);
+	}
+	unlink(out);
+
+	f = fopen("/proc/cpuinfo", "r");
+	if (!f)
+		return h;
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, "model name", 10) != 0 && strncmp(line, "flags", 5) != 0)
+			continue;
+		h = jit_fnv(h, line);
+		// Every core repeats the same lines
+		if (strncmp(line, "flags", 5) == 0)
+			break;
+	}
+	fclose(f);
+	return h;
+}
+
+
+// The cache directory, created if need be.  Returns -1 if there is none.
+static int jit_dir(char *dir, size_t size)
+{
+	const char *env = getenv("POISSON_JIT_DIR");
+	const char *home = getenv("HOME");
+	if (env && *env) {
+		snprintf(dir, size, "%s", env);
+	} else if (home && *home) {
+		snprintf(dir, size, "%s/.cache", home);
+		mkdir(dir, 0755);
+		snprintf(dir, size, "%s/.cache/poisson_jit", home);
+	} else {
+		return -1;
+	}
+	mkdir(dir, 0755);
+	struct stat st;
+	return stat(dir, &st) == 0 && S_ISDIR(st.st_mode) ? 0 : -1;
+}
+
+
+// Write the kernel source for one shape and thread count
+static int jit_source(const char *path, unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                      unsigned int numcores)
+{
+	FILE *f = fopen(path, "w");
+	if (!f)
+		return -1;
+
+	size_t plane = (size_t)xsize * ysize;
+	unsigned int tile = JIT_TILE_BYTES / (3 * xsize * sizeof(double));
+	tile = tile < 1 ? 1 : tile > ysize ? ysize : tile;
+
+	fprintf(f, "// Generated by poisson_jit_kernel\n"
+			   "#include <stddef.h>\n\n"
+			   "#define XS %uu\n#define YS %uu\n#define ZS %uu\n#define PLANE %zuu\n#define TILE %uu\n\n",
+			   xsize, ysize, zsize, plane, tile);
+	fprintf(f, "static const unsigned int ZSTART[] = {");
+	for (unsigned int i = 0; i <= numcores; i++)
+		fprintf(f, "%u%s", (unsigned int)((size_t)zsize * i / numcores), i < numcores ? ", " : "};\n\n");
+
+	fputs("static inline void row(const double *__restrict__ c,\n"
+		  "                       const double *__restrict__ ym, const double *__restrict__ yp,\n"
+		  "                       const double *__restrict__ zm, const double *__restrict__ zp,\n"
+		  "                       const double *__restrict__ s, double *__restrict__ o,\n"
+		  "                       double vb, double d2)\n"
+		  "{\n"
+		  "#if XS == 1\n"
+		  "\to[0] = (vb + vb + yp[0] + ym[0] + zp[0] + zm[0] - d2 * s[0]) / 6;\n"
+		  "#else\n"
+		  "\to[0] = (c[1] + vb + yp[0] + ym[0] + zp[0] + zm[0] - d2 * s[0]) / 6;\n"
+		  "\tfor (unsigned int x = 1; x < XS - 1; x++)\n"
+		  "\t\to[x] = (c[x + 1] + c[x - 1] + yp[x] + ym[x] + zp[x] + zm[x] - d2 * s[x]) / 6;\n"
+		  "\to[XS - 1] = (vb + c[XS - 2] + yp[XS - 1] + ym[XS - 1] + zp[XS - 1] + zm[XS - 1] - d2 * s[XS - 1]) / 6;\n"
+		  "#endif\n"
+		  "}\n\n"
+		  "extern \"C\" void " JIT_SYMBOL "(const double *__restrict__ in, const double *__restrict__ source,\n"
+		  "                                  double *__restrict__ out, double d2, double vb, unsigned int worker)\n"
+		  "{\n"
+		  "\tdouble bound[XS];\n"
+		  "\tfor (unsigned int x = 0; x < XS; x++)\n"
+		  "\t\tbound[x] = vb;\n"
+		  "\tfor (unsigned int y0 = 0; y0 < YS; y0 += TILE) {\n"
+		  "\t\tunsigned int y1 = y0 + TILE < YS ? y0 + TILE : YS;\n"
+		  "\t\tfor (unsigned int z = ZSTART[worker]; z < ZSTART[worker + 1]; z++) {\n"
+		  "\t\t\tfor (unsigned int y = y0; y < y1; y++) {\n"
+		  "\t\t\t\tsize_t r = z * PLANE + (size_t)y * XS;\n"
+		  "\t\t\t\tconst double *c = in + r;\n"
+		  "\t\t\t\trow(c, y > 0 ? c - XS : bound, y < YS - 1 ? c + XS : bound,\n"
+		  "\t\t\t\t    z > 0 ? c - PLANE : bound, z < ZS - 1 ? c + PLANE : bound,\n"
+		  "\t\t\t\t    source + r, out + r, vb, d2);\n"
+		  "\t\t\t}\n"
+		  "\t\t}\n"
+		  "\t}\n"
+		  "}\n", f);
+	return fclose(f) == 0 ? 0 : -1;
+}
+
+
+// Run a command with its standard output written to out, or thrown away
+// if out is NULL, and its errors thrown away.  Returns its exit status, or
+// -1 if it could not be run.
+static int jit_run(char *const argv[], const char *out)
+{
+	extern char **environ;
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, out ? out : "/dev/null",
+									 O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+	pid_t pid;
+	int status = -1;
+	if (posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ) == 0) {
+		while (waitpid(pid, &status, 0) < 0) {
+			if (errno != EINTR) {
+				status = -1;
+				break;
+			}
+		}
+		if (status != -1)
+			status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+	}
+	posix_spawn_file_actions_destroy(&actions);
+	return status;
+}
+
+
+// Load the cached shared object for this shape, compiling it first if
+// there is none.  Returns NULL on any failure.
+static poisson_jit_fn jit_build(unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                                unsigned int numcores)
+{
+	if (xsize == 0 || ysize == 0 || zsize == 0 || numcores == 0)
+		return NULL;
+
+	char dir[1024], so[1100], src[1200], tmp[1200];
+	if (jit_dir(dir, sizeof(dir)) != 0)
+		return NULL;
+	const char *cxx = getenv("CXX");
+	if (!cxx || !*cxx)
+		cxx = "g++";
+
+	// The toolchain is asked for its version once per process; callers
+	// hold jit_lock
+	static uint64_t hash;
+	static int hashed = 0;
+	if (!hashed) {
+		hash = jit_hash(dir, cxx);
+		hashed = 1;
+	}
+	snprintf(so, sizeof(so), "%s/sweep_%ux%ux%u_t%u_%016llx.so", dir, xsize, ysize, zsize, numcores,
+			 (unsigned long long)hash);
+
+	if (access(so, R_OK) != 0) {
+		// Build under names of our own and rename into place, so that
+		// processes racing to build the same kernel never see half a file
+		snprintf(src, sizeof(src), "%s.%d.cpp", so, (int)getpid());
+		snprintf(tmp, sizeof(tmp), "%s.%d.tmp", so, (int)getpid());
+		if (jit_source(src, xsize, ysize, zsize, numcores) != 0) {
+			unlink(src);
+			return NULL;
+		}
+		const size_t nflags = sizeof(jit_flags) / sizeof(jit_flags[0]);
+		char *argv[nflags + 5];
+		size_t n = 0;
+		argv[n++] = (char *)cxx;
+		for (size_t i = 0; i < nflags; i++)
+			argv[n++] = (char *)jit_flags[i];
+		argv[n++] = (char *)"-o";
+		argv[n++] = tmp;
+		argv[n++] = src;
+		argv[n] = NULL;
+		int status = jit_run(argv, NULL);
+		unlink(src);
+		if (status != 0 || rename(tmp, so) != 0) {
+			unlink(tmp);
+			fprintf(stderr, "poisson_jit: could not compile a kernel, using the generic one\n");
+			return NULL;
+		}
+	}
+
+	void *handle = dlopen(so, RTLD_NOW | RTLD_LOCAL);
+	if (!handle) {
+		fprintf(stderr, "poisson_jit: %s\n", dlerror());
+		return NULL;
+	}
+	poisson_jit_fn fn = (poisson_jit_fn)dlsym(handle, JIT_SYMBOL);
+	if (!fn)
+		dlclose(handle);
+	return fn;
+}
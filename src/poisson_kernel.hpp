@@ -0,0 +1,188 @@
+#ifndef POISSON_KERNEL_H
+#define POISSON_KERNEL_H
+
+#include <stdlib.h>
+
+// Geometry shared by the Jacobi sweep kernels.  bound is one x-row of
+// Vbound that stands in for rows lying outside the box, so the y and z
+// faces need no special cases.
+struct poisson_grid {
+	const double *__restrict__ source;
+	const double *bound;
+	double Vbound;
+	double delta;
+	unsigned int xsize;
+	unsigned int ysize;
+	unsigned int zsize;
+};
+
+// Allocate a row of xsize copies of Vbound for poisson_grid::bound
+static inline double *poisson_bound_row (unsigned int xsize, double Vbound)
+{
+	double *row = (double *)malloc(xsize * sizeof(double));
+	if (row) {
+		for (unsigned int x = 0; x < xsize; x++)
+			row[x] = Vbound;
+	}
+	return row;
+}
+
+// Relax columns [x0, x1) of one x-row.  c is the row of the previous
+// iterate, ym/yp and zm/zp its neighbouring rows, s the source row and o
+// the row of the new iterate.
+static inline void poisson_sweep_row (const double *__restrict__ c,
+                                      const double *__restrict__ ym, const double *__restrict__ yp,
+                                      const double *__restrict__ zm, const double *__restrict__ zp,
+                                      const double *__restrict__ s, double *__restrict__ o,
+                                      unsigned int xs, unsigned int x0, unsigned int x1,
+                                      double vb, double d2)
+{
+	const unsigned int lo = x0 > 0 ? x0 : 1;
+	const unsigned int hi = x1 < xs ? x1 : xs - 1;
+
+	if (x0 == 0) {
+		double xp = xs > 1 ? c[1] : vb;
+		o[0] = (xp + vb + yp[0] + ym[0] + zp[0] + zm[0] - d2 * s[0]) / 6;
+	}
+	for (unsigned int x = lo; x < hi; x++) {
+		o[x] = (c[x + 1] + c[x - 1] + yp[x] + ym[x] + zp[x] + zm[x] - d2 * s[x]) / 6;
+	}
+	if (x1 == xs && xs > 1) {
+		unsigned int x = xs - 1;
+		o[x] = (vb + c[x - 1] + yp[x] + ym[x] + zp[x] + zm[x] - d2 * s[x]) / 6;
+	}
+}
+
+/// Relax the box [x0, x1) x [y0, y1) x [z0, z1) for one Jacobi iteration,
+/// reading the previous iterate from in and writing the new one to out.
+/// Voxels on the faces of the grid take Vbound for their missing neighbours.
+static inline void poisson_sweep (const struct poisson_grid *g,
+                                  const double *__restrict__ in, double *__restrict__ out,
+                                  unsigned int x0, unsigned int x1,
+                                  unsigned int y0, unsigned int y1,
+                                  unsigned int z0, unsigned int z1)
+{
+	const unsigned int xs = g->xsize;
+	const unsigned int ys = g->ysize;
+	const unsigned int zs = g->zsize;
+	const size_t plane = (size_t)xs * ys;
+	const double d2 = g->delta * g->delta;
+
+	for (unsigned int z = z0; z < z1; z++) {
+		for (unsigned int y = y0; y < y1; y++) {
+			size_t row = ((size_t)z * ys + y) * xs;
+			const double *c  = in + row;
+			const double *ym = y > 0 	  ? c - xs 	  : g->bound;
+			const double *yp = y < ys - 1 ? c + xs 	  : g->bound;
+			const double *zm = z > 0 	  ? c - plane : g->bound;
+			const double *zp = z < zs - 1 ? c + plane : g->bound;
+			poisson_sweep_row(c, ym, yp, zm, zp, g->source + row, out + row,
+							  xs, x0, x1, g->Vbound, d2);
+		}
+	}
+}
+
+/// Relax rows [y0, y1) of one plane whose neighbouring planes are stored
+/// separately, e.g. in a ring of planes streamed from disk.  below and
+/// above may be g->bound-filled planes at the faces of the box.
+static inline void poisson_sweep_plane (const struct poisson_grid *g,
+                                        const double *__restrict__ below,
+                                        const double *__restrict__ centre,
+                                        const double *__restrict__ above,
+                                        const double *__restrict__ source,
+                                        double *__restrict__ out,
+                                        unsigned int y0, unsigned int y1)
+{
+	const unsigned int xs = g->xsize;
+	const unsigned int ys = g->ysize;
+	const double d2 = g->delta * g->delta;
+
+	for (unsigned int y = y0; y < y1; y++) {
+		size_t row = (size_t)y * xs;
+		const double *c  = centre + row;
+		const double *ym = y > 0 	  ? c - xs : g->bound;
+		const double *yp = y < ys - 1 ? c + xs : g->bound;
+		poisson_sweep_row(c, ym, yp, below + row, above + row, source + row, out + row,
+						  xs, 0, xs, g->Vbound, d2);
+	}
+}
+
+// Relax whole planes [z0, z1)
+static inline void poisson_sweep_slab (const struct poisson_grid *g,
+                                       const double *__restrict__ in, double *__restrict__ out,
+                                       unsigned int z0, unsigned int z1)
+{
+	poisson_sweep(g, in, out, 0, g->xsize, 0, g->ysize, z0, z1);
+}
+
+// A source held as its non-zero voxels, in index order, with the values
+// already multiplied by delta^2.  The voxels of x-row r are entries
+// rows[r] to rows[r + 1] - 1.
+struct poisson_sparse_source {
+	const size_t *index;
+	const double *scaled;
+	const size_t *rows;
+};
+
+// Relax columns [x0, x1) of one x-row with no source: Laplace's equation.
+// The arguments are as for poisson_sweep_row, less the source.
+static inline void poisson_sweep_row_laplace (const double *__restrict__ c,
+                                              const double *__restrict__ ym, const double *__restrict__ yp,
+                                              const double *__restrict__ zm, const double *__restrict__ zp,
+                                              double *__restrict__ o,
+                                              unsigned int xs, unsigned int x0, unsigned int x1, double vb)
+{
+	const unsigned int lo = x0 > 0 ? x0 : 1;
+	const unsigned int hi = x1 < xs ? x1 : xs - 1;
+
+	if (x0 == 0) {
+		double xp = xs > 1 ? c[1] : vb;
+		o[0] = (xp + vb + yp[0] + ym[0] + zp[0] + zm[0]) / 6;
+	}
+	for (unsigned int x = lo; x < hi; x++) {
+		o[x] = (c[x + 1] + c[x - 1] + yp[x] + ym[x] + zp[x] + zm[x]) / 6;
+	}
+	if (x1 == xs && xs > 1) {
+		unsigned int x = xs - 1;
+		o[x] = (vb + c[x - 1] + yp[x] + ym[x] + zp[x] + zm[x]) / 6;
+	}
+}
+
+/// Relax the box [0, xsize) x [y0, y1) x [z0, z1) like poisson_sweep, for a
+/// sparse source.  Rows run the Laplace kernel, which does not read a
+/// source at all, and the few voxels with a source are then redone with
+/// their pre-scaled value, giving bit-for-bit the result of poisson_sweep.
+static inline void poisson_sweep_sparse (const struct poisson_grid *g,
+                                         const struct poisson_sparse_source *sp,
+                                         const double *__restrict__ in, double *__restrict__ out,
+                                         unsigned int y0, unsigned int y1,
+                                         unsigned int z0, unsigned int z1)
+{
+	const unsigned int xs = g->xsize;
+	const unsigned int ys = g->ysize;
+	const unsigned int zs = g->zsize;
+	const size_t plane = (size_t)xs * ys;
+	const double vb = g->Vbound;
+
+	for (unsigned int z = z0; z < z1; z++) {
+		for (unsigned int y = y0; y < y1; y++) {
+			size_t r = (size_t)z * ys + y;
+			size_t row = r * xs;
+			const double *c  = in + row;
+			const double *ym = y > 0 	  ? c - xs 	  : g->bound;
+			const double *yp = y < ys - 1 ? c + xs 	  : g->bound;
+			const double *zm = z > 0 	  ? c - plane : g->bound;
+			const double *zp = z < zs - 1 ? c + plane : g->bound;
+			poisson_sweep_row_laplace(c, ym, yp, zm, zp, out + row, xs, 0, xs, vb);
+
+			for (size_t i = sp->rows[r]; i < sp->rows[r + 1]; i++) {
+				unsigned int x = (unsigned int)(sp->index[i] - row);
+				double xp = x + 1 < xs ? c[x + 1] : vb;
+				double xm = x > 0 ? c[x - 1] : vb;
+				out[row + x] = (xp + xm + yp[x] + ym[x] + zp[x] + zm[x] - sp->scaled[i]) / 6;
+			}
+		}
+	}
+}
+
+#endif
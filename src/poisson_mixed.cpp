@@ -0,0 +1,259 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "poisson.hpp"
+#include "poisson_kernel.hpp"
+
+// State shared by the workers of one poisson_dirichlet_mixed call
+struct mixed_engine {
+	struct poisson_grid grid;
+	double *potential;				// the double iterate, refined in place
+	float *rhs;						// residual / 6 of the current outer step
+	float *e[2];					// correction iterates
+	const float *zero;				// one plane of zeros for the faces
+	unsigned int numiters;
+	unsigned int inner;
+	double tolerance;
+	double *changes;				// changes[id], largest residual / 6 of each slab
+	unsigned int workers;
+	unsigned int done;
+	pthread_barrier_t barrier;
+};
+
+// structure we're going to use for arguments to our mixed pthread function
+struct mixed_args {
+	struct mixed_engine *e;
+	unsigned int id;
+	unsigned int zstart;
+	unsigned int zend;
+	pthread_t thread;
+};
+
+static void *mixed_thread(void *args);
+
+/// Solve Poisson's equation like poisson_dirichlet by mixed precision
+/// iterative refinement.  Each outer step works out the residual of the
+/// double iterate in double, then relaxes the correction equation for
+/// inner Jacobi sweeps in float, with a zero boundary, and adds the
+/// correction back in double.  The float sweeps move half the bytes of
+/// the double kernel, and as the iterate itself is only ever updated in
+/// double, rounding in the corrections is put right by later steps rather
+/// than building up.
+///
+/// In exact arithmetic each outer step is inner sweeps of poisson_dirichlet,
+/// so numiters counts sweeps in the same way, the residual step counting as
+/// the first sweep of its correction.  The source is the first iterate.
+/// \param source is a pointer to a flattened 3-D array for the source function
+/// \param potential is a pointer to a flattened 3-D array for the calculated potential
+/// \param Vbound is the potential on the boundary
+/// \param numiters is the most sweeps to perform
+/// \param inner is the sweeps per outer step, at least 1
+/// \param tolerance stops once no voxel would change by more than this in a
+///        double sweep, checked at each outer step.  0 runs all numiters sweeps
+/// \param numcores is the number of CPU cores to use.  If 0, an optimal number is chosen
+/// \return the number of sweeps performed
+unsigned int poisson_dirichlet_mixed (double *__restrict__ source,
+                                      double *__restrict__ potential,
+                                      double Vbound,
+                                      unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                                      double delta, unsigned int numiters, unsigned int inner,
+                                      double tolerance, unsigned int numcores)
+{
+	if (numcores == 0)
+		numcores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (numcores > zsize)
+		numcores = zsize;
+
+	size_t count = (size_t)xsize * ysize * zsize;
+	float *rhs = (float *)malloc(count * sizeof(float));
+	float *e0 = (float *)malloc(count * sizeof(float));
+	float *e1 = (float *)malloc(count * sizeof(float));
+	float *zero = (float *)calloc((size_t)xsize * ysize, sizeof(float));
+	double *changes = (double *)calloc(numcores, sizeof(double));
+	double *bound = poisson_bound_row(xsize, Vbound);
+	if (!rhs || !e0 || !e1 || !zero || !changes || !bound) {
+		fprintf(stderr, "malloc failure\n");
+		free(bound);
+		free(rhs);
+		free(e0);
+		free(e1);
+		free(zero);
+		free(changes);
+		return 0;
+	}
+
+	memcpy(potential, source, count * sizeof(double));
+
+	struct mixed_engine e;
+	e.grid.source = source;
+	e.grid.bound = bound;
+	e.grid.Vbound = Vbound;
+	e.grid.delta = delta;
+	e.grid.xsize = xsize;
+	e.grid.ysize = ysize;
+	e.grid.zsize = zsize;
+	e.potential = potential;
+	e.rhs = rhs;
+	e.e[0] = e0;
+	e.e[1] = e1;
+	e.zero = zero;
+	e.numiters = numiters;
+	e.inner = inner > 0 ? inner : 1;
+	e.tolerance = tolerance;
+	e.changes = changes;
+	e.workers = numcores;
+	e.done = numiters;
+	pthread_barrier_init(&e.barrier, NULL, numcores);
+
+	struct mixed_args ma[numcores];
+	for (unsigned int i = 0; i < numcores; i++) {
+		ma[i].e 		= &e;
+		ma[i].id 		= i;
+		ma[i].zstart 	= (unsigned int)((size_t)zsize * i / numcores);
+		ma[i].zend 		= (unsigned int)((size_t)zsize * (i + 1) / numcores);
+		if (pthread_create(&ma[i].thread, NULL, mixed_thread, (void *)&ma[i]) != 0) {
+			fprintf(stderr, "Could not create thread %d\n", i);
+		}
+	}
+	for (unsigned int i = 0; i < numcores; i++) {
+		pthread_join(ma[i].thread, NULL);
+	}
+	pthread_barrier_destroy(&e.barrier);
+
+	free(rhs);
+	free(e0);
+	free(e1);
+	free(zero);
+	free(changes);
+	free(bound);
+	return e.done;
+}
+
+
+// Work out the residual / 6 of the iterate over planes [z0, z1), which is
+// also the correction after one sweep, and return its largest magnitude.
+// That is a double sweep less the iterate, so the double kernel does it.
+static double mixed_residual(const struct mixed_engine *e, unsigned int z0, unsigned int z1)
+{
+	const struct poisson_grid *g = &e->grid;
+	const unsigned int xs = g->xsize;
+	const unsigned int ys = g->ysize;
+	const unsigned int zs = g->zsize;
+	const size_t plane = (size_t)xs * ys;
+	const double d2 = g->delta * g->delta;
+	double change = 0;
+	double o[xs];
+
+	for (unsigned int z = z0; z < z1; z++) {
+		for (unsigned int y = 0; y < ys; y++) {
+			size_t row = z * plane + (size_t)y * xs;
+			const double *c = e->potential + row;
+			const double *ym = y > 0 	  ? c - xs 	  : g->bound;
+			const double *yp = y < ys - 1 ? c + xs 	  : g->bound;
+			const double *zm = z > 0 	  ? c - plane : g->bound;
+			const double *zp = z < zs - 1 ? c + plane : g->bound;
+			poisson_sweep_row(c, ym, yp, zm, zp, g->source + row, o, xs, 0, xs, g->Vbound, d2);
+
+			float *r = e->rhs + row;
+			float *c0 = e->e[0] + row;
+			for (unsigned int x = 0; x < xs; x++) {
+				double d = o[x] - c[x];
+				r[x] = (float)d;
+				c0[x] = (float)d;
+				d = d < 0 ? -d : d;
+				change = d > change ? d : change;
+			}
+		}
+	}
+	return change;
+}
+
+
+// One float Jacobi sweep of the correction over planes [z0, z1), from in
+// to out, or added to the iterate if add is set
+static void mixed_sweep(const struct mixed_engine *e, const float *__restrict__ in,
+                        float *__restrict__ out, unsigned int z0, unsigned int z1, int add)
+{
+	const unsigned int xs = e->grid.xsize;
+	const unsigned int ys = e->grid.ysize;
+	const unsigned int zs = e->grid.zsize;
+	const size_t plane = (size_t)xs * ys;
+
+	for (unsigned int z = z0; z < z1; z++) {
+		const float *c = in + z * plane;
+		const float *zm = z > 0 ? c - plane : e->zero;
+		const float *zp = z < zs - 1 ? c + plane : e->zero;
+		for (unsigned int y = 0; y < ys; y++) {
+			size_t row = (size_t)y * xs;
+			const float *cr = c + row;
+			const float *ym = y > 0 ? cr - xs : e->zero;
+			const float *yp = y < ys - 1 ? cr + xs : e->zero;
+			const float *r = e->rhs + z * plane + row;
+			const float *zmr = zm + row;
+			const float *zpr = zp + row;
+			float o[xs];
+			if (xs == 1) {
+				o[0] = (yp[0] + ym[0] + zpr[0] + zmr[0]) / 6 + r[0];
+			} else {
+				o[0] = (cr[1] + yp[0] + ym[0] + zpr[0] + zmr[0]) / 6 + r[0];
+				for (unsigned int x = 1; x < xs - 1; x++)
+					o[x] = (cr[x + 1] + cr[x - 1] + yp[x] + ym[x] + zpr[x] + zmr[x]) / 6 + r[x];
+				unsigned int x = xs - 1;
+				o[x] = (cr[x - 1] + yp[x] + ym[x] + zpr[x] + zmr[x]) / 6 + r[x];
+			}
+			if (add) {
+				double *u = e->potential + z * plane + row;
+				for (unsigned int x = 0; x < xs; x++)
+					u[x] += o[x];
+			} else {
+				memcpy(out + z * plane + row, o, xs * sizeof(float));
+			}
+		}
+	}
+}
+
+
+static void *mixed_thread(void *args)
+{
+	struct mixed_args *ma = (struct mixed_args *)args;
+	struct mixed_engine *e = ma->e;
+	unsigned int sweeps = 0;
+
+	while (sweeps < e->numiters) {
+		unsigned int k = e->numiters - sweeps < e->inner ? e->numiters - sweeps : e->inner;
+
+		e->changes[ma->id] = mixed_residual(e, ma->zstart, ma->zend);
+		pthread_barrier_wait(&e->barrier);
+
+		// Every worker sees the same reports and stops together
+		if (e->tolerance > 0) {
+			double change = 0;
+			for (unsigned int i = 0; i < e->workers; i++)
+				change = e->changes[i] > change ? e->changes[i] : change;
+			if (change <= e->tolerance) {
+				if (ma->id == 0)
+					e->done = sweeps;
+				break;
+			}
+		}
+
+		// The last sweep of the step adds its correction straight into the
+		// iterate, which nobody reads until the barrier after it
+		for (unsigned int s = 1; s < k; s++) {
+			mixed_sweep(e, e->e[(s - 1) % 2], e->e[s % 2], ma->zstart, ma->zend, s == k - 1);
+			if (s < k - 1)
+				pthread_barrier_wait(&e->barrier);
+		}
+		if (k == 1) {
+			const size_t plane = (size_t)e->grid.xsize * e->grid.ysize;
+			for (size_t i = ma->zstart * plane; i < ma->zend * plane; i++)
+				e->potential[i] += e->e[0][i];
+		}
+		pthread_barrier_wait(&e->barrier);
+		sweeps += k;
+	}
+	return NULL;
+}
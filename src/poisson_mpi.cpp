@@ -0,0 +1,193 @@
+#include <mpi.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "poisson_mpi.hpp"
+#include "poisson_kernel.hpp"
+
+// Message tags for halo planes travelling up and down the z-axis
+#define TAG_UP 	 0
+#define TAG_DOWN 1
+
+static void mpi_sweep(const struct poisson_grid *g, const double *source,
+                      const double *in, double *out, unsigned int z0, unsigned int z1);
+
+/// Find the planes owned by this rank.  As with the threaded solvers the
+/// remainder planes go one each to the first ranks.
+/// \param comm is the communicator the grid is distributed over
+/// \param zsize is the number of elements in the z-direction of the whole grid
+/// \param z0 receives the first plane owned by this rank
+/// \param z1 receives one past the last plane owned by this rank
+void poisson_mpi_slab (MPI_Comm comm, unsigned int zsize, unsigned int *z0, unsigned int *z1)
+{
+	int rank, size;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+	*z0 = (unsigned int)((size_t)zsize * rank / size);
+	*z1 = (unsigned int)((size_t)zsize * (rank + 1) / size);
+}
+
+/// Solve Poisson's equation for a rectangular box with Dirichlet boundary
+/// conditions, with the box split into z-slabs over the ranks of comm.
+/// Every iteration the one-plane halos are exchanged with non-blocking
+/// sends while the interior of the slab is relaxed, and only the two edge
+/// planes wait for the exchange to complete.  Must be called by every rank.
+/// \param comm is the communicator to distribute over
+/// \param source holds this rank's planes, see poisson_mpi_slab, of the source function
+/// \param potential receives this rank's planes of the calculated potential
+/// \param Vbound is the potential on the boundary
+/// \param xsize is the number of elements in the x-direction
+/// \param ysize is the number of elements in the y-direction
+/// \param zsize is the number of elements in the z-direction of the whole grid
+/// \param delta is the voxel spacing in all directions
+/// \param numiters is the number of iterations to perform
+/// \return 0 on success, otherwise non-zero
+int poisson_dirichlet_mpi (MPI_Comm comm,
+                           const double *source,
+                           double *potential,
+                           double Vbound,
+                           unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                           double delta, unsigned int numiters)
+{
+	int rank, size;
+	unsigned int z0, z1;
+	poisson_mpi_slab(comm, zsize, &z0, &z1);
+
+	const unsigned int nz = z1 - z0;
+	const size_t plane = (size_t)xsize * ysize;
+
+	// With more ranks than planes some ranks own nothing.  Leave them out
+	// so that the neighbours in the remaining ranks are adjacent slabs.
+	MPI_Comm slabs;
+	MPI_Comm_split(comm, nz > 0 ? 0 : MPI_UNDEFINED, 0, &slabs);
+	if (nz == 0)
+		return 0;
+	MPI_Comm_rank(slabs, &rank);
+	MPI_Comm_size(slabs, &size);
+
+	// Local buffers hold nz planes plus a halo plane either side.  At the
+	// faces of the box the halo is a plane of Vbound that is never updated.
+	size_t count = (nz + 2) * plane;
+	double *buf[2];
+	buf[0] = (double *)malloc(count * sizeof(double));
+	buf[1] = (double *)malloc(count * sizeof(double));
+	double *bound = poisson_bound_row(xsize, Vbound);
+	if (!buf[0] || !buf[1] || !bound) {
+		fprintf(stderr, "malloc failure\n");
+		free(buf[0]);
+		free(buf[1]);
+		free(bound);
+		MPI_Comm_free(&slabs);
+		return -1;
+	}
+	for (int b = 0; b < 2; b++) {
+		for (size_t i = 0; i < plane; i++) {
+			buf[b][i] = Vbound;
+			buf[b][(nz + 1) * plane + i] = Vbound;
+		}
+	}
+
+	// The kernel sees a grid of nz + 2 planes.  The source has no halo, so
+	// mpi_sweep hands local plane z source plane z - 1 itself.
+	struct poisson_grid grid;
+	grid.source = source;
+	grid.bound = bound;
+	grid.Vbound = Vbound;
+	grid.delta = delta;
+	grid.xsize = xsize;
+	grid.ysize = ysize;
+	grid.zsize = nz + 2;
+
+	// As in poisson_dirichlet the source is the first iterate
+	memcpy(buf[0] + plane, source, nz * plane * sizeof(double));
+
+	MPI_Datatype plane_type;
+	MPI_Type_contiguous((int)plane, MPI_DOUBLE, &plane_type);
+	MPI_Type_commit(&plane_type);
+
+	int below = rank > 0 ? rank - 1 : MPI_PROC_NULL;
+	int above = rank < size - 1 ? rank + 1 : MPI_PROC_NULL;
+	double *in = buf[0];
+	double *out = buf[1];
+
+	for (unsigned int iter = 0; iter < numiters; iter++) {
+		MPI_Request req[4];
+		MPI_Irecv(in, 1, plane_type, below, TAG_UP, slabs, &req[0]);
+		MPI_Irecv(in + (nz + 1) * plane, 1, plane_type, above, TAG_DOWN, slabs, &req[1]);
+		MPI_Isend(in + nz * plane, 1, plane_type, above, TAG_UP, slabs, &req[2]);
+		MPI_Isend(in + plane, 1, plane_type, below, TAG_DOWN, slabs, &req[3]);
+
+		// Interior planes need nothing from the neighbours
+		if (nz > 2)
+			mpi_sweep(&grid, source, in, out, 2, nz);
+
+		MPI_Waitall(4, req, MPI_STATUSES_IGNORE);
+
+		mpi_sweep(&grid, source, in, out, 1, 2);
+		if (nz > 1)
+			mpi_sweep(&grid, source, in, out, nz, nz + 1);
+
+		double *temp = in;
+		in = out;
+		out = temp;
+	}
+
+	memcpy(potential, in + plane, nz * plane * sizeof(double));
+
+	MPI_Type_free(&plane_type);
+	MPI_Comm_free(&slabs);
+	free(bound);
+	free(buf[0]);
+	free(buf[1]);
+	return 0;
+}
+
+// Relax local planes [z0, z1), which lie between the halo planes 0 and
+// nz + 1, with source plane z - 1 for local plane z
+static void mpi_sweep(const struct poisson_grid *g, const double *source,
+                      const double *in, double *out, unsigned int z0, unsigned int z1)
+{
+	const size_t plane = (size_t)g->xsize * g->ysize;
+
+	for (unsigned int z = z0; z < z1; z++) {
+		const double *c = in + z * plane;
+		poisson_sweep_plane(g, c - plane, c, c + plane, source + (z - 1) * plane,
+							out + z * plane, 0, g->ysize);
+	}
+}
+
+
+/// Gather the distributed planes of a grid onto one rank.  Only needed when
+/// the whole result is wanted in one place; must be called by every rank.
+/// \param comm is the communicator the grid is distributed over
+/// \param local holds this rank's planes
+/// \param grid receives the whole grid on rank root, and is ignored elsewhere
+/// \param root is the rank to gather onto
+/// \return 0 on success, otherwise an MPI error code
+int poisson_mpi_gather (MPI_Comm comm, const double *local, double *grid,
+                        unsigned int xsize, unsigned int ysize, unsigned int zsize, int root)
+{
+	int rank, size;
+	unsigned int z0, z1;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+	poisson_mpi_slab(comm, zsize, &z0, &z1);
+
+	// Count in planes so that large grids do not overflow an int
+	MPI_Datatype plane_type;
+	MPI_Type_contiguous((int)((size_t)xsize * ysize), MPI_DOUBLE, &plane_type);
+	MPI_Type_commit(&plane_type);
+
+	int counts[size];
+	int displs[size];
+	for (int r = 0; r < size; r++) {
+		displs[r] = (int)((size_t)zsize * r / size);
+		counts[r] = (int)((size_t)zsize * (r + 1) / size) - displs[r];
+	}
+
+	int err = MPI_Gatherv(local, (int)(z1 - z0), plane_type,
+						  grid, counts, displs, plane_type, root, comm);
+	MPI_Type_free(&plane_type);
+	return err;
+}
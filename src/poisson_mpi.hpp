@@ -0,0 +1,21 @@
+#ifndef POISSON_MPI_H
+#define POISSON_MPI_H
+
+#include <mpi.h>
+
+// Planes [z0, z1) of a zsize plane grid owned by the calling rank of comm
+void poisson_mpi_slab (MPI_Comm comm, unsigned int zsize, unsigned int *z0, unsigned int *z1);
+
+// Solve Poisson's equation with the z-planes distributed over the ranks of
+// comm.  source and potential hold only this rank's planes.
+int poisson_dirichlet_mpi (MPI_Comm comm,
+                           const double *source,
+                           double *potential,
+                           double Vbound,
+                           unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                           double delta, unsigned int numiters);
+
+// Collect every rank's planes into the full grid on rank root
+int poisson_mpi_gather (MPI_Comm comm, const double *local, double *grid,
+                        unsigned int xsize, unsigned int ysize, unsigned int zsize, int root);
+#endif
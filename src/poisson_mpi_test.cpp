@@ -0,0 +1,79 @@
+/// \brief Test program for the distributed-memory solver.  Run with
+/// e.g. mpirun -np 4 ./poisson_mpi_test size numiters
+
+#include <mpi.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "poisson.hpp"
+#include "poisson_mpi.hpp"
+
+int main (int argc, char *argv[])
+{
+    int rank;
+    unsigned int N;
+    unsigned int numiters;
+    unsigned int z0, z1;
+    int status = 0;
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    if (argc < 3)
+    {
+        if (rank == 0)
+            fprintf (stderr, "Usage: %s size numiters\n", argv[0]);
+        MPI_Finalize();
+        return 1;
+    }
+
+    N = atoi(argv[1]);
+    numiters = atoi(argv[2]);
+
+    // Each rank only builds its own planes of the source
+    poisson_mpi_slab(MPI_COMM_WORLD, N, &z0, &z1);
+    size_t plane = (size_t)N * N;
+    double *source = (double *)calloc((z1 - z0) * plane, sizeof(double));
+    double *potential = (double *)calloc((z1 - z0) * plane, sizeof(double));
+    if (z1 > z0 && (!source || !potential)) {
+        fprintf(stderr, "malloc failure\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if (N / 2 >= z0 && N / 2 < z1)
+        source[((N / 2 - z0) * N + N / 2) * N + N / 2] = 1.0;
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    double start = MPI_Wtime();
+    poisson_dirichlet_mpi(MPI_COMM_WORLD, source, potential, 1, N, N, N, 0.1, numiters);
+    MPI_Barrier(MPI_COMM_WORLD);
+    double elapsed = MPI_Wtime() - start;
+
+    // Gather the result and check it against the shared-memory solver
+    double *grid = NULL;
+    if (rank == 0)
+        grid = (double *)calloc(N * plane, sizeof(double));
+    poisson_mpi_gather(MPI_COMM_WORLD, potential, grid, N, N, N, 0);
+
+    if (rank == 0) {
+        double *full = (double *)calloc(N * plane, sizeof(double));
+        double *reference = (double *)calloc(N * plane, sizeof(double));
+        full[((N / 2 * N) + N / 2) * N + N / 2] = 1.0;
+        poisson_dirichlet(full, reference, 1, N, N, N, 0.1, numiters, 1);
+
+        double diff = 0;
+        for (size_t i = 0; i < N * plane; i++)
+            diff = fmax(diff, fabs(reference[i] - grid[i]));
+        printf("MPI: %f s, max diff: %g\n", elapsed, diff);
+        status = diff > 1e-9;
+
+        free(full);
+        free(reference);
+        free(grid);
+    }
+
+    free(source);
+    free(potential);
+    MPI_Finalize();
+    return status;
+}
@@ -0,0 +1,234 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "poisson.hpp"
+#include "poisson_kernel.hpp"
+
+// How many planes ahead of the sweep front to ask the kernel to read in
+#define OOC_PREFETCH_PLANES 4
+
+// State shared by the workers of one streaming pass.  Level t of the
+// pass holds iterate k + t; level 0 is read from the input mapping and
+// the last level is written back to the potential mapping.
+struct ooc_engine {
+	struct poisson_grid grid;
+	const double *source;			// mapped source file
+	const double *input;			// mapped iterate k, either source or potential
+	double *potential;				// mapped potential file
+	double **ring;					// ring[t][p % 3] holds plane p of level t
+	const double *bound;			// a whole plane of Vbound
+	unsigned int levels;			// iterations combined in this pass
+	pthread_barrier_t barrier;
+};
+
+struct ooc_args {
+	struct ooc_engine *e;
+	unsigned int id;
+	unsigned int y0;
+	unsigned int y1;
+	pthread_t thread;
+};
+
+static void *ooc_thread(void *args);
+
+// Ask for the next few planes of a mapping ahead of the sweep front
+static void ooc_prefetch(const double *map, size_t plane, unsigned int z, unsigned int zsize)
+{
+	if (z >= zsize)
+		return;
+	unsigned int z1 = z + OOC_PREFETCH_PLANES < zsize ? z + OOC_PREFETCH_PLANES : zsize;
+	size_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t)(map + z * plane) & ~(page - 1);
+	uintptr_t end = (uintptr_t)(map + z1 * plane);
+	madvise((void *)start, end - start, MADV_WILLNEED);
+}
+
+/// Solve Poisson's equation for grids too large for memory.  The source
+/// and potential are flat files of xsize * ysize * zsize doubles, in the
+/// same order as the arrays of poisson_dirichlet, that are memory-mapped
+/// and streamed through one z-plane at a time.  Each pass over the files
+/// performs depth iterations by keeping a ring of three planes for each
+/// iteration in flight, so the files are read and written once per depth
+/// iterations and at most 3 * (depth + 1) planes are held in memory.
+/// \param source_path is the file holding the source function
+/// \param potential_path is the file to write the potential to; created or resized as needed
+/// \param Vbound is the potential on the boundary
+/// \param xsize is the number of elements in the x-direction
+/// \param ysize is the number of elements in the y-direction
+/// \param zsize is the number of elements in the z-direction
+/// \param delta is the voxel spacing in all directions
+/// \param numiters is the number of iterations to perform
+/// \param depth is the number of iterations combined in each pass over the files
+/// \param numcores is the number of CPU cores to use.  If 0, an optimal number is chosen
+/// \return 0 on success, -1 on failure
+int poisson_dirichlet_ooc (const char *source_path, const char *potential_path,
+                           double Vbound,
+                           unsigned int xsize, unsigned int ysize, unsigned int zsize, double delta,
+                           unsigned int numiters, unsigned int depth, unsigned int numcores)
+{
+	if (numcores == 0)
+		numcores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (numcores > ysize)
+		numcores = ysize;
+	if (depth == 0)
+		depth = 1;
+
+	const size_t plane = (size_t)xsize * ysize;
+	const size_t size = plane * zsize * sizeof(double);
+	int status = -1;
+
+	// Check the source before touching the potential file, so that a bad
+	// source leaves an existing output alone
+	struct stat st;
+	int sfd = open(source_path, O_RDONLY);
+	if (sfd < 0 || fstat(sfd, &st) != 0) {
+		perror(source_path);
+		if (sfd >= 0)
+			close(sfd);
+		return -1;
+	}
+	if ((size_t)st.st_size < size) {
+		fprintf(stderr, "%s: %lld bytes, too short for a %ux%ux%u grid\n", source_path,
+				(long long)st.st_size, xsize, ysize, zsize);
+		close(sfd);
+		return -1;
+	}
+	int pfd = open(potential_path, O_RDWR | O_CREAT, 0644);
+	if (pfd < 0 || ftruncate(pfd, size) != 0) {
+		perror(potential_path);
+		close(sfd);
+		if (pfd >= 0)
+			close(pfd);
+		return -1;
+	}
+	double *source = (double *)mmap(NULL, size, PROT_READ, MAP_SHARED, sfd, 0);
+	double *potential = (double *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, pfd, 0);
+	close(sfd);
+	close(pfd);
+
+	unsigned int maxlevels = depth < numiters ? depth : numiters;
+	double **ring = (double **)calloc(maxlevels + 1, sizeof(double *));
+	double *planes = (double *)malloc((3 * (maxlevels + 1) + 1) * plane * sizeof(double));
+	if (source == MAP_FAILED || potential == MAP_FAILED || !ring || !planes) {
+		fprintf(stderr, "mmap/malloc failure\n");
+	} else {
+		struct ooc_engine e;
+		double *bound = planes + 3 * (maxlevels + 1) * plane;
+		for (size_t i = 0; i < plane; i++)
+			bound[i] = Vbound;
+		for (unsigned int t = 0; t <= maxlevels; t++)
+			ring[t] = planes + 3 * t * plane;
+
+		e.grid.source = source;
+		e.grid.bound = bound;
+		e.grid.Vbound = Vbound;
+		e.grid.delta = delta;
+		e.grid.xsize = xsize;
+		e.grid.ysize = ysize;
+		e.grid.zsize = zsize;
+		e.source = source;
+		e.potential = potential;
+		e.ring = ring;
+		e.bound = bound;
+
+		madvise(source, size, MADV_SEQUENTIAL);
+		madvise(potential, size, MADV_SEQUENTIAL);
+
+		// As in poisson_dirichlet the source is the first iterate
+		if (numiters == 0)
+			memcpy(potential, source, size);
+
+		for (unsigned int done = 0; done < numiters; done += e.levels) {
+			e.levels = numiters - done < depth ? numiters - done : depth;
+			e.input = done == 0 ? source : potential;
+			pthread_barrier_init(&e.barrier, NULL, numcores);
+
+			struct ooc_args oa[numcores];
+			for (unsigned int i = 0; i < numcores; i++) {
+				oa[i].e = &e;
+				oa[i].id = i;
+				oa[i].y0 = (unsigned int)((size_t)ysize * i / numcores);
+				oa[i].y1 = (unsigned int)((size_t)ysize * (i + 1) / numcores);
+				if (pthread_create(&oa[i].thread, NULL, ooc_thread, (void *)&oa[i]) != 0) {
+					fprintf(stderr, "Could not create thread %d\n", i);
+				}
+			}
+			for (unsigned int i = 0; i < numcores; i++) {
+				pthread_join(oa[i].thread, NULL);
+			}
+			pthread_barrier_destroy(&e.barrier);
+		}
+		status = 0;
+	}
+
+	free(planes);
+	free(ring);
+	if (source != MAP_FAILED)
+		munmap(source, size);
+	if (potential != MAP_FAILED)
+		munmap(potential, size);
+	return status;
+}
+
+
+// Plane p of level t, or the Vbound plane outside the box
+static inline const double *ooc_plane(const struct ooc_engine *e, unsigned int t, long p)
+{
+	if (p < 0 || p >= (long)e->grid.zsize)
+		return e->bound;
+	return e->ring[t] + (p % 3) * ((size_t)e->grid.xsize * e->grid.ysize);
+}
+
+
+static void *ooc_thread(void *args)
+{
+	struct ooc_args *oa = (struct ooc_args *)args;
+	struct ooc_engine *e = oa->e;
+	const unsigned int zsize = e->grid.zsize;
+	const unsigned int levels = e->levels;
+	const size_t plane = (size_t)e->grid.xsize * e->grid.ysize;
+	const size_t first = (size_t)oa->y0 * e->grid.xsize;
+	const size_t count = (size_t)(oa->y1 - oa->y0) * e->grid.xsize;
+
+	// At step z plane z enters level 0, and level t advances plane z - t.
+	// Level t - 1 plane z - t + 1 is produced earlier in the same step, and
+	// only its rows [y0, y1) are needed, which this thread wrote itself.
+	// Level T plane z - T goes straight back to the potential file.  That
+	// plane of the input was copied into the level 0 ring T steps earlier,
+	// so the pass can run in place.
+	for (long z = 0; z < (long)zsize + levels; z++) {
+		if (oa->id == 0) {
+			ooc_prefetch(e->input, plane, z + 1, zsize);
+			ooc_prefetch(e->source, plane, z + 1, zsize);
+		}
+
+		if (z < (long)zsize) {
+			memcpy(e->ring[0] + (z % 3) * plane + first, e->input + z * plane + first,
+				   count * sizeof(double));
+		}
+
+		for (unsigned int t = 1; t <= levels; t++) {
+			long p = z - t;
+			if (p < 0 || p >= (long)zsize)
+				continue;
+			double *out = t == levels ? e->potential + p * plane
+									  : e->ring[t] + (p % 3) * plane;
+			poisson_sweep_plane(&e->grid, ooc_plane(e, t - 1, p - 1), ooc_plane(e, t - 1, p),
+								ooc_plane(e, t - 1, p + 1), e->source + p * plane, out,
+								oa->y0, oa->y1);
+		}
+
+		// Neighbouring rows of the planes just produced belong to other
+		// threads and are needed in the next step
+		pthread_barrier_wait(&e->barrier);
+	}
+
+	return NULL;
+}
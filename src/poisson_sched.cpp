@@ -0,0 +1,245 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "poisson.hpp"
+#include "poisson_kernel.hpp"
+
+// Voxels each worker should own before a job is worth splitting.  Below
+// this the per-iteration barrier costs more than the extra core gains.
+#define SCHED_GRAIN (64 * 64 * 64)
+
+// A queued solve plus the state its workers share
+struct sched_job {
+	struct poisson_job job;
+	struct poisson_grid grid;
+	double *scratch;				// second Jacobi buffer
+	double *bound;
+	unsigned int width;				// number of workers the job is split over
+	unsigned int joined;			// parts handed out so far
+	unsigned int finished;			// parts completed so far
+	pthread_barrier_t barrier;
+	struct sched_job *next;
+};
+
+struct poisson_scheduler {
+	pthread_mutex_t lock;
+	pthread_cond_t work;			// signalled when a job or gang is available
+	pthread_cond_t idle;			// signalled when the last outstanding job completes
+	struct sched_job *head;
+	struct sched_job *tail;
+	struct sched_job *gang;			// split job still recruiting workers
+	unsigned int outstanding;
+	unsigned int numworkers;
+	int shutdown;
+	pthread_t *workers;
+};
+
+static void *sched_worker(void *args);
+
+/// Create a pool of worker threads that solves independent problems
+/// concurrently.  Small problems run one per worker; large ones are split
+/// into z-slabs over several workers.
+/// \param numworkers is the number of worker threads.  If 0, one per CPU core
+/// \return the scheduler, or NULL on failure
+struct poisson_scheduler *poisson_scheduler_create (unsigned int numworkers)
+{
+	if (numworkers == 0)
+		numworkers = sysconf(_SC_NPROCESSORS_ONLN);
+
+	struct poisson_scheduler *s = (struct poisson_scheduler *)calloc(1, sizeof(*s));
+	if (!s) {
+		fprintf(stderr, "malloc failure\n");
+		return NULL;
+	}
+	s->workers = (pthread_t *)malloc(numworkers * sizeof(pthread_t));
+	if (!s->workers) {
+		fprintf(stderr, "malloc failure\n");
+		free(s);
+		return NULL;
+	}
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->work, NULL);
+	pthread_cond_init(&s->idle, NULL);
+
+	for (unsigned int i = 0; i < numworkers; i++) {
+		if (pthread_create(&s->workers[i], NULL, sched_worker, (void *)s) != 0) {
+			fprintf(stderr, "Could not create thread %d\n", i);
+			break;
+		}
+		s->numworkers++;
+	}
+	if (s->numworkers == 0) {
+		poisson_scheduler_destroy(s);
+		return NULL;
+	}
+	return s;
+}
+
+/// Queue a solve.  The job is copied, but its source and potential arrays
+/// must stay valid until poisson_scheduler_wait returns.
+/// \return 0 on success, -1 if the job could not be queued
+int poisson_scheduler_submit (struct poisson_scheduler *s, const struct poisson_job *job)
+{
+	size_t count = (size_t)job->xsize * job->ysize * job->zsize;
+	struct sched_job *sj = (struct sched_job *)calloc(1, sizeof(*sj));
+	if (!sj) {
+		fprintf(stderr, "malloc failure\n");
+		return -1;
+	}
+	sj->job = *job;
+	sj->scratch = (double *)malloc(count * sizeof(double));
+	sj->bound = poisson_bound_row(job->xsize, job->Vbound);
+	if (!sj->scratch || !sj->bound) {
+		fprintf(stderr, "malloc failure\n");
+		free(sj->scratch);
+		free(sj->bound);
+		free(sj);
+		return -1;
+	}
+
+	sj->grid.source = job->source;
+	sj->grid.bound 	= sj->bound;
+	sj->grid.Vbound = job->Vbound;
+	sj->grid.delta 	= job->delta;
+	sj->grid.xsize 	= job->xsize;
+	sj->grid.ysize 	= job->ysize;
+	sj->grid.zsize 	= job->zsize;
+
+	sj->width = count / SCHED_GRAIN;
+	if (sj->width > s->numworkers)
+		sj->width = s->numworkers;
+	if (sj->width > job->zsize)
+		sj->width = job->zsize;
+	if (sj->width == 0)
+		sj->width = 1;
+	if (sj->width > 1)
+		pthread_barrier_init(&sj->barrier, NULL, sj->width);
+
+	pthread_mutex_lock(&s->lock);
+	if (s->tail)
+		s->tail->next = sj;
+	else
+		s->head = sj;
+	s->tail = sj;
+	s->outstanding++;
+	pthread_cond_signal(&s->work);
+	pthread_mutex_unlock(&s->lock);
+	return 0;
+}
+
+/// Block until every submitted job has completed
+void poisson_scheduler_wait (struct poisson_scheduler *s)
+{
+	pthread_mutex_lock(&s->lock);
+	while (s->outstanding > 0)
+		pthread_cond_wait(&s->idle, &s->lock);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/// Wait for outstanding jobs, then stop the workers and free the scheduler
+void poisson_scheduler_destroy (struct poisson_scheduler *s)
+{
+	poisson_scheduler_wait(s);
+
+	pthread_mutex_lock(&s->lock);
+	s->shutdown = 1;
+	pthread_cond_broadcast(&s->work);
+	pthread_mutex_unlock(&s->lock);
+
+	for (unsigned int i = 0; i < s->numworkers; i++) {
+		pthread_join(s->workers[i], NULL);
+	}
+
+	pthread_cond_destroy(&s->idle);
+	pthread_cond_destroy(&s->work);
+	pthread_mutex_destroy(&s->lock);
+	free(s->workers);
+	free(s);
+}
+
+
+// Run one z-slab part of a job.  Like poisson_dirichlet the source seeds
+// the first iterate and the result ends up in the caller's potential.
+static void sched_run(struct sched_job *sj, unsigned int part)
+{
+	const struct poisson_job *job = &sj->job;
+	const size_t plane = (size_t)job->xsize * job->ysize;
+	const unsigned int zstart = (unsigned int)((size_t)job->zsize * part / sj->width);
+	const unsigned int zend = (unsigned int)((size_t)job->zsize * (part + 1) / sj->width);
+	double *in = sj->scratch;
+	double *out = job->potential;
+
+	memcpy(in + zstart * plane, job->source + zstart * plane, (zend - zstart) * plane * sizeof(double));
+	if (sj->width > 1)
+		pthread_barrier_wait(&sj->barrier);
+
+	for (unsigned int iter = 0; iter < job->numiters; iter++) {
+		poisson_sweep_slab(&sj->grid, in, out, zstart, zend);
+
+		double *temp = in;
+		in = out;
+		out = temp;
+
+		if (sj->width > 1)
+			pthread_barrier_wait(&sj->barrier);
+	}
+
+	if (in != job->potential) {
+		memcpy(job->potential + zstart * plane, in + zstart * plane, (zend - zstart) * plane * sizeof(double));
+	}
+}
+
+
+static void *sched_worker(void *args)
+{
+	struct poisson_scheduler *s = (struct poisson_scheduler *)args;
+
+	pthread_mutex_lock(&s->lock);
+	while (1) {
+		struct sched_job *sj;
+		unsigned int part;
+
+		// Joining a split job comes first so that its members, which
+		// are already waiting at its barrier, are not held up.
+		if (s->gang) {
+			sj = s->gang;
+			part = sj->joined++;
+			if (sj->joined == sj->width)
+				s->gang = NULL;
+		} else if (s->head) {
+			sj = s->head;
+			s->head = sj->next;
+			if (!s->head)
+				s->tail = NULL;
+			part = sj->joined++;
+			if (sj->width > 1) {
+				s->gang = sj;
+				pthread_cond_broadcast(&s->work);
+			}
+		} else if (s->shutdown) {
+			break;
+		} else {
+			pthread_cond_wait(&s->work, &s->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&s->lock);
+
+		sched_run(sj, part);
+
+		pthread_mutex_lock(&s->lock);
+		if (++sj->finished == sj->width) {
+			if (sj->width > 1)
+				pthread_barrier_destroy(&sj->barrier);
+			free(sj->scratch);
+			free(sj->bound);
+			free(sj);
+			if (--s->outstanding == 0)
+				pthread_cond_broadcast(&s->idle);
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
@@ -0,0 +1,362 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "poisson.hpp"
+
+// Buffers are allocated and written in multiples of this, which satisfies
+// the alignment O_DIRECT asks for on common filesystems
+#define SNAPSHOT_ALIGN POISSON_GRID_ALIGN
+
+struct snapshot_buffer {
+	double *data;
+	unsigned int iteration;
+};
+
+struct poisson_snapshot_writer {
+	char *prefix;
+	struct poisson_grid_header header;
+	size_t padded;					// data_bytes rounded up to SNAPSHOT_ALIGN
+	unsigned char *page;			// header page, written ahead of the data
+	int policy;
+	int checkpoint;					// keep only the latest, always complete, in prefix itself
+	double tolerance;				// compress to this error bound if positive
+	unsigned int threads;			// compression threads
+	unsigned int nbuffers;
+	struct snapshot_buffer *buffers;
+	unsigned int *free_list;		// indices of idle buffers
+	unsigned int nfree;
+	unsigned int *queue;			// ring of indices waiting to be written, oldest first
+	unsigned int head;
+	unsigned int queued;
+	unsigned int written;
+	unsigned int dropped;
+	int status;
+	int closing;
+	pthread_mutex_t lock;
+	pthread_cond_t work;			// a buffer was queued, or closing was set
+	pthread_cond_t freed;			// a buffer was returned to the free list
+	pthread_t thread;
+};
+
+static void *snapshot_thread(void *args);
+
+// Which of the writer's buffers this is
+static unsigned int snapshot_index(const struct poisson_snapshot_writer *w, const double *buffer)
+{
+	unsigned int i = 0;
+	while (w->buffers[i].data != buffer)
+		i++;
+	return i;
+}
+
+/// Start a writer thread for snapshots of one grid.  Snapshot k is written
+/// to the grid file prefix followed by k as six digits and ".pgrid".
+/// \param prefix is the start of the file names, e.g. "out/snap_"
+/// \param delta is the voxel spacing recorded in the files
+/// \param Vbound is the boundary potential recorded in the files
+/// \param nbuffers is the number of grid-sized buffers.  Two let the solver
+///        fill one while the other is written.  If 0, two
+/// \param policy is one of POISSON_SNAPSHOT_BLOCK, _DROP_NEWEST or _DROP_OLDEST
+/// \return the writer, or NULL on failure
+struct poisson_snapshot_writer *poisson_snapshot_create (const char *prefix,
+                                                         unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                                                         double delta, double Vbound,
+                                                         unsigned int nbuffers, int policy)
+{
+	if (nbuffers == 0)
+		nbuffers = 2;
+
+	struct poisson_snapshot_writer *w = (struct poisson_snapshot_writer *)calloc(1, sizeof(*w));
+	if (!w) {
+		fprintf(stderr, "malloc failure\n");
+		return NULL;
+	}
+	poisson_grid_header_init(&w->header, xsize, ysize, zsize, delta, Vbound);
+	w->padded = (w->header.data_bytes + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+	w->policy = policy;
+	w->nbuffers = nbuffers;
+	w->prefix = strdup(prefix);
+	w->buffers = (struct snapshot_buffer *)calloc(nbuffers, sizeof(*w->buffers));
+	w->free_list = (unsigned int *)malloc(nbuffers * sizeof(unsigned int));
+	w->queue = (unsigned int *)malloc(nbuffers * sizeof(unsigned int));
+
+	int ok = w->prefix && w->buffers && w->free_list && w->queue
+			 && posix_memalign((void **)&w->page, SNAPSHOT_ALIGN, SNAPSHOT_ALIGN) == 0;
+	for (unsigned int i = 0; ok && i < nbuffers; i++) {
+		void *p;
+		if (posix_memalign(&p, SNAPSHOT_ALIGN, w->padded) != 0) {
+			ok = 0;
+			break;
+		}
+		// The padding past the grid is written too, then truncated away
+		memset((unsigned char *)p + w->header.data_bytes, 0, w->padded - w->header.data_bytes);
+		w->buffers[i].data = (double *)p;
+		w->free_list[w->nfree++] = i;
+	}
+
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->work, NULL);
+	pthread_cond_init(&w->freed, NULL);
+	if (!ok || pthread_create(&w->thread, NULL, snapshot_thread, (void *)w) != 0) {
+		if (!ok)
+			fprintf(stderr, "malloc failure\n");
+		else
+			fprintf(stderr, "Could not create snapshot thread\n");
+		pthread_mutex_destroy(&w->lock);
+		pthread_cond_destroy(&w->work);
+		pthread_cond_destroy(&w->freed);
+		for (unsigned int i = 0; w->buffers && i < nbuffers; i++)
+			free(w->buffers[i].data);
+		free(w->page);
+		free(w->queue);
+		free(w->free_list);
+		free(w->buffers);
+		free(w->prefix);
+		free(w);
+		return NULL;
+	}
+	return w;
+}
+
+/// Start a writer thread for checkpoints of a solve, see poisson_options.
+/// Each checkpoint is written beside path, flushed to disk and renamed over
+/// path, so path always holds the latest complete checkpoint.  Three
+/// buffers let one be written and one queued while the solver fills the
+/// third; should the writer fall behind, the queued checkpoint is replaced
+/// by the newer one rather than holding up the solver.
+/// \param path is the checkpoint file
+/// \param delta is the voxel spacing of the solve
+/// \param Vbound is the boundary potential of the solve
+/// \return the writer, or NULL on failure
+struct poisson_snapshot_writer *poisson_checkpoint_create (const char *path,
+                                                           unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                                                           double delta, double Vbound)
+{
+	struct poisson_snapshot_writer *w = poisson_snapshot_create(path, xsize, ysize, zsize, delta, Vbound,
+																3, POISSON_SNAPSHOT_DROP_OLDEST);
+	if (w)
+		w->checkpoint = 1;
+	return w;
+}
+
+/// Take an idle buffer to copy a snapshot into.  When every buffer is busy
+/// the writer's policy decides: wait for one, give up, or take back the
+/// oldest snapshot that has not started being written.
+/// \return a buffer of xsize * ysize * zsize doubles, or NULL if this snapshot is dropped
+double *poisson_snapshot_acquire (struct poisson_snapshot_writer *w)
+{
+	double *data = NULL;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->policy == POISSON_SNAPSHOT_BLOCK) {
+		while (w->nfree == 0)
+			pthread_cond_wait(&w->freed, &w->lock);
+	}
+	if (w->nfree > 0) {
+		data = w->buffers[w->free_list[--w->nfree]].data;
+	} else if (w->policy == POISSON_SNAPSHOT_DROP_OLDEST && w->queued > 0) {
+		data = w->buffers[w->queue[w->head]].data;
+		w->head = (w->head + 1) % w->nbuffers;
+		w->queued--;
+		w->dropped++;
+	} else {
+		w->dropped++;
+	}
+	pthread_mutex_unlock(&w->lock);
+	return data;
+}
+
+/// Queue a filled buffer from poisson_snapshot_acquire for writing.  The
+/// buffer belongs to the writer again afterwards.
+/// \param iteration is the iteration count the snapshot was taken after
+void poisson_snapshot_submit (struct poisson_snapshot_writer *w, double *buffer, unsigned int iteration)
+{
+	unsigned int i = snapshot_index(w, buffer);
+
+	pthread_mutex_lock(&w->lock);
+	w->buffers[i].iteration = iteration;
+	w->queue[(w->head + w->queued) % w->nbuffers] = i;
+	w->queued++;
+	pthread_cond_signal(&w->work);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/// Give back a buffer from poisson_snapshot_acquire without writing it,
+/// e.g. when a solve stops before reaching the iterate it was meant for
+void poisson_snapshot_release (struct poisson_snapshot_writer *w, double *buffer)
+{
+	pthread_mutex_lock(&w->lock);
+	w->free_list[w->nfree++] = snapshot_index(w, buffer);
+	pthread_cond_signal(&w->freed);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/// Compress the snapshots written from now on with poisson_compress.  The
+/// writer thread does the compression, on numcores threads of its own, so
+/// the solver still pays only for its copy.
+///
+/// Checkpoints cannot be compressed: a solve resumed from a checkpoint
+/// ends bit-for-bit where an uninterrupted one does, which a lossy copy of
+/// the iterate would break.
+/// \param tolerance is the largest absolute error allowed in any voxel.  If 0, no compression
+/// \param numcores is the number of compression threads.  If 0, one per core
+/// \return 0, or -1 if w writes checkpoints and tolerance is not 0
+int poisson_snapshot_compress (struct poisson_snapshot_writer *w, double tolerance, unsigned int numcores)
+{
+	if (w->checkpoint && tolerance > 0) {
+		fprintf(stderr, "poisson_snapshot_compress: checkpoints are always written exactly\n");
+		return -1;
+	}
+	pthread_mutex_lock(&w->lock);
+	w->tolerance = tolerance;
+	w->threads = numcores;
+	pthread_mutex_unlock(&w->lock);
+	return 0;
+}
+
+/// Write the queued snapshots, stop the writer thread and free it
+/// \param written receives the number of snapshots written, if not NULL
+/// \param dropped receives the number of snapshots dropped, if not NULL
+/// \return 0 if every snapshot was written successfully, -1 otherwise
+int poisson_snapshot_destroy (struct poisson_snapshot_writer *w,
+                              unsigned int *written, unsigned int *dropped)
+{
+	pthread_mutex_lock(&w->lock);
+	w->closing = 1;
+	pthread_cond_signal(&w->work);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+
+	if (written)
+		*written = w->written;
+	if (dropped)
+		*dropped = w->dropped;
+	int status = w->status;
+
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->work);
+	pthread_cond_destroy(&w->freed);
+	for (unsigned int i = 0; i < w->nbuffers; i++)
+		free(w->buffers[i].data);
+	free(w->page);
+	free(w->queue);
+	free(w->free_list);
+	free(w->buffers);
+	free(w->prefix);
+	free(w);
+	return status;
+}
+
+
+// Write all of buf to fd at offset
+static int snapshot_pwrite(int fd, const unsigned char *buf, size_t len, off_t offset)
+{
+	while (len > 0) {
+		ssize_t n = pwrite(fd, buf, len, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+
+// Write one snapshot file.  Everything is page-aligned, so the writes go
+// round the page cache with O_DIRECT and do not evict the solver's grid.
+// Filesystems without O_DIRECT, such as tmpfs, get ordinary writes.
+static int snapshot_write(struct poisson_snapshot_writer *w, const struct snapshot_buffer *b)
+{
+	char path[strlen(w->prefix) + 32];
+	if (w->checkpoint)
+		snprintf(path, sizeof(path), "%s.tmp", w->prefix);
+	else
+		snprintf(path, sizeof(path), "%s%06u.pgrid", w->prefix, b->iteration);
+
+	// Compressed snapshots are small and go through the page cache.  If the
+	// tolerance is too fine for the data the raw grid is written instead.
+	pthread_mutex_lock(&w->lock);
+	double tolerance = w->tolerance;
+	unsigned int threads = w->threads;
+	pthread_mutex_unlock(&w->lock);
+	if (tolerance > 0) {
+		const struct poisson_grid_header *h = &w->header;
+		if (poisson_grid_write_compressed(path, b->data, h->xsize, h->ysize, h->zsize,
+										  h->delta, h->Vbound, b->iteration, tolerance, threads) == 0)
+			return 0;
+	}
+
+	w->header.iteration = b->iteration;
+	w->header.checksum = poisson_grid_checksum(b->data, &w->header);
+	memset(w->page, 0, SNAPSHOT_ALIGN);
+	memcpy(w->page, &w->header, sizeof(w->header));
+
+	for (int direct = 1; direct >= 0; direct--) {
+		int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | (direct ? O_DIRECT : 0), 0644);
+		if (fd < 0) {
+			if (direct && errno == EINVAL)
+				continue;
+			perror(path);
+			return -1;
+		}
+		int status = snapshot_pwrite(fd, (const unsigned char *)b->data, w->padded, w->header.data_offset);
+		if (status == 0)
+			status = snapshot_pwrite(fd, w->page, SNAPSHOT_ALIGN, 0);
+		if (status == 0)
+			status = ftruncate(fd, w->header.data_offset + w->header.data_bytes);
+		if (status == 0 && w->checkpoint)
+			status = fsync(fd);
+		if (close(fd) != 0)
+			status = -1;
+		// A checkpoint replaces the last one only once it is safely on disk
+		if (status == 0 && w->checkpoint && rename(path, w->prefix) != 0) {
+			perror(w->prefix);
+			return -1;
+		}
+		if (status == 0)
+			return 0;
+		if (!direct || errno != EINVAL) {
+			perror(path);
+			return -1;
+		}
+	}
+	return -1;
+}
+
+
+static void *snapshot_thread(void *args)
+{
+	struct poisson_snapshot_writer *w = (struct poisson_snapshot_writer *)args;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (w->queued == 0 && !w->closing)
+			pthread_cond_wait(&w->work, &w->lock);
+		if (w->queued == 0)
+			break;
+		unsigned int i = w->queue[w->head];
+		w->head = (w->head + 1) % w->nbuffers;
+		w->queued--;
+		pthread_mutex_unlock(&w->lock);
+
+		int status = snapshot_write(w, &w->buffers[i]);
+
+		pthread_mutex_lock(&w->lock);
+		if (status == 0)
+			w->written++;
+		else
+			w->status = -1;
+		w->free_list[w->nfree++] = i;
+		pthread_cond_signal(&w->freed);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
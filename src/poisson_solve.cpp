@@ -0,0 +1,505 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "poisson.hpp"
+#include "poisson_kernel.hpp"
+#include "poisson_stencil.hpp"
+
+// Snapshots and checkpoints are both copies of an iterate handed to a writer
+#define SOLVE_OUTPUTS 2
+
+// Rows per tile of one plane when skipping unchanged tiles
+#define DIRTY_ROWS 16
+
+// A source with at most one non-zero voxel in this many is held sparse
+#define SPARSE_FRACTION 64
+
+struct solve_output {
+	struct poisson_snapshot_writer *writer;
+	unsigned int every;
+	double *slot[2];				// slot[k % 2] receives iterate k
+};
+
+// State shared by the workers of one poisson_solve call
+struct solve_engine {
+	struct poisson_grid grid;
+	const double *start;			// first iterate, the source or a checkpoint
+	const double *source;			// as given, if grid.source is a corrected copy
+	double *rhs;					// Mehrstellen source, or NULL
+	double *potential;
+	double *scratch;
+	unsigned int first;				// iteration count of start
+	unsigned int numiters;
+	unsigned int done;				// iteration count of the result
+	double tolerance;
+	double *changes;				// changes[2 * id + iter % 2] from each worker
+	unsigned int workers;
+	unsigned char *dirty;			// dirty[(k % 2) * ntiles + t]: tile t changed in iterate k
+	unsigned int tiles_y;			// tiles across a plane
+	size_t ntiles;
+	struct poisson_sparse_source sparse;	// index is NULL if the source is dense
+	poisson_jit_fn jit;				// specialised kernel for plain sweeps, or NULL
+	poisson_sweep_fn sweep;			// stencil other than the 7-point one, or NULL
+	struct solve_output out[SOLVE_OUTPUTS];
+	pthread_barrier_t barrier;
+};
+
+// structure we're going to use for arguments to our solve pthread function
+struct solve_args {
+	struct solve_engine *e;
+	unsigned int id;
+	unsigned int zstart;
+	unsigned int zend;
+	pthread_t thread;
+};
+
+static void *solve_thread(void *args);
+static double *output_acquire(struct solve_output *o, unsigned int k, unsigned int numiters);
+static double solve_sweep(struct solve_engine *e, const struct solve_args *sa,
+                          const double *in, double *out, unsigned int iter);
+static int sparse_init(struct poisson_sparse_source *sp, const double *source,
+                       unsigned int xsize, unsigned int ysize, unsigned int zsize, double delta);
+static void sparse_free(struct poisson_sparse_source *sp);
+static void mehrstellen_rhs(const struct solve_engine *e, unsigned int z0, unsigned int z1);
+
+/// Fill in the default options: start from the source, run every
+/// iteration, and no snapshots, checkpoints or resuming
+void poisson_options_init (struct poisson_options *opts)
+{
+	memset(opts, 0, sizeof(*opts));
+}
+
+/// Solve Poisson's equation like poisson_dirichlet, with the extra
+/// behaviour selected by opts.  The workers relax z-slabs in lock-step.
+///
+/// Snapshots and checkpoints are copied out by the workers, each its own
+/// planes, alongside the next sweep and written by a background thread.
+/// Only the current iterate is checkpointed: a Jacobi sweep overwrites the
+/// other buffer completely, so the iterate, its iteration count and the
+/// parameters in the grid file header are the whole state, and resuming
+/// gives bit-for-bit the result of an uninterrupted run.
+///
+/// With a tolerance every worker reports the largest change in its slab,
+/// and after each barrier all of them see the same reports and stop
+/// together.  A warm start from a nearby solution then needs far fewer
+/// iterations than maxiters.
+///
+/// With skip_unchanged each plane is cut into tiles of DIRTY_ROWS rows,
+/// and a tile is only swept if it or a face neighbour changed in the last
+/// iteration.  Otherwise its inputs are bit-for-bit those of the previous
+/// sweep, so the other buffer, which it did not change in, already holds
+/// the result.  Early iterations from a compact source touch only the
+/// tiles the fronts from the charges and the faces have reached.
+///
+/// A source with few charges, at most one voxel in SPARSE_FRACTION, is
+/// held as a list of them per x-row.  Rows are then relaxed with the
+/// Laplace kernel, which streams only the two iterate buffers, and the
+/// charged voxels patched up afterwards, with bit-for-bit the same result.
+///
+/// With jit, plain sweeps of a dense source use a kernel compiled for this
+/// shape and number of workers by poisson_jit_kernel, again with the same
+/// result.  Without a compiler the generic kernel is used.
+///
+/// A sweep function, such as poisson_stencil<S>::sweep, replaces the
+/// 7-point stencil throughout.  The sparse and jit kernels are 7-point
+/// only, and skip_unchanged only follows face neighbours, so all three are
+/// off with it.
+///
+/// mehrstellen selects the fourth order compact scheme: the 19-point
+/// Laplacian of poisson_laplace19 with the source replaced by
+/// s + delta^2 / 12 * Laplacian(s), which the workers work out for their
+/// own planes before the first sweep.  Past the faces the source is
+/// extrapolated linearly.  The error then falls as delta^4 instead of
+/// delta^2, so a grid of half the resolution or less does as well.
+/// \param opts selects the extra behaviour; NULL gives plain poisson_dirichlet
+/// \return the number of iterations performed, counting those before a
+///         resumed checkpoint, or 0 if the checkpoint does not match this solve
+///         or memory runs out
+unsigned int poisson_solve (double * __restrict__ source,
+                            double * __restrict__ potential,
+                            double Vbound,
+                            unsigned int xsize, unsigned int ysize, unsigned int zsize, double delta,
+                            unsigned int numiters, unsigned int numcores,
+                            const struct poisson_options *opts)
+{
+	struct poisson_options defaults;
+	if (!opts) {
+		poisson_options_init(&defaults);
+		opts = &defaults;
+	}
+	if (numcores == 0)
+		numcores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (numcores > zsize)
+		numcores = zsize;
+
+	// A missing checkpoint means the solve has not got that far yet
+	struct poisson_grid_header h;
+	double *resumed = NULL;
+	if (opts->resume && access(opts->resume, F_OK) == 0) {
+		resumed = poisson_grid_read(opts->resume, &h, numcores);
+		if (!resumed || h.dtype != POISSON_GRID_F64 || h.xsize != xsize || h.ysize != ysize
+			|| h.zsize != zsize || h.delta != delta || h.Vbound != Vbound || h.iteration > numiters) {
+			fprintf(stderr, "%s: not a checkpoint of this solve\n", opts->resume);
+			free(resumed);
+			return 0;
+		}
+	}
+
+	size_t size = (size_t)xsize * ysize * zsize * sizeof(double);
+	double *scratch = (double *)malloc(size);
+	double *bound = poisson_bound_row(xsize, Vbound);
+	double *changes = (double *)calloc(2 * numcores, sizeof(double));
+	unsigned int tiles_y = (ysize + DIRTY_ROWS - 1) / DIRTY_ROWS;
+	size_t ntiles = (size_t)tiles_y * zsize;
+	poisson_sweep_fn sweep = opts->mehrstellen ? poisson_stencil<poisson_laplace19>::sweep : opts->sweep;
+	int skip = opts->skip_unchanged && !sweep;
+	unsigned char *dirty = skip ? (unsigned char *)malloc(2 * ntiles) : NULL;
+	double *rhs = opts->mehrstellen ? (double *)malloc(size) : NULL;
+	struct poisson_sparse_source sparse;
+	memset(&sparse, 0, sizeof(sparse));
+	if (!scratch || !bound || !changes || (skip && !dirty) || (opts->mehrstellen && !rhs)
+		|| (!sweep && sparse_init(&sparse, source, xsize, ysize, zsize, delta) != 0)) {
+		fprintf(stderr, "malloc failure\n");
+		free(scratch);
+		free(bound);
+		free(changes);
+		free(dirty);
+		free(rhs);
+		free(resumed);
+		return 0;
+	}
+
+	struct solve_engine e;
+	e.grid.source = rhs ? rhs : source;
+	e.grid.bound = bound;
+	e.grid.Vbound = Vbound;
+	e.grid.delta = delta;
+	e.grid.xsize = xsize;
+	e.grid.ysize = ysize;
+	e.grid.zsize = zsize;
+	e.start = resumed ? resumed : opts->warm_start ? potential : source;
+	e.source = source;
+	e.rhs = rhs;
+	e.potential = potential;
+	e.scratch = scratch;
+	e.first = resumed ? h.iteration : 0;
+	e.numiters = numiters;
+	e.done = numiters;
+	e.tolerance = opts->tolerance;
+	e.changes = changes;
+	e.workers = numcores;
+	e.dirty = dirty;
+	e.tiles_y = tiles_y;
+	e.ntiles = ntiles;
+	e.sparse = sparse;
+	e.jit = opts->jit && !sparse.index && !sweep
+		  ? poisson_jit_kernel(xsize, ysize, zsize, numcores) : NULL;
+	e.sweep = sweep;
+	// Nothing is known about the iterate before the first
+	if (dirty)
+		memset(dirty + (e.first % 2) * ntiles, 1, ntiles);
+	e.out[0].writer = opts->snapshots;
+	e.out[0].every = opts->snapshot_every;
+	e.out[1].writer = opts->checkpoints;
+	e.out[1].every = opts->checkpoint_every;
+	for (unsigned int j = 0; j < SOLVE_OUTPUTS; j++) {
+		e.out[j].slot[e.first % 2] = NULL;
+		e.out[j].slot[(e.first + 1) % 2] = output_acquire(&e.out[j], e.first + 1, numiters);
+	}
+	pthread_barrier_init(&e.barrier, NULL, numcores);
+
+	struct solve_args sa[numcores];
+	for (unsigned int i = 0; i < numcores; i++) {
+		sa[i].e 		= &e;
+		sa[i].id 		= i;
+		sa[i].zstart 	= (unsigned int)((size_t)zsize * i / numcores);
+		sa[i].zend 		= (unsigned int)((size_t)zsize * (i + 1) / numcores);
+		if (pthread_create(&sa[i].thread, NULL, solve_thread, (void *)&sa[i]) != 0) {
+			fprintf(stderr, "Could not create thread %d\n", i);
+		}
+	}
+	for (unsigned int i = 0; i < numcores; i++) {
+		pthread_join(sa[i].thread, NULL);
+	}
+
+	// The final iterate was copied after the last barrier.  After an early
+	// stop the other slot may hold a buffer for an iterate never reached.
+	for (unsigned int j = 0; j < SOLVE_OUTPUTS; j++) {
+		if (e.out[j].slot[e.done % 2])
+			poisson_snapshot_submit(e.out[j].writer, e.out[j].slot[e.done % 2], e.done);
+		if (e.out[j].slot[(e.done + 1) % 2])
+			poisson_snapshot_release(e.out[j].writer, e.out[j].slot[(e.done + 1) % 2]);
+	}
+
+	pthread_barrier_destroy(&e.barrier);
+	free(bound);
+	free(scratch);
+	free(changes);
+	free(dirty);
+	free(rhs);
+	free(resumed);
+	sparse_free(&sparse);
+	return e.done;
+}
+
+
+// Fill in sp if the source is sparse enough to be worth it, otherwise
+// leave sp->index NULL.  Returns -1 if memory runs out.
+static int sparse_init(struct poisson_sparse_source *sp, const double *source,
+                       unsigned int xsize, unsigned int ysize, unsigned int zsize, double delta)
+{
+	const size_t count = (size_t)xsize * ysize * zsize;
+	const size_t nrows = (size_t)ysize * zsize;
+	const double d2 = delta * delta;
+	memset(sp, 0, sizeof(*sp));
+
+	// Stop counting as soon as the source is too dense
+	size_t nnz = 0;
+	for (size_t i = 0; i < count && nnz <= count / SPARSE_FRACTION; i++)
+		nnz += source[i] != 0;
+	if (nnz > count / SPARSE_FRACTION)
+		return 0;
+
+	size_t *index = (size_t *)malloc((nnz ? nnz : 1) * sizeof(size_t));
+	double *scaled = (double *)malloc((nnz ? nnz : 1) * sizeof(double));
+	size_t *rows = (size_t *)malloc((nrows + 1) * sizeof(size_t));
+	if (!index || !scaled || !rows) {
+		free(index);
+		free(scaled);
+		free(rows);
+		return -1;
+	}
+
+	size_t n = 0;
+	for (size_t r = 0; r < nrows; r++) {
+		rows[r] = n;
+		for (size_t i = r * xsize; i < (r + 1) * xsize; i++) {
+			if (source[i] != 0) {
+				index[n] = i;
+				scaled[n] = d2 * source[i];
+				n++;
+			}
+		}
+	}
+	rows[nrows] = n;
+
+	sp->index = index;
+	sp->scaled = scaled;
+	sp->rows = rows;
+	return 0;
+}
+
+
+static void sparse_free(struct poisson_sparse_source *sp)
+{
+	free((void *)sp->index);
+	free((void *)sp->scaled);
+	free((void *)sp->rows);
+}
+
+
+// The source in row near at column x, where c is the voxel's own source
+// and far the row on its other side.  Either row is NULL past a face, and
+// a missing near row is extrapolated linearly from c and far.
+static inline double mehrstellen_neighbour(double c, const double *near, const double *far,
+                                           unsigned int x)
+{
+	return near ? near[x] : far ? 2 * c - far[x] : c;
+}
+
+
+// Work out the Mehrstellen source, s + (sum of face neighbours - 6 s) / 12,
+// for planes [z0, z1).  delta^2 cancels between the Laplacian of the
+// source and its weight.
+static void mehrstellen_rhs(const struct solve_engine *e, unsigned int z0, unsigned int z1)
+{
+	const unsigned int xs = e->grid.xsize;
+	const unsigned int ys = e->grid.ysize;
+	const unsigned int zs = e->grid.zsize;
+	const size_t plane = (size_t)xs * ys;
+
+	for (unsigned int z = z0; z < z1; z++) {
+		for (unsigned int y = 0; y < ys; y++) {
+			size_t row = z * plane + (size_t)y * xs;
+			const double *c  = e->source + row;
+			const double *ym = y > 0 	  ? c - xs 	  : NULL;
+			const double *yp = y < ys - 1 ? c + xs 	  : NULL;
+			const double *zm = z > 0 	  ? c - plane : NULL;
+			const double *zp = z < zs - 1 ? c + plane : NULL;
+			double *r = e->rhs + row;
+			for (unsigned int x = 0; x < xs; x++) {
+				double xm = x > 0 ? c[x - 1] : x + 1 < xs ? 2 * c[x] - c[x + 1] : c[x];
+				double xp = x + 1 < xs ? c[x + 1] : x > 0 ? 2 * c[x] - c[x - 1] : c[x];
+				double sum = xm + xp
+						   + mehrstellen_neighbour(c[x], ym, yp, x) + mehrstellen_neighbour(c[x], yp, ym, x)
+						   + mehrstellen_neighbour(c[x], zm, zp, x) + mehrstellen_neighbour(c[x], zp, zm, x);
+				r[x] = c[x] / 2 + sum / 12;
+			}
+		}
+	}
+}
+
+
+// A buffer for iterate k if the output wants it, otherwise NULL
+static double *output_acquire(struct solve_output *o, unsigned int k, unsigned int numiters)
+{
+	if (!o->writer || !o->every || k % o->every != 0 || k > numiters)
+		return NULL;
+	return poisson_snapshot_acquire(o->writer);
+}
+
+
+// Relax rows [y0, y1) of plane z, folding the largest change into *change
+// if it is not NULL.  Returns whether any voxel changed, if track is set.
+static int solve_rows(const struct solve_engine *e, const double *in, double *out,
+                      unsigned int z, unsigned int y0, unsigned int y1, double *change, int track)
+{
+	const struct poisson_grid *g = &e->grid;
+	int changed = 0;
+
+	if (!change && !track) {
+		if (e->sparse.index)
+			poisson_sweep_sparse(g, &e->sparse, in, out, y0, y1, z, z + 1);
+		else if (e->sweep)
+			e->sweep(g, in, out, 0, g->xsize, y0, y1, z, z + 1);
+		else
+			poisson_sweep(g, in, out, 0, g->xsize, y0, y1, z, z + 1);
+		return 0;
+	}
+
+	// Each row is compared while it is still in cache.  Bitwise equality
+	// is exactly what makes the next sweep reproduce its result, and the
+	// test stops at the first difference.
+	for (unsigned int y = y0; y < y1; y++) {
+		if (e->sparse.index)
+			poisson_sweep_sparse(g, &e->sparse, in, out, y, y + 1, z, z + 1);
+		else if (e->sweep)
+			e->sweep(g, in, out, 0, g->xsize, y, y + 1, z, z + 1);
+		else
+			poisson_sweep(g, in, out, 0, g->xsize, y, y + 1, z, z + 1);
+		const size_t r = ((size_t)z * g->ysize + y) * g->xsize;
+		if (change) {
+			double c = *change;
+			for (unsigned int x = 0; x < g->xsize; x++) {
+				double d = out[r + x] - in[r + x];
+				d = d < 0 ? -d : d;
+				c = d > c ? d : c;
+			}
+			*change = c;
+		}
+		if (track && !changed)
+			changed = memcmp(out + r, in + r, g->xsize * sizeof(double)) != 0;
+	}
+	return changed;
+}
+
+
+// Sweep a worker's slab and return the largest change, if there is a
+// tolerance.  When skipping unchanged tiles only the tiles whose inputs
+// changed in iterate iter are swept, noting which of them change in
+// iterate iter + 1.  The maps for neighbouring planes in other slabs were
+// written before the last barrier.
+static double solve_sweep(struct solve_engine *e, const struct solve_args *sa,
+                          const double *in, double *out, unsigned int iter)
+{
+	const struct poisson_grid *g = &e->grid;
+	double change = 0;
+	double *measure = e->tolerance > 0 ? &change : NULL;
+
+	if (!e->dirty && !measure && e->jit) {
+		e->jit(in, g->source, out, g->delta * g->delta, g->Vbound, sa->id);
+		return 0;
+	}
+	if (!e->dirty) {
+		for (unsigned int z = sa->zstart; z < sa->zend; z++)
+			solve_rows(e, in, out, z, 0, g->ysize, measure, 0);
+		return change;
+	}
+
+	const unsigned int ty = e->tiles_y;
+	const unsigned char *was = e->dirty + (iter % 2) * e->ntiles;
+	unsigned char *now = e->dirty + ((iter + 1) % 2) * e->ntiles;
+	for (unsigned int z = sa->zstart; z < sa->zend; z++) {
+		for (unsigned int y = 0; y < ty; y++) {
+			size_t t = (size_t)z * ty + y;
+			if (!was[t] && !(y > 0 && was[t - 1]) && !(y + 1 < ty && was[t + 1])
+				&& !(z > 0 && was[t - ty]) && !(z + 1 < g->zsize && was[t + ty])) {
+				now[t] = 0;
+				continue;
+			}
+			unsigned int y1 = (y + 1) * DIRTY_ROWS < g->ysize ? (y + 1) * DIRTY_ROWS : g->ysize;
+			now[t] = solve_rows(e, in, out, z, y * DIRTY_ROWS, y1, measure, 1);
+		}
+	}
+	return change;
+}
+
+
+static void *solve_thread(void *args)
+{
+	struct solve_args *sa = (struct solve_args *)args;
+	struct solve_engine *e = sa->e;
+	const size_t plane = (size_t)e->grid.xsize * e->grid.ysize;
+	const size_t first = sa->zstart * plane;
+	const size_t count = (sa->zend - sa->zstart) * plane;
+	double *in = e->scratch;
+	double *out = e->potential;
+
+	// As in poisson_dirichlet the source is the first iterate, unless
+	// warm starting or resuming from a checkpoint
+	memcpy(in + first, e->start + first, count * sizeof(double));
+	if (e->rhs)
+		mehrstellen_rhs(e, sa->zstart, sa->zend);
+	pthread_barrier_wait(&e->barrier);
+
+	for (unsigned int iter = e->first; iter < e->numiters; iter++) {
+		e->changes[2 * sa->id + iter % 2] = solve_sweep(e, sa, in, out, iter);
+
+		double *temp = in;
+		in = out;
+		out = temp;
+
+		// Every slab of iterate iter, if wanted, was copied before this
+		// barrier, so one thread hands it to the writer and reuses its slot
+		// for iterate iter + 2.  Nobody reads that slot until the next
+		// barrier, which also publishes the new buffer.
+		if (pthread_barrier_wait(&e->barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+			for (unsigned int j = 0; j < SOLVE_OUTPUTS; j++) {
+				double **slot = &e->out[j].slot[iter % 2];
+				if (*slot)
+					poisson_snapshot_submit(e->out[j].writer, *slot, iter);
+				*slot = output_acquire(&e->out[j], iter + 2, e->numiters);
+			}
+		}
+
+		// Copy-on-swap: iterate iter + 1 is not overwritten until two
+		// sweeps from now, so each thread copies out its own planes and
+		// the copy overlaps the neighbours' next sweep
+		for (unsigned int j = 0; j < SOLVE_OUTPUTS; j++) {
+			double *snap = e->out[j].slot[(iter + 1) % 2];
+			if (snap)
+				memcpy(snap + first, in + first, count * sizeof(double));
+		}
+
+		// The reports for this iteration are not overwritten until after
+		// the next barrier, by which time everyone has read them
+		if (e->tolerance > 0) {
+			double change = 0;
+			for (unsigned int i = iter % 2; i < 2 * e->workers; i += 2)
+				change = e->changes[i] > change ? e->changes[i] : change;
+			if (change <= e->tolerance) {
+				if (sa->id == 0)
+					e->done = iter + 1;
+				break;
+			}
+		}
+	}
+
+	if (in != e->potential)
+		memcpy(e->potential + first, in + first, count * sizeof(double));
+
+	return NULL;
+}
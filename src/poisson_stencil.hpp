@@ -0,0 +1,155 @@
+#ifndef POISSON_STENCIL_H
+#define POISSON_STENCIL_H
+
+#include <stddef.h>
+#include <utility>
+
+#include "poisson_kernel.hpp"
+
+// One term of a stencil: weight times the previous iterate at offset
+// (dx, dy, dz) from the voxel being relaxed
+struct poisson_tap {
+	int dx, dy, dz;
+	double weight;
+};
+
+// A stencil is a type with three constexpr members:
+//
+//   static constexpr poisson_tap taps[]    the terms, summed in this order
+//   static constexpr double source         weight of delta^2 times the source
+//   static constexpr double divisor        what the sum is divided by
+//
+// so that one Jacobi update of a voxel is
+//
+//   out = (sum of weight * in[offset] + source * delta^2 * s) / divisor
+//
+// Taps that fall outside the box read Vbound.  A tap at offset (0, 0, 0)
+// gives damped or smoothing updates, and source 0 a pure filter.
+
+// The 7-point Laplacian of poisson_dirichlet, rounded the same way
+struct poisson_laplace7 {
+	static constexpr poisson_tap taps[] = {
+		{1, 0, 0, 1}, {-1, 0, 0, 1}, {0, 1, 0, 1}, {0, -1, 0, 1}, {0, 0, 1, 1}, {0, 0, -1, 1},
+	};
+	static constexpr double source = -1;
+	static constexpr double divisor = 6;
+};
+
+// 19-point Laplacian, (2 * faces + edges - 24 * centre) / (6 delta^2)
+struct poisson_laplace19 {
+	static constexpr poisson_tap taps[] = {
+		{1, 0, 0, 2}, {-1, 0, 0, 2}, {0, 1, 0, 2}, {0, -1, 0, 2}, {0, 0, 1, 2}, {0, 0, -1, 2},
+		{1, 1, 0, 1}, {-1, 1, 0, 1}, {1, -1, 0, 1}, {-1, -1, 0, 1},
+		{1, 0, 1, 1}, {-1, 0, 1, 1}, {1, 0, -1, 1}, {-1, 0, -1, 1},
+		{0, 1, 1, 1}, {0, -1, 1, 1}, {0, 1, -1, 1}, {0, -1, -1, 1},
+	};
+	static constexpr double source = -6;
+	static constexpr double divisor = 24;
+};
+
+// 27-point Laplacian, (14 * faces + 3 * edges + corners - 128 * centre) / (30 delta^2)
+struct poisson_laplace27 {
+	static constexpr poisson_tap taps[] = {
+		{1, 0, 0, 14}, {-1, 0, 0, 14}, {0, 1, 0, 14}, {0, -1, 0, 14}, {0, 0, 1, 14}, {0, 0, -1, 14},
+		{1, 1, 0, 3}, {-1, 1, 0, 3}, {1, -1, 0, 3}, {-1, -1, 0, 3},
+		{1, 0, 1, 3}, {-1, 0, 1, 3}, {1, 0, -1, 3}, {-1, 0, -1, 3},
+		{0, 1, 1, 3}, {0, -1, 1, 3}, {0, 1, -1, 3}, {0, -1, -1, 3},
+		{1, 1, 1, 1}, {-1, 1, 1, 1}, {1, -1, 1, 1}, {-1, -1, 1, 1},
+		{1, 1, -1, 1}, {-1, 1, -1, 1}, {1, -1, -1, 1}, {-1, -1, -1, 1},
+	};
+	static constexpr double source = -30;
+	static constexpr double divisor = 128;
+};
+
+// Jacobi sweeps with stencil S.  The taps are unrolled at compile time, so
+// each x-row is one loop over the interior, which the compiler vectorises,
+// and a per-tap bounds check only in the few columns within reach of the
+// x faces.  Rows outside the box in y or z are the bound row, as in
+// poisson_sweep.
+template <class S>
+struct poisson_stencil {
+	static constexpr size_t ntaps = sizeof(S::taps) / sizeof(S::taps[0]);
+
+	// Furthest any tap reaches along x
+	static constexpr int reach ()
+	{
+		int r = 0;
+		for (size_t i = 0; i < ntaps; i++) {
+			int d = S::taps[i].dx < 0 ? -S::taps[i].dx : S::taps[i].dx;
+			r = d > r ? d : r;
+		}
+		return r;
+	}
+
+	template <size_t I>
+	static inline double tap (const double *r, int x)
+	{
+		constexpr poisson_tap t = S::taps[I];
+		if constexpr (t.weight == 1)
+			return r[x + t.dx];
+		else
+			return t.weight * r[x + t.dx];
+	}
+
+	template <size_t I>
+	static inline double tap_edge (const double *r, int x, int xs, double vb)
+	{
+		constexpr poisson_tap t = S::taps[I];
+		double v = x + t.dx >= 0 && x + t.dx < xs ? r[x + t.dx] : vb;
+		if constexpr (t.weight == 1)
+			return v;
+		else
+			return t.weight * v;
+	}
+
+	// Relax columns [x0, x1) of one x-row, r[i] being the row tap i reads
+	template <size_t... I>
+	static inline void relax_row (const double *const r[], const double *__restrict__ s,
+	                              double *__restrict__ o, int xs, int x0, int x1,
+	                              double vb, double ws, std::index_sequence<I...>)
+	{
+		constexpr int R = reach();
+		const int lo = R < x0 ? x0 : R > x1 ? x1 : R;
+		const int hi = xs - R < lo ? lo : xs - R > x1 ? x1 : xs - R;
+		const double *const rr[] = {r[I]...};
+
+		for (int x = x0; x < lo; x++)
+			o[x] = ((... + tap_edge<I>(rr[I], x, xs, vb)) + ws * s[x]) / S::divisor;
+		for (int x = lo; x < hi; x++)
+			o[x] = ((... + tap<I>(rr[I], x)) + ws * s[x]) / S::divisor;
+		for (int x = hi; x < x1; x++)
+			o[x] = ((... + tap_edge<I>(rr[I], x, xs, vb)) + ws * s[x]) / S::divisor;
+	}
+
+	/// Relax the box [x0, x1) x [y0, y1) x [z0, z1) for one Jacobi
+	/// iteration, like poisson_sweep, whose signature it shares so that it
+	/// can be handed to poisson_solve as poisson_options::sweep
+	static void sweep (const struct poisson_grid *g,
+	                   const double *__restrict__ in, double *__restrict__ out,
+	                   unsigned int x0, unsigned int x1,
+	                   unsigned int y0, unsigned int y1,
+	                   unsigned int z0, unsigned int z1)
+	{
+		const unsigned int xs = g->xsize;
+		const unsigned int ys = g->ysize;
+		const unsigned int zs = g->zsize;
+		const double ws = S::source * (g->delta * g->delta);
+		const double *r[ntaps];
+
+		for (unsigned int z = z0; z < z1; z++) {
+			for (unsigned int y = y0; y < y1; y++) {
+				for (size_t i = 0; i < ntaps; i++) {
+					long ty = (long)y + S::taps[i].dy;
+					long tz = (long)z + S::taps[i].dz;
+					r[i] = ty >= 0 && ty < ys && tz >= 0 && tz < zs
+						 ? in + ((size_t)tz * ys + ty) * xs : g->bound;
+				}
+				size_t row = ((size_t)z * ys + y) * xs;
+				relax_row(r, g->source + row, out + row, xs, x0, x1, g->Vbound, ws,
+						  std::make_index_sequence<ntaps>());
+			}
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,288 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "poisson.hpp"
+#include "poisson_kernel.hpp"
+
+// structure we're going to use for arguments to our symmetry check threads
+struct check_args {
+	const double *source;
+	unsigned int xsize, ysize, zsize;
+	unsigned int zstart;
+	unsigned int zend;
+	unsigned int *mirrors;			// cleared bit by bit as asymmetries turn up
+	pthread_t thread;
+};
+
+// State shared by the workers of one reduced solve.  Along each mirrored
+// axis only the first half is kept, plus one ghost layer holding the mirror
+// image of its neighbour so the sweep kernel sees a reflective face.
+struct sym_engine {
+	struct poisson_grid grid;		// the reduced box, ghost layers included
+	double *potential;
+	double *scratch;
+	unsigned int half[3];			// layers swept along x, y and z
+	unsigned int ghost[3];			// layer copied into the ghost, if mirrored
+	unsigned int mirrors;
+	unsigned int numiters;
+	pthread_barrier_t barrier;
+};
+
+// structure we're going to use for arguments to our reduced solve threads
+struct sym_args {
+	struct sym_engine *e;
+	unsigned int zstart;
+	unsigned int zend;
+	pthread_t thread;
+};
+
+static void *check_thread(void *args);
+static void *sym_thread(void *args);
+
+// Index of the voxel that mirrors i across the middle of [0, size)
+static inline unsigned int mirror(unsigned int i, unsigned int size)
+{
+	return size - 1 - i;
+}
+
+// The voxel of the reduced box holding voxel i of the full one
+static inline unsigned int fold(unsigned int i, unsigned int size, unsigned int half)
+{
+	return i < half ? i : mirror(i, size);
+}
+
+/// Find the mirror planes, through the middle of the box, that the source
+/// is symmetric under.  Values must match exactly.  With a uniform Vbound
+/// the box is symmetric under all three, so these are the symmetries of
+/// the whole problem.  Axes one voxel thick are never reported.
+/// \param source is a flattened 3-D array, ordered as for poisson_dirichlet
+/// \param numcores is the number of threads to check with.  If 0, one per core
+/// \return a mask of POISSON_MIRROR_X, POISSON_MIRROR_Y and POISSON_MIRROR_Z
+unsigned int poisson_symmetry (const double *source,
+                               unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                               unsigned int numcores)
+{
+	if (numcores == 0)
+		numcores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (numcores > zsize)
+		numcores = zsize;
+
+	unsigned int mirrors = (xsize > 1 ? POISSON_MIRROR_X : 0)
+						 | (ysize > 1 ? POISSON_MIRROR_Y : 0)
+						 | (zsize > 1 ? POISSON_MIRROR_Z : 0);
+
+	struct check_args ca[numcores];
+	for (unsigned int i = 0; i < numcores; i++) {
+		ca[i].source 	= source;
+		ca[i].xsize 	= xsize;
+		ca[i].ysize 	= ysize;
+		ca[i].zsize 	= zsize;
+		ca[i].zstart 	= (unsigned int)((size_t)zsize * i / numcores);
+		ca[i].zend 		= (unsigned int)((size_t)zsize * (i + 1) / numcores);
+		ca[i].mirrors 	= &mirrors;
+		if (pthread_create(&ca[i].thread, NULL, check_thread, (void *)&ca[i]) != 0) {
+			fprintf(stderr, "Could not create thread %d\n", i);
+		}
+	}
+	for (unsigned int i = 0; i < numcores; i++) {
+		pthread_join(ca[i].thread, NULL);
+	}
+	return mirrors;
+}
+
+
+static void *check_thread(void *args)
+{
+	struct check_args *ca = (struct check_args *)args;
+	const unsigned int xs = ca->xsize;
+	const unsigned int ys = ca->ysize;
+	const size_t plane = (size_t)xs * ys;
+
+	// Each pair is seen twice, once from each side, which keeps the slabs
+	// independent.  Stop once every mirror has been ruled out.
+	unsigned int found = __atomic_load_n(ca->mirrors, __ATOMIC_RELAXED);
+	for (unsigned int z = ca->zstart; z < ca->zend && found; z++) {
+		const double *p = ca->source + z * plane;
+		const double *pz = ca->source + mirror(z, ca->zsize) * plane;
+		for (unsigned int y = 0; y < ys; y++) {
+			const double *r = p + (size_t)y * xs;
+			const double *ry = p + (size_t)mirror(y, ys) * xs;
+			const double *rz = pz + (size_t)y * xs;
+			unsigned int bad = 0;
+			for (unsigned int x = 0; x < xs; x++) {
+				if (r[x] != r[mirror(x, xs)])
+					bad |= POISSON_MIRROR_X;
+				if (r[x] != ry[x])
+					bad |= POISSON_MIRROR_Y;
+				if (r[x] != rz[x])
+					bad |= POISSON_MIRROR_Z;
+			}
+			if (bad)
+				found = __atomic_and_fetch(ca->mirrors, ~bad, __ATOMIC_RELAXED);
+		}
+	}
+	return NULL;
+}
+
+
+/// Solve Poisson's equation like poisson_dirichlet, using the mirror
+/// symmetries of the source found by poisson_symmetry to relax only the
+/// fundamental sub-domain: half the box along each mirrored axis, up to an
+/// eighth of it in all.  The middle plane is a reflective face, stood in
+/// for by a ghost layer refreshed from its mirror image after each sweep.
+/// The result is expanded back into the whole of potential.  It matches
+/// poisson_dirichlet to rounding, as the full solve only keeps its
+/// symmetry to rounding.
+/// \param source is a pointer to a flattened 3-D array for the source function
+/// \param potential is a pointer to a flattened 3-D array for the calculated potential
+/// \param Vbound is the potential on the boundary
+/// \param numiters is the number of iterations to perform
+/// \param numcores is the number of CPU cores to use.  If 0, an optimal number is chosen
+/// \return the mirrors used, as for poisson_symmetry
+unsigned int poisson_dirichlet_symmetric (double *__restrict__ source,
+                                          double *__restrict__ potential,
+                                          double Vbound,
+                                          unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                                          double delta, unsigned int numiters, unsigned int numcores)
+{
+	if (numcores == 0)
+		numcores = sysconf(_SC_NPROCESSORS_ONLN);
+
+	const unsigned int size[3] = {xsize, ysize, zsize};
+	const unsigned int bits[3] = {POISSON_MIRROR_X, POISSON_MIRROR_Y, POISSON_MIRROR_Z};
+	const unsigned int mirrors = poisson_symmetry(source, xsize, ysize, zsize, numcores);
+
+	// The ghost is the layer just past the half, and in the full box that
+	// layer already holds the mirror image, so the reduced box is simply a
+	// corner of the full one
+	struct sym_engine e;
+	unsigned int dims[3];
+	for (unsigned int a = 0; a < 3; a++) {
+		if (mirrors & bits[a]) {
+			e.half[a] = (size[a] + 1) / 2;
+			e.ghost[a] = mirror(e.half[a], size[a]);
+			dims[a] = e.half[a] + 1;
+		} else {
+			e.half[a] = size[a];
+			e.ghost[a] = 0;
+			dims[a] = size[a];
+		}
+	}
+
+	const size_t count = (size_t)dims[0] * dims[1] * dims[2];
+	double *reduced = (double *)malloc(count * sizeof(double));
+	double *first = (double *)malloc(count * sizeof(double));
+	double *scratch = (double *)malloc(count * sizeof(double));
+	double *bound = poisson_bound_row(dims[0], Vbound);
+	if (!reduced || !first || !scratch || !bound) {
+		fprintf(stderr, "malloc failure\n");
+		free(reduced);
+		free(first);
+		free(scratch);
+		free(bound);
+		return 0;
+	}
+	for (unsigned int z = 0; z < dims[2]; z++) {
+		for (unsigned int y = 0; y < dims[1]; y++) {
+			memcpy(reduced + ((size_t)z * dims[1] + y) * dims[0],
+				   source + ((size_t)z * ysize + y) * xsize, dims[0] * sizeof(double));
+		}
+	}
+	// The source is also the first iterate
+	memcpy(first, reduced, count * sizeof(double));
+
+	e.grid.source = reduced;
+	e.grid.bound = bound;
+	e.grid.Vbound = Vbound;
+	e.grid.delta = delta;
+	e.grid.xsize = dims[0];
+	e.grid.ysize = dims[1];
+	e.grid.zsize = dims[2];
+	e.potential = first;
+	e.scratch = scratch;
+	e.mirrors = mirrors;
+	e.numiters = numiters;
+
+	if (numcores > e.half[2])
+		numcores = e.half[2];
+	pthread_barrier_init(&e.barrier, NULL, numcores);
+	struct sym_args sa[numcores];
+	for (unsigned int i = 0; i < numcores; i++) {
+		sa[i].e 		= &e;
+		sa[i].zstart 	= (unsigned int)((size_t)e.half[2] * i / numcores);
+		sa[i].zend 		= (unsigned int)((size_t)e.half[2] * (i + 1) / numcores);
+		if (pthread_create(&sa[i].thread, NULL, sym_thread, (void *)&sa[i]) != 0) {
+			fprintf(stderr, "Could not create thread %d\n", i);
+		}
+	}
+	for (unsigned int i = 0; i < numcores; i++) {
+		pthread_join(sa[i].thread, NULL);
+	}
+	pthread_barrier_destroy(&e.barrier);
+
+	// Unfold the last iterate into the whole box
+	const double *result = numiters % 2 == 0 ? first : scratch;
+	for (unsigned int z = 0; z < zsize; z++) {
+		unsigned int rz = fold(z, zsize, e.half[2]);
+		for (unsigned int y = 0; y < ysize; y++) {
+			unsigned int ry = fold(y, ysize, e.half[1]);
+			const double *in = result + ((size_t)rz * dims[1] + ry) * dims[0];
+			double *out = potential + ((size_t)z * ysize + y) * xsize;
+			for (unsigned int x = 0; x < xsize; x++)
+				out[x] = in[fold(x, xsize, e.half[0])];
+		}
+	}
+
+	free(reduced);
+	free(first);
+	free(scratch);
+	free(bound);
+	return mirrors;
+}
+
+
+// Relax the swept part of plane z and refresh its ghosts
+static void sym_sweep(const struct sym_engine *e, const double *in, double *out, unsigned int z)
+{
+	const struct poisson_grid *g = &e->grid;
+	const size_t plane = (size_t)g->xsize * g->ysize;
+	double *p = out + z * plane;
+
+	poisson_sweep(g, in, out, 0, e->half[0], 0, e->half[1], z, z + 1);
+	if (e->mirrors & POISSON_MIRROR_X) {
+		for (unsigned int y = 0; y < e->half[1]; y++) {
+			double *row = p + (size_t)y * g->xsize;
+			row[e->half[0]] = row[e->ghost[0]];
+		}
+	}
+	if (e->mirrors & POISSON_MIRROR_Y)
+		memcpy(p + (size_t)e->half[1] * g->xsize, p + (size_t)e->ghost[1] * g->xsize,
+			   g->xsize * sizeof(double));
+	// The ghost plane belongs to whoever sweeps its mirror image, and is
+	// only read after the barrier
+	if ((e->mirrors & POISSON_MIRROR_Z) && z == e->ghost[2])
+		memcpy(out + e->half[2] * plane, p, plane * sizeof(double));
+}
+
+
+static void *sym_thread(void *args)
+{
+	struct sym_args *sa = (struct sym_args *)args;
+	struct sym_engine *e = sa->e;
+	double *in = e->potential;
+	double *out = e->scratch;
+
+	for (unsigned int iter = 0; iter < e->numiters; iter++) {
+		for (unsigned int z = sa->zstart; z < sa->zend; z++)
+			sym_sweep(e, in, out, z);
+
+		double *temp = in;
+		in = out;
+		out = temp;
+		pthread_barrier_wait(&e->barrier);
+	}
+	return NULL;
+}
@@ -3,12 +3,1148 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <time.h>
+#include <unistd.h>
 
-extern void poisson_dirichlet (double *__restrict__ source,
-                        double *__restrict__ potential,
-                        double Vbound,
-                        unsigned int xsize, unsigned int ysize, unsigned int zsize,
-                        double delta, unsigned int maxiters, unsigned int numcores);
+#include "poisson.hpp"
+#include "poisson_stencil.hpp"
+
+static double now (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double max_diff (const double *a, const double *b, size_t count)
+{
+    double diff = 0;
+    for (size_t i = 0; i < count; i++)
+        diff = fmax(diff, fabs(a[i] - b[i]));
+    return diff;
+}
+
+// How far from the fixed point a Jacobi solve on an N^3 box can stop when
+// no voxel changed by more than tolerance in the last sweep: the slowest
+// mode decays by cos(pi / (N + 1)) per sweep, so the remaining error is
+// about tolerance / (1 - cos(pi / (N + 1)))
+static double jacobi_bound (unsigned int N, double tolerance)
+{
+    return tolerance / (1 - cos(M_PI / (N + 1)));
+}
+
+// Solve nrhs point-charge problems with the batched solver and check
+// each against poisson_dirichlet
+static int test_batch (unsigned int N, unsigned int numiters, unsigned int numcores,
+                       unsigned int nrhs)
+{
+    size_t count = (size_t)N * N * N;
+    double *sources[nrhs];
+    double *potentials[nrhs];
+    double *reference = (double *)calloc(count, sizeof(double));
+
+    for (unsigned int m = 0; m < nrhs; m++) {
+        sources[m] = (double *)calloc(count, sizeof(double));
+        potentials[m] = (double *)calloc(count, sizeof(double));
+        sources[m][((N / 2 * N) + N / 2) * N + (m * N) / nrhs] = 1.0;
+    }
+
+    double start = now();
+    poisson_dirichlet_batch(sources, potentials, nrhs, 1, N, N, N, 0.1,
+                            numiters, numcores);
+    double batched = now() - start;
+
+    double diff = 0;
+    start = now();
+    for (unsigned int m = 0; m < nrhs; m++) {
+        poisson_dirichlet(sources[m], reference, 1, N, N, N, 0.1,
+                          numiters, numcores);
+        diff = fmax(diff, max_diff(reference, potentials[m], count));
+    }
+    double single = now() - start;
+
+    printf("Batch of %u: %f s, one at a time: %f s, max diff: %g\n",
+           nrhs, batched, single, diff);
+
+    for (unsigned int m = 0; m < nrhs; m++) {
+        free(sources[m]);
+        free(potentials[m]);
+    }
+    free(reference);
+    return diff > 1e-9;
+}
+
+// Solve a mix of small and large problems on the scheduler and check
+// each against poisson_dirichlet run one after another
+static int test_sched (unsigned int N, unsigned int numiters, unsigned int numcores,
+                       unsigned int numjobs)
+{
+    struct poisson_job jobs[numjobs];
+
+    for (unsigned int j = 0; j < numjobs; j++) {
+        // Every fourth job is full size, the rest are small
+        unsigned int n = j % 4 == 0 ? N : 8 + (N - 8) * j / (4 * numjobs);
+        size_t count = (size_t)n * n * n;
+        jobs[j].source = (double *)calloc(count, sizeof(double));
+        jobs[j].potential = (double *)calloc(count, sizeof(double));
+        jobs[j].Vbound = 1;
+        jobs[j].xsize = jobs[j].ysize = jobs[j].zsize = n;
+        jobs[j].delta = 0.1;
+        jobs[j].numiters = numiters;
+        jobs[j].source[((n / 2 * n) + n / 2) * n + n / 2] = 1.0;
+    }
+
+    double start = now();
+    struct poisson_scheduler *s = poisson_scheduler_create(numcores);
+    if (!s)
+        return 1;
+    for (unsigned int j = 0; j < numjobs; j++)
+        poisson_scheduler_submit(s, &jobs[j]);
+    poisson_scheduler_wait(s);
+    poisson_scheduler_destroy(s);
+    double scheduled = now() - start;
+
+    double diff = 0;
+    double sequential = 0;
+    for (unsigned int j = 0; j < numjobs; j++) {
+        size_t count = (size_t)jobs[j].xsize * jobs[j].ysize * jobs[j].zsize;
+        double *reference = (double *)calloc(count, sizeof(double));
+        start = now();
+        poisson_dirichlet(jobs[j].source, reference, jobs[j].Vbound,
+                          jobs[j].xsize, jobs[j].ysize, jobs[j].zsize,
+                          jobs[j].delta, numiters, numcores);
+        sequential += now() - start;
+        diff = fmax(diff, max_diff(reference, jobs[j].potential, count));
+        free(reference);
+        free(jobs[j].source);
+        free(jobs[j].potential);
+    }
+
+    printf("%u jobs scheduled: %f s, one at a time: %f s, max diff: %g\n",
+           numjobs, scheduled, sequential, diff);
+    return diff > 1e-9;
+}
+
+// Compare the tiled work-stealing solver against poisson_dirichlet
+static int test_tiled (unsigned int N, unsigned int numiters, unsigned int numcores)
+{
+    size_t count = (size_t)N * N * N;
+    double *source = (double *)calloc(count, sizeof(double));
+    double *potential = (double *)calloc(count, sizeof(double));
+    double *reference = (double *)calloc(count, sizeof(double));
+
+    source[((N / 2 * N) + N / 2) * N + N / 2] = 1.0;
+
+    double start = now();
+    poisson_dirichlet_tiled(source, potential, 1, N, N, N, 0.1, numiters, numcores);
+    double tiled = now() - start;
+
+    start = now();
+    poisson_dirichlet(source, reference, 1, N, N, N, 0.1, numiters, numcores);
+    double slabs = now() - start;
+
+    double diff = max_diff(reference, potential, count);
+    printf("Tiled: %f s, z-slabs: %f s, max diff: %g\n", tiled, slabs, diff);
+
+    free(source);
+    free(potential);
+    free(reference);
+    return diff > 1e-9;
+}
+
+// Compare asynchronous relaxation to tolerance against numiters
+// synchronous iterations.  Choose numiters so that the synchronous
+// solve has converged.
+static int test_async (unsigned int N, unsigned int numiters, unsigned int numcores,
+                       double tolerance)
+{
+    size_t count = (size_t)N * N * N;
+    double *source = (double *)calloc(count, sizeof(double));
+    double *potential = (double *)calloc(count, sizeof(double));
+    double *reference = (double *)calloc(count, sizeof(double));
+
+    source[((N / 2 * N) + N / 2) * N + N / 2] = 1.0;
+
+    int converged;
+    double start = now();
+    unsigned int sweeps = poisson_dirichlet_async(source, potential, 1, N, N, N, 0.1,
+                                                  numiters, tolerance, numcores, &converged);
+    double async = now() - start;
+
+    start = now();
+    poisson_dirichlet(source, reference, 1, N, N, N, 0.1, numiters, numcores);
+    double sync = now() - start;
+
+    double diff = max_diff(reference, potential, count);
+    printf("Async: %u sweeps %f s, %s, synchronous: %u iterations %f s, max diff: %g\n",
+           sweeps, async, converged ? "converged" : "maxiters reached first", numiters, sync, diff);
+
+    free(source);
+    free(potential);
+    free(reference);
+    return !converged || diff > 1e-6;
+}
+
+// Compare the block-decomposed solver against poisson_dirichlet, here
+// forced onto z-slabs by solving one core at a time
+static int test_blocks (unsigned int N, unsigned int numiters, unsigned int numcores)
+{
+    size_t count = (size_t)N * N * N;
+    double *source = (double *)calloc(count, sizeof(double));
+    double *potential = (double *)calloc(count, sizeof(double));
+    double *reference = (double *)calloc(count, sizeof(double));
+    struct poisson_block blocks[numcores];
+    unsigned int dims[3];
+
+    source[((N / 2 * N) + N / 2) * N + N / 2] = 1.0;
+
+    unsigned int n = poisson_decompose(numcores, N, N, N, dims, blocks);
+
+    double start = now();
+    poisson_dirichlet_blocks(source, potential, 1, N, N, N, 0.1, numiters, numcores);
+    double blocked = now() - start;
+
+    start = now();
+    poisson_dirichlet(source, reference, 1, N, N, N, 0.1, numiters, 1);
+    double single = now() - start;
+
+    double diff = max_diff(reference, potential, count);
+    printf("%u blocks (%u x %u x %u): %f s, one core: %f s, max diff: %g\n",
+           n, dims[0], dims[1], dims[2], blocked, single, diff);
+
+    free(source);
+    free(potential);
+    free(reference);
+    return diff > 1e-9;
+}
+
+// Solve out of core through files in the current directory and compare
+// against poisson_dirichlet in memory
+static int test_ooc (unsigned int N, unsigned int numiters, unsigned int numcores,
+                     unsigned int depth)
+{
+    size_t count = (size_t)N * N * N;
+    double *source = (double *)calloc(count, sizeof(double));
+    double *reference = (double *)calloc(count, sizeof(double));
+
+    source[((N / 2 * N) + N / 2) * N + N / 2] = 1.0;
+
+    FILE *fp = fopen("ooc_source.raw", "wb");
+    if (!fp || fwrite(source, sizeof(double), count, fp) != count) {
+        fprintf(stderr, "Could not write ooc_source.raw\n");
+        if (fp)
+            fclose(fp);
+        free(source);
+        free(reference);
+        return 1;
+    }
+    fclose(fp);
+
+    double start = now();
+    int status = poisson_dirichlet_ooc("ooc_source.raw", "ooc_potential.raw", 1, N, N, N, 0.1,
+                                       numiters, depth, numcores);
+    double streamed = now() - start;
+
+    start = now();
+    poisson_dirichlet(source, reference, 1, N, N, N, 0.1, numiters, numcores);
+    double inmemory = now() - start;
+
+    double *potential = (double *)calloc(count, sizeof(double));
+    fp = status == 0 ? fopen("ooc_potential.raw", "rb") : NULL;
+    int read = fp && fread(potential, sizeof(double), count, fp) == count;
+    if (fp)
+        fclose(fp);
+    remove("ooc_source.raw");
+    remove("ooc_potential.raw");
+    if (!read) {
+        fprintf(stderr, "Could not read ooc_potential.raw\n");
+        free(source);
+        free(potential);
+        free(reference);
+        return 1;
+    }
+
+    double diff = max_diff(reference, potential, count);
+    printf("Out of core, %u iterations per pass: %f s, in memory: %f s, max diff: %g\n",
+           depth, streamed, inmemory, diff);
+
+    free(source);
+    free(potential);
+    free(reference);
+    return diff > 1e-9;
+}
+
+// Solve for a source loaded from a grid file and write the potential to
+// another.  A point-charge source file is created first if there is none.
+static int test_file (unsigned int N, unsigned int numiters, unsigned int numcores,
+                      const char *source_path, const char *potential_path)
+{
+    struct poisson_grid_header h;
+
+    if (access(source_path, F_OK) != 0) {
+        double *charge = (double *)calloc((size_t)N * N * N, sizeof(double));
+        charge[((N / 2 * N) + N / 2) * N + N / 2] = 1.0;
+        int status = poisson_grid_write(source_path, charge, N, N, N, 0.1, 1, numcores);
+        free(charge);
+        if (status != 0)
+            return 1;
+    }
+
+    double start = now();
+    const double *source = (const double *)poisson_grid_map(source_path, &h, 1, numcores);
+    if (!source || h.dtype != POISSON_GRID_F64) {
+        fprintf(stderr, "%s: need a grid of doubles\n", source_path);
+        return 1;
+    }
+    double loaded = now() - start;
+
+    size_t count = (size_t)h.xsize * h.ysize * h.zsize;
+    double *potential = (double *)calloc(count, sizeof(double));
+    poisson_dirichlet((double *)source, potential, h.Vbound, h.xsize, h.ysize, h.zsize,
+                      h.delta, numiters, numcores);
+
+    start = now();
+    int status = poisson_grid_write(potential_path, potential, h.xsize, h.ysize, h.zsize,
+                                    h.delta, h.Vbound, numcores);
+    double written = now() - start;
+
+    struct poisson_grid_header check;
+    const double *result = (const double *)poisson_grid_map(potential_path, &check, 1, numcores);
+    double diff = result ? max_diff(potential, result, count) : INFINITY;
+    printf("Loaded %u x %u x %u source: %f s, wrote potential: %f s, max diff on reload: %g\n",
+           h.xsize, h.ysize, h.zsize, loaded, written, diff);
+
+    poisson_grid_unmap(result, &check);
+
+    // Headers whose data would overlap the header, be misaligned or wrap
+    // past the end of the address space must be rejected
+    const uint64_t offsets[] = {0, POISSON_GRID_ALIGN - sizeof(double), (uint64_t)0 - POISSON_GRID_ALIGN};
+    int rejected = 1;
+    for (unsigned int i = 0; i < 3 && result; i++) {
+        struct poisson_grid_header bad = check;
+        bad.data_offset = offsets[i];
+        FILE *fp = fopen(potential_path, "r+b");
+        if (!fp || fwrite(&bad, sizeof(bad), 1, fp) != 1) {
+            if (fp)
+                fclose(fp);
+            rejected = 0;
+            break;
+        }
+        fclose(fp);
+        const void *map = poisson_grid_map(potential_path, &bad, 0, numcores);
+        if (map) {
+            poisson_grid_unmap(map, &bad);
+            printf("Header with data offset %llu accepted\n", (unsigned long long)offsets[i]);
+            rejected = 0;
+        }
+    }
+    FILE *fp = result ? fopen(potential_path, "r+b") : NULL;
+    if (fp) {
+        fwrite(&check, sizeof(check), 1, fp);
+        fclose(fp);
+    }
+
+    poisson_grid_unmap(source, &h);
+    free(potential);
+    return status != 0 || diff != 0 || !rejected;
+}
+
+static int test_snap (unsigned int N, unsigned int numiters, unsigned int numcores,
+                      unsigned int every, const char *policy)
+{
+    size_t count = (size_t)N * N * N;
+    double *source = (double *)calloc(count, sizeof(double));
+    double *plain = (double *)calloc(count, sizeof(double));
+    double *snapped = (double *)calloc(count, sizeof(double));
+    double *expect = (double *)calloc(count, sizeof(double));
+    source[((N / 2 * N) + N / 2) * N + N / 2] = 1.0;
+
+    int p = POISSON_SNAPSHOT_BLOCK;
+    if (strcmp(policy, "newest") == 0)
+        p = POISSON_SNAPSHOT_DROP_NEWEST;
+    else if (strcmp(policy, "oldest") == 0)
+        p = POISSON_SNAPSHOT_DROP_OLDEST;
+
+    double start = now();
+    poisson_solve(source, plain, 0, N, N, N, 0.1, numiters, numcores, NULL);
+    double t_plain = now() - start;
+
+    struct poisson_options opts;
+    poisson_options_init(&opts);
+    opts.snapshots = poisson_snapshot_create("snap_", N, N, N, 0.1, 0, 2, p);
+    opts.snapshot_every = every;
+    start = now();
+    poisson_solve(source, snapped, 0, N, N, N, 0.1, numiters, numcores, &opts);
+    double t_snap = now() - start;
+    unsigned int written, dropped;
+    int status = poisson_snapshot_destroy(opts.snapshots, &written, &dropped);
+    double t_drain = now() - start;
+
+    // With back-pressure nothing is dropped, so the last snapshot is there
+    // to check against a fresh solve of that many iterations
+    double diff = max_diff(plain, snapped, count);
+    unsigned int last = every ? numiters / every * every : 0;
+    if (p == POISSON_SNAPSHOT_BLOCK && last > 0) {
+        char path[32];
+        struct poisson_grid_header h;
+        snprintf(path, sizeof(path), "snap_%06u.pgrid", last);
+        poisson_dirichlet(source, expect, 0, N, N, N, 0.1, last, numcores);
+        const double *result = (const double *)poisson_grid_map(path, &h, 1, numcores);
+        double d = result ? max_diff(expect, result, count) : INFINITY;
+        diff = d > diff ? d : diff;
+        poisson_grid_unmap(result, &h);
+    }
+
+    printf("Snapshots every %u iterations (%s): solve %f s, with snapshots %f s (%f s to drain),"
+           " %u written, %u dropped, max diff: %g\n",
+           every, policy, t_plain, t_snap, t_drain, written, dropped, diff);
+
+    free(expect);
+    free(snapped);
+    free(plain);
+    free(source);
+    return status != 0 || diff > 1e-12;
+}
+
+// Compress a potential and check the error bound, the round trip through
+// a grid file, that damaged streams are rejected and, if min_ratio is
+// given, the compression ratio
+static int test_zip (unsigned int N, unsigned int numiters, unsigned int numcores, double tolerance,
+                     double min_ratio)
+{
+    size_t count = (size_t)N * N * N;
+    double *source = (double *)calloc(count, sizeof(double));
+    double *potential = (double *)calloc(count, sizeof(double));
+    double *restored = (double *)calloc(count, sizeof(double));
+    source[((N / 2 * N) + N / 2) * N + N / 2] = 1.0;
+    poisson_dirichlet(source, potential, 1, N, N, N, 0.1, numiters, numcores);
+
+    unsigned char *stream;
+    double start = now();
+    size_t bytes = poisson_compress(potential, N, N, N, tolerance, &stream, numcores);
+    double t_comp = now() - start;
+    start = now();
+    int status = bytes ? poisson_decompress(stream, bytes, restored, N, N, N, numcores) : -1;
+    double t_decomp = now() - start;
+    double diff = status == 0 ? max_diff(potential, restored, count) : INFINITY;
+
+    // The same through a grid file, which records the iteration
+    struct poisson_grid_header h;
+    double *reread = NULL;
+    if (poisson_grid_write_compressed("potential.pzgrid", potential, N, N, N, 0.1, 1, numiters,
+                                      tolerance, numcores) == 0)
+        reread = poisson_grid_read("potential.pzgrid", &h, numcores);
+    double file_diff = reread && h.iteration == numiters ? max_diff(restored, reread, count) : INFINITY;
+
+    // A stream missing its last byte, or with one too many, must be refused
+    int rejected = 1;
+    if (bytes) {
+        unsigned char *longer = (unsigned char *)malloc(bytes + 1);
+        memcpy(longer, stream, bytes);
+        longer[bytes] = 0;
+        rejected = poisson_decompress(stream, bytes - 1, restored, N, N, N, numcores) != 0
+                && poisson_decompress(longer, bytes + 1, restored, N, N, N, numcores) != 0;
+        free(longer);
+    }
+    double ratio = bytes ? (double)(count * sizeof(double)) / bytes : 0.0;
+
+    printf("Compressed to %g: %zu -> %zu bytes (%.1fx), %f s, decompressed %f s,"
+           " max error: %g, file max diff: %g\n",
+           tolerance, count * sizeof(double), bytes, ratio, t_comp, t_decomp, diff, file_diff);
+    if (!rejected)
+        printf("Damaged stream accepted\n");
+    if (ratio < min_ratio)
+        printf("Ratio below %.1fx\n", min_ratio);
+
+    free(reread);
+    free(stream);
+    free(restored);
+    free(potential);
+    free(source);
+    return status != 0 || diff > tolerance || file_diff != 0 || !rejected || ratio < min_ratio;
+}
+
+static int test_text (unsigned int N, unsigned int numiters, unsigned int numcores,
+                      int precision, int sparse)
+{
+    size_t count = (size_t)N * N * N;
+    double *source = (double *)calloc(count, sizeof(double));
+    double *potential = (double *)calloc(count, sizeof(double));
+    source[((N / 2 * N) + N / 2) * N + N / 2] = 1.0;
+    poisson_dirichlet(source, potential, 0, N, N, N, 0.1, numiters, numcores);
+
+    double start = now();
+    int status = poisson_export_text("potential.txt", potential, N, N, N, 0, precision, sparse, numcores);
+    double t_text = now() - start;
+
+    // The old per-voxel dump, for comparison
+    start = now();
+    FILE *ptr = fopen("potential_fprintf.txt", "w");
+    for (unsigned int z = 0; z < N; z++) {
+        for (unsigned int y = 0; y < N; y++) {
+            for (unsigned int x = 0; x < N; x++) {
+                double v = potential[((z * N) + y) * N + x];
+                if (sparse && v == 0)
+                    continue;
+                if (precision < 0)
+                    fprintf(ptr, "x: %d | y: %d | z: %d - %.17g\n", x, y, z, v);
+                else
+                    fprintf(ptr, "x: %d | y: %d | z: %d - %.*f\n", x, y, z, precision, v);
+            }
+        }
+    }
+    fclose(ptr);
+    double t_fprintf = now() - start;
+
+    // With a fixed precision the two must match byte for byte
+    int same = -1;
+    if (precision >= 0) {
+        FILE *a = fopen("potential.txt", "r");
+        FILE *b = fopen("potential_fprintf.txt", "r");
+        int ca, cb;
+        do {
+            ca = getc(a);
+            cb = getc(b);
+        } while (ca == cb && ca != EOF);
+        same = ca == cb;
+        fclose(a);
+        fclose(b);
+    }
+
+    printf("Text export (precision %d%s): to_chars %f s, fprintf %f s, %s\n",
+           precision, sparse ? ", sparse" : "", t_text, t_fprintf,
+           same < 0 ? "not compared" : same ? "identical" : "DIFFERENT");
+
+    free(potential);
+    free(source);
+    return status != 0 || same == 0;
+}
+
+static int test_ckpt (unsigned int N, unsigned int numiters, unsigned int numcores, unsigned int every)
+{
+    size_t count = (size_t)N * N * N;
+    double *source = (double *)calloc(count, sizeof(double));
+    double *whole = (double *)calloc(count, sizeof(double));
+    double *resumed = (double *)calloc(count, sizeof(double));
+    source[((N / 2 * N) + N / 2) * N + N / 2] = 1.0;
+    unlink("solve.ckpt");
+
+    double start = now();
+    poisson_solve(source, whole, 1, N, N, N, 0.1, numiters, numcores, NULL);
+    double t_plain = now() - start;
+
+    // Checkpoint a run that is cut off half way through
+    struct poisson_options opts;
+    poisson_options_init(&opts);
+    opts.checkpoints = poisson_checkpoint_create("solve.ckpt", N, N, N, 0.1, 1);
+    opts.checkpoint_every = every;
+    opts.resume = "solve.ckpt";
+    start = now();
+    poisson_solve(source, resumed, 1, N, N, N, 0.1, numiters / 2, numcores, &opts);
+    double t_ckpt = now() - start;
+    int status = poisson_snapshot_destroy(opts.checkpoints, NULL, NULL);
+
+    // and resume it to the end
+    struct poisson_grid_header h;
+    const void *ckpt = access("solve.ckpt", F_OK) == 0 ? poisson_grid_map("solve.ckpt", &h, 0, numcores) : NULL;
+    unsigned int from = ckpt ? h.iteration : 0;
+    poisson_grid_unmap(ckpt, &h);
+    opts.checkpoints = poisson_checkpoint_create("solve.ckpt", N, N, N, 0.1, 1);
+    // Lossy checkpoints would break the bit-identical resume
+    int refused = opts.checkpoints && poisson_snapshot_compress(opts.checkpoints, 1e-6, 1) != 0;
+    start = now();
+    unsigned int done = poisson_solve(source, resumed, 1, N, N, N, 0.1, numiters, numcores, &opts);
+    double t_resume = now() - start;
+    status |= poisson_snapshot_destroy(opts.checkpoints, NULL, NULL);
+
+    int same = done == numiters && memcmp(whole, resumed, count * sizeof(double)) == 0;
+    printf("Checkpoint every %u: solve %f s, first half with checkpoints %f s,"
+           " resumed from %u in %f s, %s\n",
+           every, t_plain, t_ckpt, from, t_resume, same ? "bit-identical" : "DIFFERENT");
+
+    free(resumed);
+    free(whole);
+    free(source);
+    return status != 0 || !same || !refused;
+}
+
+static int test_warm (unsigned int N, unsigned int numiters, unsigned int numcores, double tolerance)
+{
+    size_t count = (size_t)N * N * N;
+    size_t centre = ((N / 2 * N) + N / 2) * N + N / 2;
+    double *source = (double *)calloc(count, sizeof(double));
+    double *cold = (double *)calloc(count, sizeof(double));
+    double *warm = (double *)calloc(count, sizeof(double));
+
+    struct poisson_options opts;
+    poisson_options_init(&opts);
+    opts.tolerance = tolerance;
+
+    source[centre] = 1.0;
+    unsigned int first = poisson_solve(source, warm, 1, N, N, N, 0.1, numiters, numcores, &opts);
+
+    // Re-solve after a small change to the charge, from scratch and from
+    // the previous answer
+    source[centre] = 1.05;
+    double start = now();
+    unsigned int n_cold = poisson_solve(source, cold, 1, N, N, N, 0.1, numiters, numcores, &opts);
+    double t_cold = now() - start;
+    opts.warm_start = 1;
+    start = now();
+    unsigned int n_warm = poisson_solve(source, warm, 1, N, N, N, 0.1, numiters, numcores, &opts);
+    double t_warm = now() - start;
+
+    printf("Tolerance %g: first solve %u iterations, re-solve cold %u iterations %f s,"
+           " warm %u iterations %f s, max diff: %g\n",
+           tolerance, first, n_cold, t_cold, n_warm, t_warm, max_diff(cold, warm, count));
+
+    // Both answers stop within jacobi_bound of the same fixed point
+    int status = n_warm > n_cold;
+    if (n_cold >= numiters || n_warm >= numiters) {
+        printf("Re-solve did not converge in %u iterations\n", numiters);
+        status = 1;
+    } else if (max_diff(cold, warm, count) > 2 * jacobi_bound(N, tolerance)) {
+        printf("Warm answer differs from cold by more than %g\n", 2 * jacobi_bound(N, tolerance));
+        status = 1;
+    }
+
+    free(warm);
+    free(cold);
+    free(source);
+    return status;
+}
+
+static int test_local (unsigned int N, unsigned int numiters, unsigned int numcores, double tolerance)
+{
+    size_t count = (size_t)N * N * N;
+    double *source = (double *)calloc(count, sizeof(double));
+    double *whole = (double *)calloc(count, sizeof(double));
+    double *local = (double *)calloc(count, sizeof(double));
+    source[((N / 2 * N) + N / 2) * N + N / 2] = 1.0;
+
+    struct poisson_options opts;
+    poisson_options_init(&opts);
+    opts.tolerance = tolerance;
+    poisson_solve(source, whole, 0, N, N, N, 0.1, numiters, numcores, &opts);
+    memcpy(local, whole, count * sizeof(double));
+
+    // Add a small charge near a corner and re-solve, sweeping the whole box
+    // from the old answer and then only around the edit
+    struct poisson_block edit = {N / 8, N / 8 + 1, N / 8, N / 8 + 1, N / 8, N / 8 + 1};
+    source[((edit.z0 * N) + edit.y0) * N + edit.x0] = 0.01;
+
+    opts.warm_start = 1;
+    double start = now();
+    unsigned int n_whole = poisson_solve(source, whole, 0, N, N, N, 0.1, numiters, numcores, &opts);
+    double t_whole = now() - start;
+    start = now();
+    unsigned int n_local = poisson_resolve_local(source, local, 0, N, N, N, 0.1, &edit, 1,
+                                                 numiters, tolerance, numcores);
+    double t_local = now() - start;
+
+    double diff = max_diff(whole, local, count);
+    printf("Local edit, tolerance %g: whole box %u iterations %f s, local %u iterations %f s,"
+           " max diff: %g\n", tolerance, n_whole, t_whole, n_local, t_local, diff);
+
+    // Both answers stop within jacobi_bound of the same fixed point
+    int status = 0;
+    if (n_whole >= numiters || n_local >= numiters) {
+        printf("Re-solve did not converge in %u iterations\n", numiters);
+        status = 1;
+    } else if (diff > 2 * jacobi_bound(N, tolerance)) {
+        printf("Local answer differs from the whole box by more than %g\n", 2 * jacobi_bound(N, tolerance));
+        status = 1;
+    }
+
+    free(local);
+    free(whole);
+    free(source);
+    return status;
+}
+
+static int test_dirty (unsigned int N, unsigned int numiters, unsigned int numcores)
+{
+    size_t count = (size_t)N * N * N;
+    double *source = (double *)calloc(count, sizeof(double));
+    double *full = (double *)calloc(count, sizeof(double));
+    double *skipped = (double *)calloc(count, sizeof(double));
+    source[((N / 2 * N) + N / 2) * N + N / 2] = 1.0;
+
+    double start = now();
+    poisson_solve(source, full, 0, N, N, N, 0.1, numiters, numcores, NULL);
+    double t_full = now() - start;
+
+    struct poisson_options opts;
+    poisson_options_init(&opts);
+    opts.skip_unchanged = 1;
+    start = now();
+    poisson_solve(source, skipped, 0, N, N, N, 0.1, numiters, numcores, &opts);
+    double t_skip = now() - start;
+
+    int same = memcmp(full, skipped, count * sizeof(double)) == 0;
+    printf("Skipping unchanged tiles: every tile %f s, changed tiles only %f s, %s\n",
+           t_full, t_skip, same ? "bit-identical" : "DIFFERENT");
+
+    free(skipped);
+    free(full);
+    free(source);
+    return !same;
+}
+
+static int test_sparse (unsigned int N, unsigned int numiters, unsigned int numcores)
+{
+    size_t count = (size_t)N * N * N;
+    double *source = (double *)calloc(count, sizeof(double));
+    double *dense = (double *)calloc(count, sizeof(double));
+    double *sparse = (double *)calloc(count, sizeof(double));
+
+    // A handful of point charges, including ones on the faces
+    source[((N / 2 * N) + N / 2) * N + N / 2] = 1.0;
+    source[((N / 4 * N) + N / 3) * N + N / 5] = -2.5;
+    source[((0 * N) + N / 2) * N + N - 1] = 0.75;
+    source[(((N - 1) * N) + N - 1) * N + 0] = 3.0;
+
+    double start = now();
+    poisson_dirichlet_blocks(source, dense, 1, N, N, N, 0.1, numiters, numcores);
+    double t_dense = now() - start;
+
+    start = now();
+    poisson_solve(source, sparse, 1, N, N, N, 0.1, numiters, numcores, NULL);
+    double t_sparse = now() - start;
+
+    int same = memcmp(dense, sparse, count * sizeof(double)) == 0;
+    printf("Sparse source: dense kernel %f s, Laplace kernel with charge list %f s, %s\n",
+           t_dense, t_sparse, same ? "bit-identical" : "DIFFERENT");
+
+    free(sparse);
+    free(dense);
+    free(source);
+    return !same;
+}
+
+static int test_sym (unsigned int N, unsigned int numiters, unsigned int numcores)
+{
+    size_t count = (size_t)N * N * N;
+    double *source = (double *)calloc(count, sizeof(double));
+    double *full = (double *)calloc(count, sizeof(double));
+    double *reduced = (double *)calloc(count, sizeof(double));
+    source[((N / 2 * N) + N / 2) * N + N / 2] = 1.0;
+
+    // Only an odd box has a middle voxel for the charge to be mirrored about
+    const unsigned int all = N % 2 ? POISSON_MIRROR_X | POISSON_MIRROR_Y | POISSON_MIRROR_Z : 0;
+    int status = 0;
+
+    double start = now();
+    poisson_dirichlet(source, full, 1, N, N, N, 0.1, numiters, numcores);
+    double t_full = now() - start;
+
+    start = now();
+    unsigned int mirrors = poisson_dirichlet_symmetric(source, reduced, 1, N, N, N, 0.1, numiters, numcores);
+    double t_reduced = now() - start;
+
+    printf("Centred charge, mirrors %s%s%s: whole box %f s, reduced %f s, max diff: %g\n",
+           mirrors & POISSON_MIRROR_X ? "x" : "", mirrors & POISSON_MIRROR_Y ? "y" : "",
+           mirrors & POISSON_MIRROR_Z ? "z" : "", t_full, t_reduced, max_diff(full, reduced, count));
+    if (poisson_symmetry(source, N, N, N, numcores) != all || mirrors != all) {
+        printf("Centred charge should have mirrors %u, found %u\n", all, mirrors);
+        status = 1;
+    }
+    if (max_diff(full, reduced, count) > 1e-12)
+        status = 1;
+
+    // A second charge off the middle in x leaves only the y and z mirrors
+    source[((N / 2 * N) + N / 2) * N + N / 4] = 1.0;
+    poisson_dirichlet(source, full, 1, N, N, N, 0.1, numiters, numcores);
+    mirrors = poisson_dirichlet_symmetric(source, reduced, 1, N, N, N, 0.1, numiters, numcores);
+    printf("Off-centre charge, mirrors %s%s%s: max diff: %g\n",
+           mirrors & POISSON_MIRROR_X ? "x" : "", mirrors & POISSON_MIRROR_Y ? "y" : "",
+           mirrors & POISSON_MIRROR_Z ? "z" : "", max_diff(full, reduced, count));
+    if (mirrors != (all & ~POISSON_MIRROR_X)) {
+        printf("Off-centre charge should have mirrors %u, found %u\n", all & ~POISSON_MIRROR_X, mirrors);
+        status = 1;
+    }
+    if (max_diff(full, reduced, count) > 1e-12)
+        status = 1;
+
+    free(reduced);
+    free(full);
+    free(source);
+    return status;
+}
+
+static int test_amr (unsigned int N, unsigned int numiters, unsigned int numcores, unsigned int passes)
+{
+    size_t count = (size_t)N * N * N;
+    double *source = (double *)calloc(count, sizeof(double));
+    double *dense = (double *)calloc(count, sizeof(double));
+    double *sampled = (double *)calloc(count, sizeof(double));
+    unsigned int c = N / 2;
+    source[((c * N) + c) * N + c] = 1.0;
+
+    double start = now();
+    poisson_dirichlet_blocks(source, dense, 1, N, N, N, 0.1, numiters, numcores);
+    double t_dense = now() - start;
+
+    struct poisson_amr_options opts;
+    poisson_amr_options_init(&opts);
+    opts.passes = passes;
+    opts.gradient_threshold = 1e-3;
+    start = now();
+    struct poisson_amr *amr = poisson_amr_solve(source, 1, N, N, N, 0.1, numiters, numcores, &opts);
+    double t_amr = now() - start;
+    if (!amr)
+        return 1;
+    poisson_amr_sample(amr, sampled, numcores);
+
+    // Near field: within 4 voxels of the charge, where the cells are voxels
+    double near = 0;
+    for (unsigned int z = c > 4 ? c - 4 : 0; z <= c + 4 && z < N; z++)
+        for (unsigned int y = c > 4 ? c - 4 : 0; y <= c + 4 && y < N; y++)
+            for (unsigned int x = c > 4 ? c - 4 : 0; x <= c + 4 && x < N; x++) {
+                size_t i = ((size_t)z * N + y) * N + x;
+                near = fmax(near, fabs(dense[i] - sampled[i]));
+            }
+    printf("AMR, %u pass(es): %zu cells (%.1f%% of %zu voxels), dense %f s, AMR %f s, "
+           "near-field max diff: %g, max diff: %g\n",
+           passes, poisson_amr_cells(amr), 100.0 * poisson_amr_cells(amr) / count, count,
+           t_dense, t_amr, near, max_diff(dense, sampled, count));
+
+    // Converged, 51^3 agrees to 4.1e-6 near the charge, where the cells
+    // are voxels and only the coarse far field perturbs the answer
+    int status = near > 1e-5;
+    if (status)
+        printf("Near-field difference above 1e-5, more iterations may be needed\n");
+
+    poisson_amr_destroy(amr);
+    free(sampled);
+    free(dense);
+    free(source);
+    return status;
+}
+
+static int test_walk (unsigned int N, unsigned int numiters, unsigned int numcores, double halfwidth)
+{
+    size_t count = (size_t)N * N * N;
+    double *source = (double *)calloc(count, sizeof(double));
+    double *potential = (double *)calloc(count, sizeof(double));
+    unsigned int c = N / 2;
+    source[((c * N) + c) * N + c] = 1.0;
+
+    double start = now();
+    poisson_dirichlet_blocks(source, potential, 1, N, N, N, 0.1, numiters, numcores);
+    double t_dense = now() - start;
+
+    struct poisson_probe probes[4] = {{c, c, c, 0, 0, 0}, {c + 1, c, c, 0, 0, 0},
+                                      {c, c / 2, c, 0, 0, 0}, {1, 1, 1, 0, 0, 0}};
+    start = now();
+    int met = poisson_probe_walk(source, 1, N, N, N, 0.1, probes, 4, halfwidth, 100000000, 464,
+                                 numcores);
+    double t_walk = now() - start;
+
+    printf("Random walks, %d of 4 probes within %g: dense %f s, walks %f s\n", met, halfwidth, t_dense, t_walk);
+    // A 95% interval misses now and then, three halfwidths practically
+    // never.  Walks that all agree, as near the boundary, report a zero
+    // width, so the requested halfwidth is the yardstick
+    int inside = 0, status = met < 4;
+    for (unsigned int p = 0; p < 4; p++) {
+        double v = potential[((size_t)probes[p].z * N + probes[p].y) * N + probes[p].x];
+        double err = fabs(probes[p].value - v);
+        inside += err <= probes[p].halfwidth;
+        status |= !(err <= 3 * halfwidth);
+        printf("  (%u, %u, %u): %.8f +- %.2g from %lu walks, dense %.8f, diff %.2g\n",
+               probes[p].x, probes[p].y, probes[p].z, probes[p].value, probes[p].halfwidth,
+               probes[p].walks, v, err);
+    }
+    printf("  %d of 4 dense values inside the intervals\n", inside);
+    if (status)
+        printf("Walks disagree with the dense solve, or did not reach halfwidth %g\n", halfwidth);
+
+    free(potential);
+    free(source);
+    return status;
+}
+
+static int test_mixed (unsigned int N, unsigned int numiters, unsigned int numcores, unsigned int inner)
+{
+    size_t count = (size_t)N * N * N;
+    double *source = (double *)calloc(count, sizeof(double));
+    double *full = (double *)calloc(count, sizeof(double));
+    double *mixed = (double *)calloc(count, sizeof(double));
+    source[((N / 2 * N) + N / 2) * N + N / 2] = 1.0;
+
+    double start = now();
+    poisson_dirichlet_blocks(source, full, 1, N, N, N, 0.1, numiters, numcores);
+    double t_full = now() - start;
+
+    start = now();
+    poisson_dirichlet_mixed(source, mixed, 1, N, N, N, 0.1, numiters, inner, 0, numcores);
+    double t_mixed = now() - start;
+
+    // Float sweeps of the iterate itself could not get closer than FLT_EPSILON
+    printf("Mixed precision, %u sweeps per step: double %f s, mixed %f s, max diff: %g (float epsilon %g)\n",
+           inner, t_full, t_mixed, max_diff(full, mixed, count), (double)FLT_EPSILON);
+
+    // Once both have converged they share the double fixed point
+    int status = max_diff(full, mixed, count) > 1e-12;
+    if (status)
+        printf("Mixed answer differs by more than 1e-12, more iterations may be needed\n");
+
+    free(mixed);
+    free(full);
+    free(source);
+    return status;
+}
+
+static int test_jit (unsigned int N, unsigned int numiters, unsigned int numcores)
+{
+    size_t count = (size_t)N * N * N;
+    double *source = (double *)malloc(count * sizeof(double));
+    double *generic = (double *)calloc(count, sizeof(double));
+    double *jit = (double *)calloc(count, sizeof(double));
+    // Dense, so that the sparse source path does not take over
+    for (size_t i = 0; i < count; i++)
+        source[i] = (double)(i % 7) - 3;
+
+    double start = now();
+    poisson_solve(source, generic, 1, N, N, N, 0.1, numiters, numcores, NULL);
+    double t_generic = now() - start;
+
+    struct poisson_options opts;
+    poisson_options_init(&opts);
+    opts.jit = 1;
+    start = now();
+    poisson_solve(source, jit, 1, N, N, N, 0.1, numiters, numcores, &opts);
+    double t_first = now() - start;
+    start = now();
+    poisson_solve(source, jit, 1, N, N, N, 0.1, numiters, numcores, &opts);
+    double t_cached = now() - start;
+
+    int same = memcmp(generic, jit, count * sizeof(double)) == 0;
+    printf("JIT kernel: generic %f s, first JIT solve %f s, cached %f s, %s\n",
+           t_generic, t_first, t_cached, same ? "bit-identical" : "DIFFERENT");
+
+    free(jit);
+    free(generic);
+    free(source);
+    return !same;
+}
+
+// Sample sin(pi x) sin(pi y) sin(pi z) and its Laplacian at xsize x ysize
+// x zsize voxels filling the unit cube
+static void sine_problem (unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                          double *source, double *exact)
+{
+    for (unsigned int z = 0; z < zsize; z++) {
+        for (unsigned int y = 0; y < ysize; y++) {
+            for (unsigned int x = 0; x < xsize; x++) {
+                size_t i = ((size_t)z * ysize + y) * xsize + x;
+                exact[i] = sin(M_PI * (x + 1) / (xsize + 1)) * sin(M_PI * (y + 1) / (ysize + 1))
+                         * sin(M_PI * (z + 1) / (zsize + 1));
+                source[i] = -3 * M_PI * M_PI * exact[i];
+            }
+        }
+    }
+}
+
+static int test_stencil (unsigned int N, unsigned int numiters, unsigned int numcores)
+{
+    size_t count = (size_t)N * N * N;
+    double *source = (double *)malloc(count * sizeof(double));
+    double *reference = (double *)calloc(count, sizeof(double));
+    double *potential = (double *)calloc(count, sizeof(double));
+    // Dense, so that the sparse source path does not take over the reference
+    for (size_t i = 0; i < count; i++)
+        source[i] = (double)(i % 7) - 3;
+
+    double start = now();
+    poisson_solve(source, reference, 1, N, N, N, 0.1, numiters, numcores, NULL);
+    double t_reference = now() - start;
+
+    struct poisson_options opts;
+    poisson_options_init(&opts);
+    opts.sweep = poisson_stencil<poisson_laplace7>::sweep;
+    start = now();
+    poisson_solve(source, potential, 1, N, N, N, 0.1, numiters, numcores, &opts);
+    double t_7 = now() - start;
+    int same = memcmp(reference, potential, count * sizeof(double)) == 0;
+    printf("7-point stencil: poisson_sweep %f s, stencil %f s, %s\n",
+           t_reference, t_7, same ? "bit-identical" : "DIFFERENT");
+
+    opts.sweep = poisson_stencil<poisson_laplace19>::sweep;
+    start = now();
+    poisson_solve(source, potential, 1, N, N, N, 0.1, numiters, numcores, &opts);
+    printf("19-point stencil: %f s, max difference from 7-point %g\n",
+           now() - start, max_diff(reference, potential, count));
+
+    opts.sweep = poisson_stencil<poisson_laplace27>::sweep;
+    start = now();
+    poisson_solve(source, potential, 1, N, N, N, 0.1, numiters, numcores, &opts);
+    printf("27-point stencil: %f s, max difference from 7-point %g\n",
+           now() - start, max_diff(reference, potential, count));
+
+    // Each stencil on sin(pi x) sin(pi y) sin(pi z): all three are second
+    // order, the 7-point one off by pi^2 h^2 / 12 to leading order and the
+    // other two by pi^2 h^2 / 4.  A wrong weight or divisor moves the fixed
+    // point by far more than the half again allowed here.
+    unsigned int n = N < 31 ? N : 31;
+    size_t ncount = (size_t)n * n * n;
+    double *exact = (double *)malloc(ncount * sizeof(double));
+    double h = 1.0 / (n + 1);
+    sine_problem(n, n, n, source, exact);
+    const struct {
+        const char *name;
+        poisson_sweep_fn sweep;
+        double bound;
+    } cases[] = {
+        {"7-point", poisson_stencil<poisson_laplace7>::sweep, 1.5 * M_PI * M_PI * h * h / 12},
+        {"19-point", poisson_stencil<poisson_laplace19>::sweep, 1.5 * M_PI * M_PI * h * h / 4},
+        {"27-point", poisson_stencil<poisson_laplace27>::sweep, 1.5 * M_PI * M_PI * h * h / 4},
+    };
+    int status = !same;
+    opts.tolerance = 1e-13;
+    for (unsigned int i = 0; i < 3; i++) {
+        opts.sweep = cases[i].sweep;
+        memset(potential, 0, ncount * sizeof(double));
+        unsigned int iters = poisson_solve(source, potential, 0, n, n, n, h, numiters, numcores, &opts);
+        double error = max_diff(exact, potential, ncount);
+        printf("%s stencil on %u^3 sine: %u iterations, max error %g, bound %g\n",
+               cases[i].name, n, iters, error, cases[i].bound);
+        if (iters >= numiters || error > cases[i].bound) {
+            printf("%s stencil inaccurate or not converged in %u iterations\n", cases[i].name, numiters);
+            status = 1;
+        }
+    }
+
+    free(exact);
+    free(potential);
+    free(reference);
+    free(source);
+    return status;
+}
+
+// Solve for u = sin(pi x) sin(pi y) sin(pi z) on the unit cube, sampled
+// at n^3 voxels, by the second and fourth order schemes to convergence.
+// Returns the largest error against u of each, and their times.
+static void mehrstellen_case (unsigned int n, unsigned int numiters, unsigned int numcores,
+                              double error[2], double seconds[2], unsigned int iters[2])
+{
+    size_t count = (size_t)n * n * n;
+    double *source = (double *)malloc(count * sizeof(double));
+    double *exact = (double *)malloc(count * sizeof(double));
+    double *potential = (double *)calloc(count, sizeof(double));
+    double h = 1.0 / (n + 1);
+    for (unsigned int z = 0; z < n; z++) {
+        for (unsigned int y = 0; y < n; y++) {
+            for (unsigned int x = 0; x < n; x++) {
+                size_t i = ((size_t)z * n + y) * n + x;
+                exact[i] = sin(M_PI * (x + 1) * h) * sin(M_PI * (y + 1) * h) * sin(M_PI * (z + 1) * h);
+                source[i] = -3 * M_PI * M_PI * exact[i];
+            }
+        }
+    }
+
+    struct poisson_options opts;
+    poisson_options_init(&opts);
+    opts.tolerance = 1e-13;
+    for (int order = 0; order < 2; order++) {
+        opts.mehrstellen = order;
+        double start = now();
+        iters[order] = poisson_solve(source, potential, 0, n, n, n, h, numiters, numcores, &opts);
+        seconds[order] = now() - start;
+        error[order] = max_diff(exact, potential, count);
+    }
+
+    free(potential);
+    free(exact);
+    free(source);
+}
+
+// Error against time of the second order 7-point scheme and the fourth
+// order Mehrstellen one, on grids of N, (N + 1) / 2 - 1 and so on voxels
+static int test_mehrstellen (unsigned int N, unsigned int numiters, unsigned int numcores)
+{
+    double last[2] = {0, 0};
+    int status = 0;
+    printf("%6s %12s %10s %8s %6s %12s %10s %8s %6s\n", "size", "7-point err", "time", "iters", "order",
+           "Mehr err", "time", "iters", "order");
+    for (unsigned int n = N, k = 0; n >= 3 && k < 3; n = (n + 1) / 2 - 1, k++) {
+        double error[2], seconds[2];
+        unsigned int iters[2];
+        mehrstellen_case(n, numiters, numcores, error, seconds, iters);
+        // Each coarser grid has twice the spacing, so the order is log2 of
+        // the error ratio
+        printf("%6u %12.3e %10.4f %8u %6.2f %12.3e %10.4f %8u %6.2f\n", n,
+               error[0], seconds[0], iters[0], last[0] > 0 ? log2(error[0] / last[0]) : 0.0,
+               error[1], seconds[1], iters[1], last[1] > 0 ? log2(error[1] / last[1]) : 0.0);
+        // The 7-point stencil is second order and Mehrstellen fourth
+        if (last[0] > 0 && (fabs(log2(error[0] / last[0]) - 2) > 0.2 || log2(error[1] / last[1]) < 3.5)) {
+            printf("Orders not near 2 and at least 3.5, more iterations may be needed\n");
+            status = 1;
+        }
+        last[0] = error[0];
+        last[1] = error[1];
+    }
+    return status;
+}
+
+// Check that cubic voxels through poisson_dirichlet_aniso cost nothing,
+// then solve the unit cube on N^3 cubes and on N x N x (N + 1) / 2 - 1
+// voxels twice as thick, as for slices of imaging data
+static int test_aniso (unsigned int N, unsigned int numiters, unsigned int numcores)
+{
+    size_t count = (size_t)N * N * N;
+    double *source = (double *)malloc(count * sizeof(double));
+    double *exact = (double *)malloc(count * sizeof(double));
+    double *reference = (double *)calloc(count, sizeof(double));
+    double *potential = (double *)calloc(count, sizeof(double));
+    double h = 1.0 / (N + 1);
+    sine_problem(N, N, N, source, exact);
+
+    double start = now();
+    poisson_dirichlet(source, reference, 0, N, N, N, h, numiters, numcores);
+    double t_reference = now() - start;
+    start = now();
+    poisson_dirichlet_aniso(source, potential, 0, N, N, N, h, h, h, numiters, numcores);
+    double t_iso = now() - start;
+    int same = memcmp(reference, potential, count * sizeof(double)) == 0;
+    printf("Cubic voxels: poisson_dirichlet %f s, anisotropic API %f s, %s\n",
+           t_reference, t_iso, same ? "bit-identical" : "DIFFERENT");
+
+    unsigned int nz = (N + 1) / 2 - 1;
+    size_t thin = (size_t)N * N * nz;
+    double *thick_source = (double *)malloc(thin * sizeof(double));
+    double *thick_exact = (double *)malloc(thin * sizeof(double));
+    sine_problem(N, N, nz, thick_source, thick_exact);
+    start = now();
+    poisson_dirichlet_aniso(thick_source, potential, 0, N, N, nz, h, h, 1.0 / (nz + 1), numiters, numcores);
+    double t_aniso = now() - start;
+    printf("%u^3 cubes: %f s, max error %g\n", N, t_reference, max_diff(exact, reference, count));
+    printf("%u x %u x %u thick voxels: %f s, max error %g\n", N, N, nz, t_aniso,
+           max_diff(thick_exact, potential, thin));
+
+    // The 7-point stencil's error on this problem is pi^2 / 36 times the
+    // sum of the squared spacings, to leading order; allow half as much again
+    double hz = 1.0 / (nz + 1);
+    double cube_bound = 1.5 * M_PI * M_PI / 36 * 3 * h * h;
+    double thick_bound = 1.5 * M_PI * M_PI / 36 * (2 * h * h + hz * hz);
+    int status = !same;
+    if (max_diff(exact, reference, count) > cube_bound
+        || max_diff(thick_exact, potential, thin) > thick_bound) {
+        printf("Errors above %g and %g, more iterations may be needed\n", cube_bound, thick_bound);
+        status = 1;
+    }
+
+    free(thick_exact);
+    free(thick_source);
+    free(potential);
+    free(reference);
+    free(exact);
+    free(source);
+    return status;
+}
 
 int main (int argc, char *argv[])
 {
@@ -21,10 +1157,16 @@ int main (int argc, char *argv[])
     unsigned int ysize;
     unsigned int zsize;    
     double delta = 0.1;
+    const char *mode = "";
 
     if (argc < 3)
     {
-        fprintf (stderr, "Usage: %s size numiters\n", argv[0]);
+        fprintf (stderr, "Usage: %s size numiters [numcores [mode ...]]\n", argv[0]);
+        fprintf (stderr, "Modes: batch [nrhs], sched [numjobs], tiled, blocks, async [tolerance], ooc [depth],\n"
+                         "       file [source.pgrid [potential.pgrid]], snap [every [block|newest|oldest]],\n"
+                         "       zip [tolerance [min_ratio]], text [precision [sparse]], ckpt [every],\n"
+                         "       warm [tolerance], local [tolerance], dirty, sparse, sym, amr [passes],\n"
+                         "       walk [halfwidth], mixed [inner], jit, stencil, mehrstellen, aniso\n");
         return 1;
     }
 
@@ -40,6 +1182,60 @@ int main (int argc, char *argv[])
     else
         numcores = 0;
 
+    if (argc > 4)
+        mode = argv[4];
+
+    if (strcmp(mode, "batch") == 0)
+        return test_batch(N, numiters, numcores, argc > 5 ? atoi(argv[5]) : 8);
+    if (strcmp(mode, "tiled") == 0)
+        return test_tiled(N, numiters, numcores);
+    if (strcmp(mode, "blocks") == 0)
+        return test_blocks(N, numiters, numcores ? numcores : 1);
+    if (strcmp(mode, "file") == 0)
+        return test_file(N, numiters, numcores, argc > 5 ? argv[5] : "source.pgrid",
+                         argc > 6 ? argv[6] : "potential.pgrid");
+    if (strcmp(mode, "aniso") == 0)
+        return test_aniso(N, numiters, numcores);
+    if (strcmp(mode, "mehrstellen") == 0)
+        return test_mehrstellen(N, numiters, numcores);
+    if (strcmp(mode, "stencil") == 0)
+        return test_stencil(N, numiters, numcores);
+    if (strcmp(mode, "jit") == 0)
+        return test_jit(N, numiters, numcores);
+    if (strcmp(mode, "mixed") == 0)
+        return test_mixed(N, numiters, numcores, argc > 5 ? atoi(argv[5]) : 10);
+    if (strcmp(mode, "walk") == 0)
+        return test_walk(N, numiters, numcores, argc > 5 ? atof(argv[5]) : 1e-5);
+    if (strcmp(mode, "amr") == 0)
+        return test_amr(N, numiters, numcores, argc > 5 ? atoi(argv[5]) : 1);
+    if (strcmp(mode, "sym") == 0)
+        return test_sym(N, numiters, numcores);
+    if (strcmp(mode, "sparse") == 0)
+        return test_sparse(N, numiters, numcores);
+    if (strcmp(mode, "dirty") == 0)
+        return test_dirty(N, numiters, numcores);
+    if (strcmp(mode, "local") == 0)
+        return test_local(N, numiters, numcores, argc > 5 ? atof(argv[5]) : 1e-9);
+    if (strcmp(mode, "warm") == 0)
+        return test_warm(N, numiters, numcores, argc > 5 ? atof(argv[5]) : 1e-9);
+    if (strcmp(mode, "ckpt") == 0)
+        return test_ckpt(N, numiters, numcores, argc > 5 ? atoi(argv[5]) : 10);
+    if (strcmp(mode, "text") == 0)
+        return test_text(N, numiters, numcores, argc > 5 ? atoi(argv[5]) : 6,
+                         argc > 6 ? atoi(argv[6]) : 0);
+    if (strcmp(mode, "zip") == 0)
+        return test_zip(N, numiters, numcores, argc > 5 ? atof(argv[5]) : 1e-6,
+                        argc > 6 ? atof(argv[6]) : 0);
+    if (strcmp(mode, "snap") == 0)
+        return test_snap(N, numiters, numcores, argc > 5 ? atoi(argv[5]) : 10,
+                         argc > 6 ? argv[6] : "block");
+    if (strcmp(mode, "ooc") == 0)
+        return test_ooc(N, numiters, numcores, argc > 5 ? atoi(argv[5]) : 4);
+    if (strcmp(mode, "async") == 0)
+        return test_async(N, numiters, numcores, argc > 5 ? atof(argv[5]) : 1e-12);
+    if (strcmp(mode, "sched") == 0)
+        return test_sched(N, numiters, numcores, argc > 5 ? atoi(argv[5]) : 16);
+
     source = (double *)calloc(xsize * ysize * zsize, sizeof(*source));
     potential = (double *)calloc(xsize * ysize * zsize, sizeof(*potential));
 
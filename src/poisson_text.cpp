@@ -0,0 +1,246 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <charconv>
+
+#include "poisson.hpp"
+
+// Aim for about this much text per thread per round, so that memory stays
+// bounded however large the grid
+#define TEXT_ROUND_BYTES (4 << 20)
+
+// Room that formatting one voxel may need before the buffer is grown
+#define TEXT_LINE_MAX 128
+
+struct text_buffer {
+	char *buf;
+	size_t size;
+	size_t len;
+};
+
+// State shared by the formatting threads of one export
+struct text_engine {
+	const double *data;
+	unsigned int xsize, ysize, zsize;
+	double Vbound;
+	int precision;
+	int sparse;
+	unsigned int numcores;
+	unsigned int step;				// planes per thread per round
+	unsigned int rounds;
+	int fd;
+	int status;
+	pthread_barrier_t barrier;
+};
+
+// structure we're going to use for arguments to the formatting threads
+struct text_args {
+	struct text_engine *e;
+	unsigned int id;
+	struct text_buffer out[2];		// alternate rounds
+	struct text_args *all;
+	pthread_t thread;
+};
+
+static void *text_thread(void *args);
+
+/// Export a grid as text, one line per voxel in the format of the old
+/// poisson_dirichlet dump, "x: 1 | y: 2 | z: 3 - 0.500000".  Threads format
+/// interleaved runs of planes with std::to_chars into their own buffers,
+/// which are written out in plane order with large sequential writes while
+/// the next round is formatted.  The output does not depend on numcores.
+/// \param path is the file to create or overwrite
+/// \param data is a flattened 3-D array, ordered as for poisson_dirichlet
+/// \param Vbound is the boundary potential, skipped in sparse mode
+/// \param precision is the number of decimal places.  If negative, the
+///        shortest text that reads back as the same double
+/// \param sparse skips voxels exactly equal to Vbound if non-zero
+/// \param numcores is the number of threads to format with.  If 0, one per core
+/// \return 0 on success, -1 on failure
+int poisson_export_text (const char *path, const double *data,
+                         unsigned int xsize, unsigned int ysize, unsigned int zsize,
+                         double Vbound, int precision, int sparse, unsigned int numcores)
+{
+	if (numcores == 0)
+		numcores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (numcores > zsize)
+		numcores = zsize > 0 ? zsize : 1;
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+
+	struct text_engine e;
+	size_t plane_text = (size_t)xsize * ysize * 40 + 1;
+	e.data = data;
+	e.xsize = xsize;
+	e.ysize = ysize;
+	e.zsize = zsize;
+	e.Vbound = Vbound;
+	e.precision = precision;
+	e.sparse = sparse;
+	e.numcores = numcores;
+	e.step = TEXT_ROUND_BYTES / plane_text > 0 ? TEXT_ROUND_BYTES / plane_text : 1;
+	e.rounds = (unsigned int)((zsize + (size_t)e.step * numcores - 1) / ((size_t)e.step * numcores));
+	e.fd = fd;
+	e.status = 0;
+	pthread_barrier_init(&e.barrier, NULL, numcores);
+
+	struct text_args ta[numcores];
+	memset(ta, 0, sizeof(ta));
+	for (unsigned int i = 0; i < numcores; i++) {
+		ta[i].e = &e;
+		ta[i].id = i;
+		ta[i].all = ta;
+		if (pthread_create(&ta[i].thread, NULL, text_thread, (void *)&ta[i]) != 0) {
+			fprintf(stderr, "Could not create thread %d\n", i);
+		}
+	}
+	for (unsigned int i = 0; i < numcores; i++) {
+		pthread_join(ta[i].thread, NULL);
+		free(ta[i].out[0].buf);
+		free(ta[i].out[1].buf);
+	}
+	pthread_barrier_destroy(&e.barrier);
+
+	if (close(fd) != 0)
+		e.status = -1;
+	if (e.status != 0)
+		perror(path);
+	return e.status;
+}
+
+
+// Make room for at least one more line
+static int text_reserve(struct text_buffer *t)
+{
+	if (t->size - t->len >= TEXT_LINE_MAX)
+		return 0;
+	size_t size = t->size ? 2 * t->size : TEXT_ROUND_BYTES;
+	char *buf = (char *)realloc(t->buf, size);
+	if (!buf) {
+		fprintf(stderr, "malloc failure\n");
+		return -1;
+	}
+	t->buf = buf;
+	t->size = size;
+	return 0;
+}
+
+
+static inline char *text_literal(char *p, const char *s, size_t n)
+{
+	memcpy(p, s, n);
+	return p + n;
+}
+
+
+// Format planes [z0, z1) into t
+static int text_format(const struct text_engine *e, struct text_buffer *t, unsigned int z0, unsigned int z1)
+{
+	t->len = 0;
+	for (unsigned int z = z0; z < z1; z++) {
+		for (unsigned int y = 0; y < e->ysize; y++) {
+			const double *row = e->data + ((size_t)z * e->ysize + y) * e->xsize;
+			for (unsigned int x = 0; x < e->xsize; x++) {
+				double v = row[x];
+				if (e->sparse && v == e->Vbound)
+					continue;
+				if (text_reserve(t) != 0)
+					return -1;
+
+				char *p = t->buf + t->len;
+				char *end = t->buf + t->size - 1;
+				p = text_literal(p, "x: ", 3);
+				p = std::to_chars(p, end, x).ptr;
+				p = text_literal(p, " | y: ", 6);
+				p = std::to_chars(p, end, y).ptr;
+				p = text_literal(p, " | z: ", 6);
+				p = std::to_chars(p, end, z).ptr;
+				p = text_literal(p, " - ", 3);
+
+				// Fixed notation can be hundreds of digits long for huge
+				// values, so grow the buffer until it fits
+				std::to_chars_result r = e->precision < 0 ? std::to_chars(p, end, v)
+								: std::to_chars(p, end, v, std::chars_format::fixed, e->precision);
+				while (r.ec != std::errc()) {
+					size_t at = p - t->buf;
+					char *buf = (char *)realloc(t->buf, 2 * t->size);
+					if (!buf) {
+						fprintf(stderr, "malloc failure\n");
+						return -1;
+					}
+					t->buf = buf;
+					t->size *= 2;
+					p = t->buf + at;
+					end = t->buf + t->size - 1;
+					r = e->precision < 0 ? std::to_chars(p, end, v)
+						: std::to_chars(p, end, v, std::chars_format::fixed, e->precision);
+				}
+				*r.ptr = '\n';
+				t->len = r.ptr + 1 - t->buf;
+			}
+		}
+	}
+	return 0;
+}
+
+
+// Write all of t to fd
+static int text_write(int fd, const struct text_buffer *t)
+{
+	const char *p = t->buf;
+	size_t left = t->len;
+	while (left > 0) {
+		ssize_t n = write(fd, p, left);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		left -= n;
+	}
+	return 0;
+}
+
+
+static void *text_thread(void *args)
+{
+	struct text_args *ta = (struct text_args *)args;
+	struct text_engine *e = ta->e;
+	int failed = 0;
+
+	// Round r covers planes [r * n * step, (r + 1) * n * step) with thread i
+	// taking the i'th run of step planes.  After the barrier ending round r
+	// thread 0 writes it out while the others start on round r + 1 in
+	// their other buffer, which nobody is writing from.
+	for (unsigned int r = 0; r < e->rounds; r++) {
+		size_t z0 = ((size_t)r * e->numcores + ta->id) * e->step;
+		size_t z1 = z0 + e->step;
+		if (z0 > e->zsize)
+			z0 = e->zsize;
+		if (z1 > e->zsize)
+			z1 = e->zsize;
+		if (!failed && text_format(e, &ta->out[r % 2], (unsigned int)z0, (unsigned int)z1) != 0) {
+			failed = 1;
+			__atomic_store_n(&e->status, -1, __ATOMIC_RELAXED);
+		}
+		pthread_barrier_wait(&e->barrier);
+
+		if (ta->id == 0 && __atomic_load_n(&e->status, __ATOMIC_RELAXED) == 0) {
+			for (unsigned int i = 0; i < e->numcores; i++) {
+				if (text_write(e->fd, &ta->all[i].out[r % 2]) != 0) {
+					__atomic_store_n(&e->status, -1, __ATOMIC_RELAXED);
+					break;
+				}
+			}
+		}
+	}
+	return NULL;
+}
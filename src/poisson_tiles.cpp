@@ -0,0 +1,256 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <atomic>
+
+#include "poisson.hpp"
+#include "poisson_kernel.hpp"
+
+// Tile extents.  Tiles span the whole x-row so the inner loop stays long.
+#define TILE_Y 16
+#define TILE_Z 4
+
+// Work-stealing deque of tile indices.  The owner pushes and pops at the
+// bottom, thieves take the oldest task from the top.  Each tile has at most
+// one task queued at a time, so ntiles slots are always enough.
+struct tile_deque {
+	pthread_mutex_t lock;
+	unsigned int *tasks;
+	unsigned int top;
+	unsigned int bottom;
+};
+
+// State shared by all workers of one tiled solve
+struct tile_engine {
+	struct poisson_grid grid;
+	double *buf[2];						// iterate k lives in buf[k % 2]
+	const double *source;
+	unsigned int numiters;
+	unsigned int numcores;
+	unsigned int ty;					// tiles along y
+	unsigned int tz;					// tiles along z
+	unsigned int ntiles;
+	std::atomic<unsigned int> *done;	// iterations completed per tile
+	std::atomic<unsigned int> *next;	// next iteration to queue per tile
+	std::atomic<size_t> remaining;		// tasks not yet completed
+	struct tile_deque *deques;
+	pthread_barrier_t barrier;
+};
+
+struct tile_args {
+	struct tile_engine *e;
+	unsigned int id;
+	pthread_t thread;
+};
+
+static void *tile_thread(void *args);
+
+/// Solve Poisson's equation with the same arguments as poisson_dirichlet,
+/// but as a dataflow graph of tiles.  Tile t may start iteration i as soon
+/// as its face neighbours have finished iteration i - 1, so workers run
+/// ahead where they can and steal tiles from each other when idle instead
+/// of meeting at a barrier every iteration.
+void poisson_dirichlet_tiled (double * __restrict__ source,
+                              double * __restrict__ potential,
+                              double Vbound,
+                              unsigned int xsize, unsigned int ysize, unsigned int zsize, double delta,
+                              unsigned int numiters, unsigned int numcores)
+{
+	if (numcores == 0)
+		numcores = sysconf(_SC_NPROCESSORS_ONLN);
+
+	size_t size = (size_t)xsize * ysize * zsize * sizeof(double);
+	struct tile_engine e;
+	e.ty = (ysize + TILE_Y - 1) / TILE_Y;
+	e.tz = (zsize + TILE_Z - 1) / TILE_Z;
+	e.ntiles = e.ty * e.tz;
+	if (numcores > e.ntiles)
+		numcores = e.ntiles;
+
+	double *scratch = (double *)malloc(size);
+	double *bound = poisson_bound_row(xsize, Vbound);
+	e.done = new std::atomic<unsigned int>[e.ntiles];
+	e.next = new std::atomic<unsigned int>[e.ntiles];
+	e.deques = (struct tile_deque *)malloc(numcores * sizeof(struct tile_deque));
+	unsigned int *slots = (unsigned int *)malloc((size_t)numcores * e.ntiles * sizeof(unsigned int));
+	if (!scratch || !bound || !e.deques || !slots) {
+		fprintf(stderr, "malloc failure\n");
+		free(scratch);
+		free(bound);
+		free(e.deques);
+		free(slots);
+		delete[] e.done;
+		delete[] e.next;
+		return;
+	}
+
+	e.grid.source = source;
+	e.grid.bound = bound;
+	e.grid.Vbound = Vbound;
+	e.grid.delta = delta;
+	e.grid.xsize = xsize;
+	e.grid.ysize = ysize;
+	e.grid.zsize = zsize;
+	// Choose the buffers so that the last iterate lands in potential
+	e.buf[numiters % 2] = potential;
+	e.buf[(numiters + 1) % 2] = scratch;
+	e.source = source;
+	e.numiters = numiters;
+	e.numcores = numcores;
+	e.remaining = (size_t)e.ntiles * numiters;
+
+	for (unsigned int t = 0; t < e.ntiles; t++) {
+		e.done[t] = 0;
+		e.next[t] = 0;
+	}
+	for (unsigned int i = 0; i < numcores; i++) {
+		pthread_mutex_init(&e.deques[i].lock, NULL);
+		e.deques[i].tasks = slots + (size_t)i * e.ntiles;
+		e.deques[i].top = 0;
+		e.deques[i].bottom = 0;
+	}
+	pthread_barrier_init(&e.barrier, NULL, numcores);
+
+	struct tile_args ta[numcores];
+	for (unsigned int i = 0; i < numcores; i++) {
+		ta[i].e = &e;
+		ta[i].id = i;
+		if (pthread_create(&ta[i].thread, NULL, tile_thread, (void *)&ta[i]) != 0) {
+			fprintf(stderr, "Could not create thread %d\n", i);
+		}
+	}
+	for (unsigned int i = 0; i < numcores; i++) {
+		pthread_join(ta[i].thread, NULL);
+	}
+
+	pthread_barrier_destroy(&e.barrier);
+	for (unsigned int i = 0; i < numcores; i++) {
+		pthread_mutex_destroy(&e.deques[i].lock);
+	}
+	free(slots);
+	free(e.deques);
+	delete[] e.done;
+	delete[] e.next;
+	free(bound);
+	free(scratch);
+}
+
+
+static void deque_push(struct tile_deque *d, unsigned int ntiles, unsigned int tile)
+{
+	pthread_mutex_lock(&d->lock);
+	d->tasks[d->bottom % ntiles] = tile;
+	d->bottom++;
+	pthread_mutex_unlock(&d->lock);
+}
+
+// Take from the bottom (owner) or the top (thief).  Returns 0 if empty.
+static int deque_take(struct tile_deque *d, unsigned int ntiles, int steal, unsigned int *tile)
+{
+	int found = 0;
+	pthread_mutex_lock(&d->lock);
+	if (d->top != d->bottom) {
+		if (steal) {
+			*tile = d->tasks[d->top % ntiles];
+			d->top++;
+		} else {
+			d->bottom--;
+			*tile = d->tasks[d->bottom % ntiles];
+		}
+		found = 1;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return found;
+}
+
+// Queue the next iteration of tile t on deque d if all of its face
+// neighbours have caught up.  The compare-exchange on next[t] makes sure
+// only one of the workers that might enable a task actually queues it.
+static void tile_try_queue(struct tile_engine *e, struct tile_deque *d, unsigned int t)
+{
+	unsigned int iter = e->done[t];
+	if (iter >= e->numiters)
+		return;
+
+	unsigned int y = t % e->ty;
+	unsigned int z = t / e->ty;
+	if ((y > 0 			&& e->done[t - 1] < iter) ||
+		(y < e->ty - 1 	&& e->done[t + 1] < iter) ||
+		(z > 0 			&& e->done[t - e->ty] < iter) ||
+		(z < e->tz - 1 	&& e->done[t + e->ty] < iter))
+		return;
+
+	unsigned int expected = iter;
+	if (e->next[t].compare_exchange_strong(expected, iter + 1))
+		deque_push(d, e->ntiles, t);
+}
+
+
+static void tile_run(struct tile_engine *e, unsigned int t)
+{
+	unsigned int iter = e->done[t];
+	unsigned int y = t % e->ty;
+	unsigned int z = t / e->ty;
+	unsigned int y1 = (y + 1) * TILE_Y < e->grid.ysize ? (y + 1) * TILE_Y : e->grid.ysize;
+	unsigned int z1 = (z + 1) * TILE_Z < e->grid.zsize ? (z + 1) * TILE_Z : e->grid.zsize;
+
+	poisson_sweep(&e->grid, e->buf[iter % 2], e->buf[(iter + 1) % 2],
+				  0, e->grid.xsize, y * TILE_Y, y1, z * TILE_Z, z1);
+	e->done[t] = iter + 1;
+}
+
+
+static void *tile_thread(void *args)
+{
+	struct tile_args *ta = (struct tile_args *)args;
+	struct tile_engine *e = ta->e;
+	struct tile_deque *own = &e->deques[ta->id];
+	const size_t plane = (size_t)e->grid.xsize * e->grid.ysize;
+	const unsigned int first = (unsigned int)((size_t)e->ntiles * ta->id / e->numcores);
+	const unsigned int last = (unsigned int)((size_t)e->ntiles * (ta->id + 1) / e->numcores);
+
+	// Seed the first iterate from the source, one z-range per worker
+	unsigned int z0 = (unsigned int)((size_t)e->grid.zsize * ta->id / e->numcores);
+	unsigned int z1 = (unsigned int)((size_t)e->grid.zsize * (ta->id + 1) / e->numcores);
+	memcpy(e->buf[0] + z0 * plane, e->source + z0 * plane, (z1 - z0) * plane * sizeof(double));
+	pthread_barrier_wait(&e->barrier);
+
+	// Start with a contiguous run of tiles so that each worker mostly
+	// keeps the same part of the grid in its cache
+	for (unsigned int t = first; t < last; t++) {
+		tile_try_queue(e, own, t);
+	}
+
+	while (e->remaining > 0) {
+		unsigned int t;
+		int found = deque_take(own, e->ntiles, 0, &t);
+		for (unsigned int i = 1; !found && i < e->numcores; i++) {
+			unsigned int victim = (ta->id + i) % e->numcores;
+			found = deque_take(&e->deques[victim], e->ntiles, 1, &t);
+		}
+		if (!found) {
+			sched_yield();
+			continue;
+		}
+
+		tile_run(e, t);
+		e->remaining--;
+
+		unsigned int y = t % e->ty;
+		unsigned int z = t / e->ty;
+		tile_try_queue(e, own, t);
+		if (y > 0)
+			tile_try_queue(e, own, t - 1);
+		if (y < e->ty - 1)
+			tile_try_queue(e, own, t + 1);
+		if (z > 0)
+			tile_try_queue(e, own, t - e->ty);
+		if (z < e->tz - 1)
+			tile_try_queue(e, own, t + e->ty);
+	}
+
+	return NULL;
+}
@@ -0,0 +1,315 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "poisson.hpp"
+
+// Half-width of a 95% confidence interval in standard errors
+#define WALK_Z95 1.96
+
+// Walks per probe each thread runs between checks of the intervals
+#define WALK_ROUND 64
+
+// Fewest walks before an interval is trusted
+#define WALK_MIN 256
+
+// One xoshiro256** stream per thread, on its own cache line
+struct walk_rng {
+	uint64_t s[4];
+} __attribute__((aligned(64)));
+
+// Running sums for one probe from one thread, of the walk values less
+// Vbound so that the variance does not cancel away
+struct walk_sums {
+	double sum;
+	double sumsq;
+	unsigned long walks;
+};
+
+// State shared by the walkers of one poisson_probe_walk call
+struct walk_engine {
+	const double *source;
+	double Vbound;
+	double scale;					// -delta^2 / 6, the weight of the source at each visit
+	unsigned int xsize, ysize, zsize;
+	struct poisson_probe *probes;
+	unsigned int nprobes;
+	unsigned char *done;			// probes whose intervals are narrow enough, or out of walks
+	struct walk_sums *sums;			// sums[id * nprobes + p]
+	unsigned int workers;
+	double halfwidth;
+	unsigned long maxwalks;
+	int stop;
+	pthread_barrier_t barrier;
+};
+
+// structure we're going to use for arguments to our walk pthread function
+struct walk_args {
+	struct walk_engine *e;
+	unsigned int id;
+	struct walk_rng rng;
+	pthread_t thread;
+};
+
+static void *walk_thread(void *args);
+
+static inline uint64_t rotl(uint64_t x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t walk_next(struct walk_rng *r)
+{
+	uint64_t *s = r->s;
+	uint64_t result = rotl(s[1] * 5, 7) * 9;
+	uint64_t t = s[1] << 17;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 45);
+	return result;
+}
+
+// Advance r by 2^128 steps, giving a stream that does not overlap the
+// next 2^128 numbers of the old one
+static void walk_jump(struct walk_rng *r)
+{
+	static const uint64_t JUMP[] = {0x180ec6d33cfd0aba, 0xd5a61266f0c9392c,
+									0xa9582618e03fc9aa, 0x39abdc4529b1661c};
+	uint64_t s[4] = {0, 0, 0, 0};
+	for (unsigned int i = 0; i < 4; i++) {
+		for (int b = 0; b < 64; b++) {
+			if (JUMP[i] & (uint64_t)1 << b) {
+				for (unsigned int j = 0; j < 4; j++)
+					s[j] ^= r->s[j];
+			}
+			walk_next(r);
+		}
+	}
+	memcpy(r->s, s, sizeof(s));
+}
+
+/// Estimate the potential at a few probe voxels without solving for the
+/// whole volume.  A walk starts at the probe and steps to one of the six
+/// neighbouring voxels at random until it leaves the box, adding
+/// -delta^2 / 6 times the source at every voxel it passes through, and
+/// Vbound at the end.  That is the discrete analogue of walk on spheres:
+/// its expectation is exactly the converged poisson_dirichlet solution,
+/// and no grid besides the source is needed.
+///
+/// Walks are shared among the threads, each with its own xoshiro256**
+/// stream jumped 2^128 steps from the last, so they share nothing but the
+/// read-only source.  After every round the threads pool their sums, and
+/// a probe is finished once the 95% confidence interval of its mean is no
+/// wider than halfwidth each side, or maxwalks walks have been made.
+/// The estimates depend on seed and numcores.
+/// \param source is a flattened 3-D array, ordered as for poisson_dirichlet
+/// \param probes give the voxels to estimate, and receive the estimates
+/// \param halfwidth is the half-width wanted of each 95% confidence interval
+/// \param maxwalks is the most walks for any one probe
+/// \param seed selects the random streams
+/// \param numcores is the number of CPU cores to use.  If 0, an optimal number is chosen
+/// \return the number of probes whose intervals are within halfwidth, or -1
+///         if memory runs out
+int poisson_probe_walk (const double *source, double Vbound,
+                        unsigned int xsize, unsigned int ysize, unsigned int zsize, double delta,
+                        struct poisson_probe *probes, unsigned int nprobes,
+                        double halfwidth, unsigned long maxwalks, uint64_t seed,
+                        unsigned int numcores)
+{
+	if (numcores == 0)
+		numcores = sysconf(_SC_NPROCESSORS_ONLN);
+
+	struct walk_args *wa = (struct walk_args *)aligned_alloc(64, numcores * sizeof(struct walk_args));
+	struct walk_sums *sums = (struct walk_sums *)calloc((size_t)numcores * nprobes, sizeof(struct walk_sums));
+	unsigned char *done = (unsigned char *)calloc(nprobes ? nprobes : 1, 1);
+	if (!wa || !sums || !done) {
+		fprintf(stderr, "malloc failure\n");
+		free(wa);
+		free(sums);
+		free(done);
+		return -1;
+	}
+
+	struct walk_engine e;
+	e.source = source;
+	e.Vbound = Vbound;
+	e.scale = -delta * delta / 6;
+	e.xsize = xsize;
+	e.ysize = ysize;
+	e.zsize = zsize;
+	e.probes = probes;
+	e.nprobes = nprobes;
+	e.done = done;
+	e.sums = sums;
+	e.workers = numcores;
+	e.halfwidth = halfwidth;
+	e.maxwalks = maxwalks;
+	e.stop = nprobes == 0;
+	for (unsigned int p = 0; p < nprobes; p++) {
+		probes[p].value = Vbound;
+		probes[p].halfwidth = 0;
+		probes[p].walks = 0;
+		// A probe outside the box is on the boundary
+		if (probes[p].x >= xsize || probes[p].y >= ysize || probes[p].z >= zsize)
+			done[p] = 1;
+	}
+
+	// Seed the first stream with splitmix64 and jump from there
+	struct walk_rng rng;
+	for (unsigned int i = 0; i < 4; i++) {
+		uint64_t z = (seed += 0x9e3779b97f4a7c15);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+		rng.s[i] = z ^ (z >> 31);
+	}
+
+	pthread_barrier_init(&e.barrier, NULL, numcores);
+	for (unsigned int i = 0; i < numcores; i++) {
+		wa[i].e = &e;
+		wa[i].id = i;
+		wa[i].rng = rng;
+		walk_jump(&rng);
+		if (pthread_create(&wa[i].thread, NULL, walk_thread, (void *)&wa[i]) != 0) {
+			fprintf(stderr, "Could not create thread %d\n", i);
+		}
+	}
+	for (unsigned int i = 0; i < numcores; i++) {
+		pthread_join(wa[i].thread, NULL);
+	}
+	pthread_barrier_destroy(&e.barrier);
+
+	int met = 0;
+	for (unsigned int p = 0; p < nprobes; p++) {
+		if (probes[p].walks == 0 || probes[p].halfwidth <= halfwidth)
+			met++;
+	}
+	free(wa);
+	free(sums);
+	free(done);
+	return met;
+}
+
+
+// One walk from voxel (x, y, z) to the boundary, less Vbound
+static double walk_one(const struct walk_engine *e, struct walk_rng *rng,
+                       unsigned int x, unsigned int y, unsigned int z)
+{
+	const size_t xs = e->xsize;
+	const size_t plane = xs * e->ysize;
+	double acc = 0;
+	size_t i = z * plane + y * xs + x;
+
+	for (;;) {
+		// Each 32 bits give one of six directions by multiply and shift
+		uint64_t r = walk_next(rng);
+		for (unsigned int half = 0; half < 2; half++, r >>= 32) {
+			acc += e->source[i];
+			switch ((unsigned int)(((r & 0xffffffff) * 6) >> 32)) {
+			case 0:
+				if (x == 0)
+					return e->scale * acc;
+				x--; i--;
+				break;
+			case 1:
+				if (x == e->xsize - 1)
+					return e->scale * acc;
+				x++; i++;
+				break;
+			case 2:
+				if (y == 0)
+					return e->scale * acc;
+				y--; i -= xs;
+				break;
+			case 3:
+				if (y == e->ysize - 1)
+					return e->scale * acc;
+				y++; i += xs;
+				break;
+			case 4:
+				if (z == 0)
+					return e->scale * acc;
+				z--; i -= plane;
+				break;
+			default:
+				if (z == e->zsize - 1)
+					return e->scale * acc;
+				z++; i += plane;
+				break;
+			}
+		}
+	}
+}
+
+
+// Pool the threads' sums and finish the probes that are done
+static void walk_update(struct walk_engine *e)
+{
+	int left = 0;
+	for (unsigned int p = 0; p < e->nprobes; p++) {
+		if (e->done[p])
+			continue;
+		double sum = 0, sumsq = 0;
+		unsigned long walks = 0;
+		for (unsigned int id = 0; id < e->workers; id++) {
+			const struct walk_sums *s = &e->sums[(size_t)id * e->nprobes + p];
+			sum += s->sum;
+			sumsq += s->sumsq;
+			walks += s->walks;
+		}
+		struct poisson_probe *probe = &e->probes[p];
+		if (walks > 0) {
+			double mean = sum / walks;
+			double var = walks > 1 ? (sumsq - sum * mean) / (walks - 1) : 0;
+			probe->value = e->Vbound + mean;
+			probe->halfwidth = WALK_Z95 * sqrt((var > 0 ? var : 0) / walks);
+			probe->walks = walks;
+		}
+		if ((walks >= WALK_MIN && probe->halfwidth <= e->halfwidth) || walks >= e->maxwalks)
+			e->done[p] = 1;
+		else
+			left = 1;
+	}
+	e->stop = !left;
+}
+
+
+static void *walk_thread(void *args)
+{
+	struct walk_args *wa = (struct walk_args *)args;
+	struct walk_engine *e = wa->e;
+	struct walk_sums *sums = e->sums + (size_t)wa->id * e->nprobes;
+
+	// Split each round's walks so that a round never overshoots maxwalks
+	// by more than one walk per thread
+	while (!e->stop) {
+		for (unsigned int p = 0; p < e->nprobes; p++) {
+			if (e->done[p])
+				continue;
+			const struct poisson_probe *probe = &e->probes[p];
+			unsigned long left = e->maxwalks > probe->walks ? e->maxwalks - probe->walks : 0;
+			unsigned long n = (left + e->workers - 1) / e->workers;
+			n = n < WALK_ROUND ? n : WALK_ROUND;
+
+			struct walk_sums s = sums[p];
+			for (unsigned long k = 0; k < n; k++) {
+				double v = walk_one(e, &wa->rng, probe->x, probe->y, probe->z);
+				s.sum += v;
+				s.sumsq += v * v;
+			}
+			s.walks += n;
+			sums[p] = s;
+		}
+
+		// One thread pools the sums while the rest wait to see the result
+		if (pthread_barrier_wait(&e->barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+			walk_update(e);
+		pthread_barrier_wait(&e->barrier);
+	}
+	return NULL;
+}